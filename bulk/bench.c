@@ -0,0 +1,136 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include "bench.h"
+#include "sys.h"
+
+static void printHeader(BenchFormat format, FILE *out) {
+	if ( format == BENCH_JSON ) {
+		fprintf(out, "[\n");
+	} else {
+		fprintf(out, "direction,transfer_size,queue_depth,in_flight,bytes,transfers,seconds,mb_per_s,p50_us,p99_us,p999_us,max_us,cpu_percent,stalls\n");
+	}
+}
+
+static void printRow(
+	BenchFormat format, FILE *out, bool first, bool isIn, const StreamConfig *config,
+	uint32 inFlight, const StreamStats *stats, const uint32 *sorted, uint32 count, double cpuPercent)
+{
+	const double seconds = (double)(stats->endTime - stats->startTime) / 1000000.0;
+	const double speed = seconds > 0.0 ? (double)stats->numBytes / (1024*1024*seconds) : 0.0;
+	const uint32 p50 = sysPercentile(sorted, count, 0.50);
+	const uint32 p99 = sysPercentile(sorted, count, 0.99);
+	const uint32 p999 = sysPercentile(sorted, count, 0.999);
+	const uint32 max = count ? sorted[count - 1] : 0;
+	if ( format == BENCH_JSON ) {
+		fprintf(
+			out,
+			"%s  {\"direction\": \"%s\", \"transfer_size\": %lu, \"queue_depth\": %lu, \"in_flight\": %lu, "
+			"\"bytes\": %lld, \"transfers\": %lld, \"seconds\": %f, \"mb_per_s\": %f, \"p50_us\": %lu, "
+			"\"p99_us\": %lu, \"p999_us\": %lu, \"max_us\": %lu, \"cpu_percent\": %f, \"stalls\": %lu}",
+			first ? "" : ",\n", isIn ? "in" : "out", config->transferSize, config->queueDepth,
+			inFlight, stats->numBytes, stats->numTransfers, seconds, speed, p50, p99, p999, max,
+			cpuPercent, stats->numStalls
+		);
+	} else {
+		fprintf(
+			out, "%s,%lu,%lu,%lu,%lld,%lld,%f,%f,%lu,%lu,%lu,%lu,%f,%lu\n",
+			isIn ? "in" : "out", config->transferSize, config->queueDepth,
+			inFlight, stats->numBytes, stats->numTransfers, seconds, speed, p50, p99, p999, max,
+			cpuPercent, stats->numStalls
+		);
+	}
+	fflush(out);
+}
+
+// Run the same stream once for every combination of transfer size and queue depth (unless one
+// or other is fixed), reporting throughput, the latency distribution of individual transfers
+// and the CPU cost of each. Where only one transfer can be in flight whatever the queue depth,
+// sweeping it would only measure buffering, so the depth stays at the configured one. OUT
+// sweeps send the whole file each time; IN sweeps read baseConfig->maxBytes each time, which
+// must therefore be set.
+//
+StreamStatus benchSweep(
+	FX2Session *session, int epNum, bool isIn, FILE *file,
+	const StreamConfig *baseConfig, uint32 fixedTransfer, uint32 fixedQueue,
+	BenchFormat format, FILE *out, StreamStats *stats)
+{
+	StreamStatus status = STREAM_SUCCESS;
+	StreamConfig config = *baseConfig;
+	long long totalBytes, wallTime, cpuTime;
+	uint32 count;
+	bool first = true;
+	if ( !fixedQueue && streamTransfersInFlight(session, epNum, isIn, BENCH_MAX_QUEUE) == 1 ) {
+		fixedQueue = baseConfig->queueDepth;
+		fprintf(
+			stderr, "Only one transfer can be in flight here, so sweeping transfer sizes only, with a queue of %lu buffers\n",
+			fixedQueue);
+	}
+	if ( isIn ) {
+		totalBytes = baseConfig->maxBytes;
+	} else {
+		fseek(file, 0, SEEK_END);
+		totalBytes = ftell(file);
+	}
+	printHeader(format, out);
+	for ( config.transferSize = fixedTransfer ? fixedTransfer : BENCH_MIN_TRANSFER;
+	      config.transferSize <= (fixedTransfer ? fixedTransfer : BENCH_MAX_TRANSFER);
+	      config.transferSize *= 2 )
+	{
+		for ( config.queueDepth = fixedQueue ? fixedQueue : 1;
+		      config.queueDepth <= (fixedQueue ? fixedQueue : BENCH_MAX_QUEUE);
+		      config.queueDepth *= 2 )
+		{
+			config.maxLatencies = (uint32)(totalBytes / config.transferSize + 1);
+			config.latencies = (uint32 *)malloc(config.maxLatencies * sizeof(uint32));
+			if ( !config.latencies ) {
+				status = STREAM_NO_MEM;
+				goto exit;
+			}
+			if ( file != stdout ) {
+				fseek(file, 0, SEEK_SET);
+			}
+			wallTime = sysTimeMicros();
+			cpuTime = sysCpuMicros();
+			if ( isIn ) {
+				status = streamIn(session, epNum, file, &config, stats);
+			} else {
+				status = streamOut(session, epNum, file, &config, stats);
+			}
+			cpuTime = sysCpuMicros() - cpuTime;
+			wallTime = sysTimeMicros() - wallTime;
+			if ( status != STREAM_SUCCESS ) {
+				free(config.latencies);
+				goto exit;
+			}
+			count = stats->numTransfers < (long long)config.maxLatencies ? (uint32)stats->numTransfers : config.maxLatencies;
+			sysSortMicros(config.latencies, count);
+			printRow(
+				format, out, first, isIn, &config,
+				stats->maxInFlight, stats, config.latencies, count,
+				wallTime > 0 ? 100.0 * (double)cpuTime / (double)wallTime : 0.0
+			);
+			first = false;
+			free(config.latencies);
+		}
+	}
+exit:
+	if ( format == BENCH_JSON ) {
+		fprintf(out, "%s]\n", first ? "" : "\n");
+	}
+	return status;
+}
@@ -0,0 +1,49 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include "types.h"
+#include "stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	typedef enum {
+		BENCH_CSV,
+		BENCH_JSON
+	} BenchFormat;
+
+	// Transfer sizes and queue depths covered by a sweep, both stepping in powers of two
+	//
+	#define BENCH_MIN_TRANSFER 512UL
+	#define BENCH_MAX_TRANSFER (4UL*1024*1024)
+	#define BENCH_MAX_QUEUE 32UL
+
+	StreamStatus benchSweep(
+		FX2Session *session, int epNum, bool isIn, FILE *file,
+		const StreamConfig *baseConfig, uint32 fixedTransfer, uint32 fixedQueue,
+		BenchFormat format, FILE *out, StreamStats *stats
+	);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
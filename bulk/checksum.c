@@ -0,0 +1,212 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include "checksum.h"
+
+// On x86 we can use SSE2 (and with GCC, AVX2) to do the byte sum, and the SSE4.2 CRC32
+// instruction for CRC32C. Everything else gets the portable versions.
+//
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define CHECKSUM_X86
+	#define CHECKSUM_AVX2
+	#define TARGET(x) __attribute__((target(x)))
+	#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	#define CHECKSUM_X86
+	#define TARGET(x)
+	#include <intrin.h>
+	#include <emmintrin.h>
+	#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78UL  // Castagnoli, bit-reversed
+
+typedef uint16 (*Sum16Func)(uint16 sum, const uint8 *data, uint32 length);
+typedef uint32 (*Crc32cFunc)(uint32 crc, const uint8 *data, uint32 length);
+
+static Sum16Func sum16Impl = NULL;
+static Crc32cFunc crc32cImpl = NULL;
+static const char *sum16Name = "scalar";
+static const char *crc32cName = "slicing-by-8";
+static uint32 crcTable[8][256];
+
+// Portable implementations
+//
+static uint16 sum16Scalar(uint16 sum, const uint8 *data, uint32 length) {
+	uint32 acc = 0;
+	while ( length-- ) {
+		acc += *data++;
+	}
+	return (uint16)(sum + acc);
+}
+
+// Slicing-by-8: eight table lookups per eight bytes rather than one per byte.
+//
+static uint32 crc32cScalar(uint32 crc, const uint8 *data, uint32 length) {
+	crc = ~crc & 0xFFFFFFFFUL;
+	while ( length >= 8 ) {
+		const uint32 lo = crc ^ (data[0] | (data[1] << 8) | ((uint32)data[2] << 16) | ((uint32)data[3] << 24));
+		crc =
+			crcTable[7][lo & 0xFF] ^ crcTable[6][(lo >> 8) & 0xFF] ^
+			crcTable[5][(lo >> 16) & 0xFF] ^ crcTable[4][lo >> 24] ^
+			crcTable[3][data[4]] ^ crcTable[2][data[5]] ^
+			crcTable[1][data[6]] ^ crcTable[0][data[7]];
+		data += 8;
+		length -= 8;
+	}
+	while ( length-- ) {
+		crc = crcTable[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc & 0xFFFFFFFFUL;
+}
+
+#ifdef CHECKSUM_X86
+// PSADBW against zero sums each group of eight bytes into a 64-bit lane, so there is no risk of
+// the accumulators overflowing however long the buffer is.
+//
+TARGET("sse2") static uint16 sum16Sse2(uint16 sum, const uint8 *data, uint32 length) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = _mm_setzero_si128();
+	unsigned long long lanes[2];
+	while ( length >= 16 ) {
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)data), zero));
+		data += 16;
+		length -= 16;
+	}
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	sum = (uint16)(sum + lanes[0] + lanes[1]);
+	return sum16Scalar(sum, data, length);
+}
+
+// CRC32 instruction: eight bytes per instruction on x64, four on x86.
+//
+TARGET("sse4.2") static uint32 crc32cSse42(uint32 crc, const uint8 *data, uint32 length) {
+	#if defined(__x86_64__) || defined(_M_X64)
+		unsigned long long crc64 = ~crc & 0xFFFFFFFFUL;
+		unsigned long long word;
+		while ( length >= 8 ) {
+			memcpy(&word, data, 8);
+			crc64 = _mm_crc32_u64(crc64, word);
+			data += 8;
+			length -= 8;
+		}
+		crc = (uint32)crc64;
+	#else
+		unsigned int word;
+		crc = ~crc & 0xFFFFFFFFUL;
+		while ( length >= 4 ) {
+			memcpy(&word, data, 4);
+			crc = _mm_crc32_u32(crc, word);
+			data += 4;
+			length -= 4;
+		}
+	#endif
+	while ( length-- ) {
+		crc = _mm_crc32_u8(crc, *data++);
+	}
+	return ~crc & 0xFFFFFFFFUL;
+}
+#endif
+
+#ifdef CHECKSUM_AVX2
+TARGET("avx2") static uint16 sum16Avx2(uint16 sum, const uint8 *data, uint32 length) {
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = _mm256_setzero_si256();
+	unsigned long long lanes[4];
+	while ( length >= 32 ) {
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)data), zero));
+		data += 32;
+		length -= 32;
+	}
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	sum = (uint16)(sum + lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+	return sum16Scalar(sum, data, length);
+}
+#endif
+
+// Build the slicing tables and choose implementations based on what the CPU can do.
+//
+void checksumInitialise(void) {
+	uint32 i, j, crc;
+	if ( sum16Impl ) {
+		return;
+	}
+	for ( i = 0; i < 256; i++ ) {
+		crc = i;
+		for ( j = 0; j < 8; j++ ) {
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crcTable[0][i] = crc;
+	}
+	for ( i = 0; i < 256; i++ ) {
+		for ( j = 1; j < 8; j++ ) {
+			crcTable[j][i] = crcTable[0][crcTable[j-1][i] & 0xFF] ^ (crcTable[j-1][i] >> 8);
+		}
+	}
+	crc32cImpl = crc32cScalar;
+	sum16Impl = sum16Scalar;
+	#if defined(CHECKSUM_X86) && defined(__GNUC__)
+		__builtin_cpu_init();
+		if ( __builtin_cpu_supports("sse2") ) {
+			sum16Impl = sum16Sse2;
+			sum16Name = "sse2";
+		}
+		if ( __builtin_cpu_supports("avx2") ) {
+			sum16Impl = sum16Avx2;
+			sum16Name = "avx2";
+		}
+		if ( __builtin_cpu_supports("sse4.2") ) {
+			crc32cImpl = crc32cSse42;
+			crc32cName = "sse4.2";
+		}
+	#elif defined(CHECKSUM_X86)
+		{
+			int info[4];
+			__cpuid(info, 1);
+			if ( info[3] & (1<<26) ) {
+				sum16Impl = sum16Sse2;
+				sum16Name = "sse2";
+			}
+			if ( info[2] & (1<<20) ) {
+				crc32cImpl = crc32cSse42;
+				crc32cName = "sse4.2";
+			}
+		}
+	#endif
+}
+
+// Name the implementations chosen for this CPU, for the benchmark report.
+//
+const char *checksumSum16Implementation(void) {
+	checksumInitialise();
+	return sum16Name;
+}
+
+const char *checksumCrc32cImplementation(void) {
+	checksumInitialise();
+	return crc32cName;
+}
+
+uint16 checksumSum16(uint16 sum, const uint8 *data, uint32 length) {
+	checksumInitialise();
+	return sum16Impl(sum, data, length);
+}
+
+uint32 checksumCrc32c(uint32 crc, const uint8 *data, uint32 length) {
+	checksumInitialise();
+	return crc32cImpl(crc, data, length);
+}
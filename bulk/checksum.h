@@ -0,0 +1,40 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// Both functions are incremental: pass the result of the previous call (or zero to start).
+	// The first call to either picks the fastest implementation the CPU supports, so call
+	// checksumInitialise() before sharing them between threads.
+	//
+	void checksumInitialise(void);
+	const char *checksumSum16Implementation(void);
+	const char *checksumCrc32cImplementation(void);
+	uint16 checksumSum16(uint16 sum, const uint8 *data, uint32 length);
+	uint32 checksumCrc32c(uint32 crc, const uint8 *data, uint32 length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -14,51 +14,66 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <stdlib.h>
+#include <string.h>
 #include "usbwrap.h"
+#include "fx2loader.h"
 #include "argtable2.h"
 #include "arg_uint.h"
 #include "dump.h"
+#include "stream.h"
+#include "bench.h"
+#include "checksum.h"
 #ifdef WIN32
 #include <Windows.h>
-#else
-#include <sys/time.h>
+#include <fcntl.h>
+#include <io.h>
 #endif
 
 #define VID 0x1443
 #define PID 0x0005
+#define TRANSFER_SIZE 65536
+#define QUEUE_DEPTH 8
 
 int main(int argc, char *argv[]) {
 
 	struct arg_uint *vidOpt  = arg_uint0("v", "vid", "<vendorID>", "  vendor ID");
 	struct arg_uint *pidOpt  = arg_uint0("p", "pid", "<productID>", " product ID");
-	struct arg_int  *epOpt   = arg_int0("e", "endpoint", "<N>", "    endpoint to write to");
+	struct arg_str  *devOpt  = arg_str0("d", "device", "<bus:addr>", "  device location, or \"mock\" for a simulated device (overrides VID/PID)");
+	struct arg_int  *epOpt   = arg_int0("e", "endpoint", "<N>", "    endpoint to use (default 6 for OUT, 8 for IN)");
+	struct arg_lit  *inOpt   = arg_lit0("i", "in", "              read from an IN endpoint into the file (\"-\" for stdout)");
+	struct arg_str  *numOpt  = arg_str0("n", "count", "<bytes>", "   with -i, stop after this many bytes (default: until the device stops)");
+	struct arg_lit  *dropOpt = arg_lit0(NULL, "drop", "             with -i, discard data rather than stall if the disk falls behind");
+	struct arg_uint *xferOpt = arg_uint0("t", "transfer", "<bytes>", " bytes per bulk transfer (default 65536)");
+	struct arg_uint *qdOpt   = arg_uint0("q", "queue", "<N>", "       number of transfers to queue (default 8)");
 	struct arg_lit  *benOpt  = arg_lit0("b", "benchmark", "       benchmark the operation");
+	struct arg_lit  *swpOpt  = arg_lit0("s", "sweep", "           benchmark over a range of transfer sizes and queue depths");
+	struct arg_str  *fmtOpt  = arg_str0(NULL, "format", "<csv|json>", " output format for --sweep (default csv)");
 	struct arg_lit  *chkOpt  = arg_lit0("c", "checksum", "        print 16-bit checksum");
+	struct arg_lit  *crcOpt  = arg_lit0(NULL, "crc", "              print CRC32C");
 	struct arg_lit  *helpOpt = arg_lit0("h", "help", "            print this help and exit\n");
-	struct arg_file *fileOpt = arg_file1(NULL, NULL, "<fileName>", "            the data to send");
+	struct arg_file *fileOpt = arg_file1(NULL, NULL, "<fileName>", "            the data to send (or the file to receive into with -i)");
 	struct arg_end  *endOpt  = arg_end(20);
-	void* argTable[] = {vidOpt, pidOpt, epOpt, benOpt, chkOpt, helpOpt, fileOpt, endOpt};
+	void* argTable[] = {vidOpt, pidOpt, devOpt, epOpt, inOpt, numOpt, dropOpt, xferOpt, qdOpt, benOpt, swpOpt, fmtOpt, chkOpt, crcOpt, helpOpt, fileOpt, endOpt};
 	const char *progName = "bulk";
 	uint32 exitCode = 0;
 	int numErrors;
-	int epNum = 0x06;
-	FILE *inFile = NULL;
-	uint8 *buffer = NULL;
-	uint32 fileLen;
-	UsbDeviceHandle *deviceHandle = NULL;
-	int returnCode;
+	int epNum;
+	bool isIn;
+	FILE *file = NULL;
+	FILE *report = stdout;
+	FX2Session *session = NULL;
+	FX2Status fStatus;
 	double totalTime, speed;
 	uint16 vid, pid;
-	unsigned short checksum = 0x0000;
 	uint32 i;
+	StreamConfig config;
+	StreamStats stats;
+	StreamStatus sStatus;
+	BenchFormat format = BENCH_CSV;
 	#ifdef WIN32
-		LARGE_INTEGER tvStart, tvEnd, freq;
 		DWORD_PTR mask = 1;
 		SetThreadAffinityMask(GetCurrentThread(), mask);
-		QueryPerformanceFrequency(&freq);
-	#else
-		struct timeval tvStart, tvEnd;
-		long long startTime, endTime;
 	#endif
 
 	if ( arg_nullcheck(argTable) != 0 ) {
@@ -70,9 +85,9 @@ int main(int argc, char *argv[]) {
 	numErrors = arg_parse(argc, argv, argTable);
 
 	if ( helpOpt->count > 0 ) {
-		printf("Bulk Write Tool Copyright (C) 2009-2010 Chris McClelland\n\nUsage: %s", progName);
+		printf("Bulk Transfer Tool Copyright (C) 2009-2010 Chris McClelland\n\nUsage: %s", progName);
 		arg_print_syntax(stdout, argTable, "\n");
-		printf("\nWrite data to a bulk endpoint.\n\n");
+		printf("\nWrite data to (or read data from) a bulk endpoint.\n\n");
 		arg_print_glossary(stdout, argTable,"  %-10s %s\n");
 		exitCode = 0;
 		goto cleanup;
@@ -87,94 +102,146 @@ int main(int argc, char *argv[]) {
 
 	vid = vidOpt->count ? (uint16)vidOpt->ival[0] : VID;
 	pid = pidOpt->count ? (uint16)pidOpt->ival[0] : PID;
-
-	inFile = fopen(fileOpt->filename[0], "rb");
-	if ( !inFile ) {
-		fprintf(stderr, "Unable to open file %s", fileOpt->filename[0]);
-		exitCode = 3;
+	isIn = inOpt->count ? true : false;
+	epNum = epOpt->count ? epOpt->ival[0] : (isIn ? 0x08 : 0x06);
+	config.transferSize = xferOpt->count ? xferOpt->ival[0] : TRANSFER_SIZE;
+	config.queueDepth = qdOpt->count ? qdOpt->ival[0] : QUEUE_DEPTH;
+	config.timeout = 5000;
+	config.maxBytes = numOpt->count ? (long long)strtoull(numOpt->sval[0], NULL, 0) : 0;
+	config.dropWhenFull = dropOpt->count ? true : false;
+	config.wantChecksum = chkOpt->count ? true : false;
+	config.wantCrc32c = crcOpt->count ? true : false;
+	config.latencies = NULL;
+	config.maxLatencies = 0;
+	if ( config.transferSize == 0 || config.queueDepth == 0 ) {
+		fprintf(stderr, "The transfer size and queue depth must both be nonzero\n");
+		exitCode = 4;
 		goto cleanup;
 	}
-	fseek(inFile, 0, SEEK_END);
-	fileLen = ftell(inFile);
-	fseek(inFile, 0, SEEK_SET);
-
-	buffer = (uint8 *)malloc(fileLen);
-	if ( !buffer ) {
-		fprintf(stderr, "Unable to allocate memory for file %s\n", fileOpt->filename[0]);
+	if ( !isIn && (numOpt->count || dropOpt->count) ) {
+		fprintf(stderr, "The -n and --drop options only make sense with -i\n");
 		exitCode = 4;
 		goto cleanup;
 	}
 
-	if ( fread(buffer, 1, fileLen, inFile) != fileLen ) {
-		fprintf(stderr, "Unable to read file %s\n", fileOpt->filename[0]);
-		exitCode = 5;
+	if ( fmtOpt->count ) {
+		if ( !strcmp(fmtOpt->sval[0], "json") ) {
+			format = BENCH_JSON;
+		} else if ( strcmp(fmtOpt->sval[0], "csv") ) {
+			fprintf(stderr, "Unrecognised format: %s\n", fmtOpt->sval[0]);
+			exitCode = 4;
+			goto cleanup;
+		}
+	}
+	if ( swpOpt->count && isIn && !config.maxBytes ) {
+		fprintf(stderr, "An IN sweep needs a byte count (-n) for each run\n");
+		exitCode = 4;
 		goto cleanup;
 	}
 
-	if ( chkOpt->count ) {
-		for ( i = 0; i < fileLen; i++  ) {
-			checksum += buffer[i];
+	if ( isIn && !strcmp(fileOpt->filename[0], "-") ) {
+		#ifdef WIN32
+			_setmode(_fileno(stdout), O_BINARY);
+		#endif
+		file = stdout;
+		report = stderr;
+	} else {
+		file = fopen(fileOpt->filename[0], isIn ? "wb" : "rb");
+		if ( !file ) {
+			fprintf(stderr, "Unable to open file %s\n", fileOpt->filename[0]);
+			exitCode = 3;
+			goto cleanup;
 		}
-		printf("Checksum: 0x%04X\n", checksum);
-	}
-
-	if ( epOpt->count ) {
-		epNum = epOpt->ival[0];
 	}
 
-	usbInitialise();
-	returnCode = usbOpenDevice(vid, pid, 1, 0, 0, &deviceHandle);
-	if ( returnCode ) {
-		fprintf(stderr, "usbOpenDevice() failed returnCode %d: %s\n", returnCode, usbStrError());
+	fStatus = devOpt->count ?
+		fx2OpenSessionPath(devOpt->sval[0], &session) :
+		fx2OpenSession(vid, pid, &session);
+	if ( fStatus ) {
+		fprintf(stderr, "%s", fx2StrError());
 		exitCode = 6;
 		goto cleanup;
 	}
-	usb_clear_halt(deviceHandle, epNum);
-	#ifdef WIN32
-		QueryPerformanceCounter(&tvStart);
-		returnCode = usb_bulk_write(deviceHandle, USB_ENDPOINT_OUT | epNum, (char*)buffer, fileLen, 5000);
-		QueryPerformanceCounter(&tvEnd);
-	#else
-		gettimeofday(&tvStart, NULL);
-		returnCode = usb_bulk_write(deviceHandle, USB_ENDPOINT_OUT | epNum, (char*)buffer, fileLen, 5000);
-		gettimeofday(&tvEnd, NULL);
-	#endif
-	if ( returnCode != (int)fileLen ) {
-		printf("Expected to write %lu bytes but actually wrote %d: %s\n", fileLen, returnCode, usb_strerror());
+	fx2SessionClearHalt(session, (uint8)(isIn ? (USB_ENDPOINT_IN | epNum) : epNum));
+
+	if ( swpOpt->count ) {
+		sStatus = benchSweep(
+			session, epNum, isIn, file, &config,
+			xferOpt->count ? config.transferSize : 0, qdOpt->count ? config.queueDepth : 0,
+			format, report, &stats
+		);
+	} else if ( isIn ) {
+		sStatus = streamIn(session, epNum, file, &config, &stats);
+	} else {
+		sStatus = streamOut(session, epNum, file, &config, &stats);
+	}
+	if ( sStatus == STREAM_USB_ERR ) {
+		fprintf(stderr, "Transferred %lld bytes before a transfer failed with returnCode %d: %s\n", stats.numBytes, stats.returnCode, fx2SessionStrUsbError(session, stats.returnCode));
 		exitCode = 7;
 		goto cleanup;
+	} else if ( sStatus == STREAM_FILE_ERR ) {
+		fprintf(stderr, "Unable to %s file %s\n", isIn ? "write" : "read", fileOpt->filename[0]);
+		exitCode = 5;
+		goto cleanup;
+	} else if ( sStatus == STREAM_NO_MEM ) {
+		fprintf(stderr, "Unable to allocate %lu transfer buffers of %lu bytes\n", config.queueDepth, config.transferSize);
+		exitCode = 4;
+		goto cleanup;
+	} else if ( sStatus != STREAM_SUCCESS ) {
+		fprintf(stderr, "Unable to start the file I/O thread\n");
+		exitCode = 8;
+		goto cleanup;
+	}
+
+	if ( swpOpt->count ) {
+		goto cleanup;
+	}
+	if ( chkOpt->count ) {
+		fprintf(report, "Checksum: 0x%04X\n", stats.checksum);
+	}
+	if ( crcOpt->count ) {
+		fprintf(report, "CRC32C: 0x%08lX\n", stats.crc32c);
 	}
-	#ifdef WIN32
-		totalTime = (double)(tvEnd.QuadPart - tvStart.QuadPart);
-		totalTime /= freq.QuadPart;
-		printf("Time: %fms\n", totalTime/1000.0);
-		speed = (double)fileLen / (1024*1024*totalTime);
-	#else
-		startTime = tvStart.tv_sec;
-		startTime *= 1000000;
-		startTime += tvStart.tv_usec;
-		endTime = tvEnd.tv_sec;
-		endTime *= 1000000;
-		endTime += tvEnd.tv_usec;
-		totalTime = endTime - startTime;
-		totalTime /= 1000000;  // convert from uS to S.
-		speed = (double)fileLen / (1024*1024*totalTime);
-	#endif
 	if ( benOpt->count ) {
-		printf("Speed: %f MB/s\n", speed);
+		totalTime = (double)(stats.endTime - stats.startTime);
+		totalTime /= 1000000;  // convert from uS to S.
+		speed = (double)stats.numBytes / (1024*1024*totalTime);
+		fprintf(report, "Speed: %f MB/s\n", speed);
+		if ( chkOpt->count ) {
+			fprintf(report, "Checksum implementation: %s\n", checksumSum16Implementation());
+		}
+		if ( crcOpt->count ) {
+			fprintf(report, "CRC32C implementation: %s\n", checksumCrc32cImplementation());
+		}
+	}
+	if ( isIn && (stats.numStalls || stats.numDrops) ) {
+		fprintf(
+			report, "Disk fell behind: %lu stalls totalling %f ms; %lu drops totalling %lld bytes\n",
+			stats.numStalls, (double)stats.stallMicros / 1000.0, stats.numDrops, stats.droppedBytes
+		);
+		for ( i = 0; i < stats.numEvents; i++ ) {
+			fprintf(
+				report, "  %s at offset 0x%llX for %f ms",
+				stats.events[i].numBytes ? "Dropped" : "Stalled",
+				(unsigned long long)stats.events[i].offset,
+				(double)stats.events[i].micros / 1000.0
+			);
+			if ( stats.events[i].numBytes ) {
+				fprintf(report, " (%lld bytes)\n", stats.events[i].numBytes);
+			} else {
+				fprintf(report, "\n");
+			}
+		}
+		if ( stats.numStalls + stats.numDrops > stats.numEvents ) {
+			fprintf(report, "  ...\n");
+		}
 	}
 
 cleanup:
-	if ( buffer ) {
-		free(buffer);
-	}
-	if ( inFile ) {
-		fclose(inFile);
-	}
-	if ( deviceHandle ) {
-		usb_release_interface(deviceHandle, 0);
-		usb_close(deviceHandle);
+	if ( file && file != stdout ) {
+		fclose(file);
 	}
+	fx2CloseSession(session);
 	arg_freetable(argTable, sizeof(argTable)/sizeof(argTable[0]));
 
 	return exitCode;
@@ -0,0 +1,136 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include "ring.h"
+#include "sys.h"
+
+// Spin politely for a while before sleeping, so a ring which is briefly full or empty costs little
+// latency, but one which stays that way (e.g a slow disk) doesn't burn a whole CPU.
+//
+#define SPIN_COUNT 64
+#define SLEEP_MICROS 100
+
+static void backOff(uint32 *spins) {
+	if ( *spins < SPIN_COUNT ) {
+		(*spins)++;
+		sysYield();
+	} else {
+		sysSleepMicros(SLEEP_MICROS);
+	}
+}
+
+int ringInitialise(Ring *self, uint32 numBlocks, uint32 blockSize) {
+	self->data = (uint8 *)malloc(numBlocks * blockSize);
+	self->lengths = (uint32 *)malloc(numBlocks * sizeof(uint32));
+	if ( !self->data || !self->lengths ) {
+		free(self->data);
+		free(self->lengths);
+		return -1;
+	}
+	self->blockSize = blockSize;
+	self->numBlocks = numBlocks;
+	self->head = 0;
+	self->tail = 0;
+	self->finished = false;
+	self->aborted = false;
+	return 0;
+}
+
+void ringDestroy(Ring *self) {
+	free(self->data);
+	free(self->lengths);
+	self->data = NULL;
+	self->lengths = NULL;
+}
+
+// Wait for the index'th uncommitted block to be free and return a pointer to it, or NULL if the
+// consumer has aborted. The producer may fill blocks ahead of the head like this, but commits them
+// strictly in order.
+//
+uint8 *ringWriteBlock(Ring *self, uint32 index) {
+	uint32 spins = 0;
+	while ( self->head + index - self->tail >= self->numBlocks ) {
+		if ( self->aborted ) {
+			return NULL;
+		}
+		backOff(&spins);
+	}
+	sysMemoryBarrier();
+	return self->aborted ? NULL : self->data + ((self->head + index) % self->numBlocks) * self->blockSize;
+}
+
+// The same, but return NULL rather than wait if the block isn't free yet (or the consumer has
+// aborted), so the producer can decide what to do about a slow consumer.
+//
+uint8 *ringTryWriteBlock(Ring *self, uint32 index) {
+	if ( self->aborted || self->head + index - self->tail >= self->numBlocks ) {
+		return NULL;
+	}
+	sysMemoryBarrier();
+	return self->data + ((self->head + index) % self->numBlocks) * self->blockSize;
+}
+
+// Publish the oldest uncommitted block.
+//
+void ringWriteCommit(Ring *self, uint32 length) {
+	self->lengths[self->head % self->numBlocks] = length;
+	sysMemoryBarrier();
+	self->head++;
+}
+
+// Tell the consumer there are no more blocks to come.
+//
+void ringWriteFinish(Ring *self) {
+	sysMemoryBarrier();
+	self->finished = true;
+}
+
+// Wait for the index'th unreleased block to be committed and return it, or NULL if the producer
+// finished (or the consumer aborted) before committing it.
+//
+uint8 *ringReadBlock(Ring *self, uint32 index, uint32 *length) {
+	uint32 spins = 0;
+	uint32 slot;
+	while ( self->head - self->tail <= index ) {
+		if ( self->finished ) {
+			sysMemoryBarrier();
+			if ( self->head - self->tail <= index ) {
+				return NULL;
+			}
+			break;
+		}
+		if ( self->aborted ) {
+			return NULL;
+		}
+		backOff(&spins);
+	}
+	sysMemoryBarrier();
+	slot = (self->tail + index) % self->numBlocks;
+	*length = self->lengths[slot];
+	return self->data + slot * self->blockSize;
+}
+
+// Hand the oldest block back to the producer.
+//
+void ringReadRelease(Ring *self) {
+	sysMemoryBarrier();
+	self->tail++;
+}
+
+void ringAbort(Ring *self) {
+	self->aborted = true;
+}
@@ -0,0 +1,59 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RING_H
+#define RING_H
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// A single-producer, single-consumer ring of fixed-size blocks. The producer may fill any free
+	// block, but commits them strictly in order; the consumer may look ahead at any committed block,
+	// but releases them strictly in order. No locks: each index is only ever written by one side.
+	//
+	typedef struct {
+		uint8 *data;
+		uint32 *lengths;
+		uint32 blockSize;
+		uint32 numBlocks;
+		volatile uint32 head;      // number of blocks committed by the producer
+		volatile uint32 tail;      // number of blocks released by the consumer
+		volatile bool finished;    // producer has committed its last block
+		volatile bool aborted;     // consumer has given up
+	} Ring;
+
+	int ringInitialise(Ring *self, uint32 numBlocks, uint32 blockSize);
+	void ringDestroy(Ring *self);
+
+	// Producer side
+	uint8 *ringWriteBlock(Ring *self, uint32 index);
+	uint8 *ringTryWriteBlock(Ring *self, uint32 index);
+	void ringWriteCommit(Ring *self, uint32 length);
+	void ringWriteFinish(Ring *self);
+
+	// Consumer side
+	uint8 *ringReadBlock(Ring *self, uint32 index, uint32 *length);
+	void ringReadRelease(Ring *self);
+	void ringAbort(Ring *self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,447 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include "usbwrap.h"
+#include "stream.h"
+#include "ring.h"
+#include "sys.h"
+#include "checksum.h"
+
+// If the caller asked for them, record per-transfer latencies (submission to completion).
+//
+static void recordLatency(const StreamConfig *config, StreamStats *stats, long long micros) {
+	if ( config->latencies && stats->numTransfers < (long long)config->maxLatencies ) {
+		config->latencies[stats->numTransfers] = (uint32)micros;
+	}
+}
+
+// Integrity checks are done a block at a time by the file I/O thread, so they overlap with the USB
+// transfers rather than adding to the total time.
+//
+typedef struct {
+	uint16 checksum;
+	uint32 crc32c;
+} Checks;
+
+static void updateChecks(const StreamConfig *config, Checks *checks, const uint8 *block, uint32 length) {
+	if ( config->wantChecksum ) {
+		checks->checksum = checksumSum16(checks->checksum, block, length);
+	}
+	if ( config->wantCrc32c ) {
+		checks->crc32c = checksumCrc32c(checks->crc32c, block, length);
+	}
+}
+
+// State shared between the file reader thread and the USB side.
+//
+typedef struct {
+	Ring ring;
+	FILE *file;
+	const StreamConfig *config;
+	Checks checks;
+	bool fileError;
+} OutContext;
+
+// Producer: read the file into ring blocks until EOF, so the next few blocks are always ready to
+// go by the time the USB side wants them.
+//
+static void fileReader(void *arg) {
+	OutContext *ctx = (OutContext *)arg;
+	const uint32 blockSize = ctx->ring.blockSize;
+	uint8 *block;
+	size_t bytesRead;
+	while ( (block = ringWriteBlock(&ctx->ring, 0)) != NULL ) {
+		bytesRead = fread(block, 1, blockSize, ctx->file);
+		if ( bytesRead ) {
+			// Only this thread ever writes to the block, so it's safe to carry on reading it
+			// after it has been handed over to the USB side.
+			//
+			ringWriteCommit(&ctx->ring, (uint32)bytesRead);
+			updateChecks(ctx->config, &ctx->checks, block, (uint32)bytesRead);
+		}
+		if ( bytesRead != blockSize ) {
+			ctx->fileError = ferror(ctx->file) ? true : false;
+			break;
+		}
+	}
+	ringWriteFinish(&ctx->ring);
+}
+
+// Consumer: keep up to queueDepth transfers queued on the endpoint, submitting each ring block as
+// soon as the reader has filled it and handing it back once its transfer has completed.
+//
+static StreamStatus usbWriter(
+	FX2Session *session, int epNum, OutContext *ctx, const StreamConfig *config,
+	StreamStats *stats)
+{
+	StreamStatus status = STREAM_SUCCESS;
+	FX2BulkQueue *queue;
+	long long *submitTimes;
+	uint32 length, pending, inFlight, oldest = 0;
+	uint8 *block;
+	int returnCode;
+	submitTimes = (long long *)calloc(config->queueDepth, sizeof(long long));
+	if ( !submitTimes ) {
+		return STREAM_NO_MEM;
+	}
+	if ( fx2BulkQueueOpen(session, (uint8)(USB_ENDPOINT_OUT | epNum), config->queueDepth, &queue) ) {
+		free(submitTimes);
+		return STREAM_NO_MEM;
+	}
+	inFlight = fx2BulkQueueInFlight(queue);
+	for ( ;; ) {
+		// Top up the queue with whatever the reader has ready...
+		//
+		while ( (pending = fx2BulkQueuePending(queue)) < config->queueDepth &&
+		        (block = ringReadBlock(&ctx->ring, pending, &length)) != NULL )
+		{
+			submitTimes[(oldest + pending) % config->queueDepth] = sysTimeMicros();
+			if ( stats->numTransfers == 0 && pending == 0 ) {
+				stats->startTime = submitTimes[oldest];
+			}
+			returnCode = fx2BulkQueueSubmit(queue, block, length);
+			if ( returnCode < 0 ) {
+				stats->returnCode = returnCode;
+				status = STREAM_USB_ERR;
+				goto cleanup;
+			}
+			if ( pending < inFlight && pending + 1 > stats->maxInFlight ) {
+				stats->maxInFlight = pending + 1;
+			}
+		}
+		if ( pending == 0 ) {
+			break;
+		}
+
+		// ...then wait for the oldest one to complete.
+		//
+		ringReadBlock(&ctx->ring, 0, &length);
+		returnCode = fx2BulkQueueReap(queue, config->timeout);
+		if ( returnCode != (int)length ) {
+			stats->returnCode = returnCode;
+			status = STREAM_USB_ERR;
+			goto cleanup;
+		}
+		stats->endTime = sysTimeMicros();
+		recordLatency(config, stats, stats->endTime - submitTimes[oldest]);
+		stats->numBytes += length;
+		stats->numTransfers++;
+		ringReadRelease(&ctx->ring);
+		oldest = (oldest + 1) % config->queueDepth;
+	}
+cleanup:
+	fx2BulkQueueClose(queue);
+	free(submitTimes);
+	return status;
+}
+
+// How many transfers a stream in the given direction can really have in flight at once with the
+// given queue depth: all of them if the session can queue bulk transfers, otherwise just one.
+//
+uint32 streamTransfersInFlight(FX2Session *session, int epNum, bool isIn, uint32 queueDepth) {
+	const uint8 ep = (uint8)((isIn ? USB_ENDPOINT_IN : USB_ENDPOINT_OUT) | epNum);
+	FX2BulkQueue *queue;
+	uint32 inFlight = 1;
+	if ( !fx2BulkQueueOpen(session, ep, queueDepth, &queue) ) {
+		inFlight = fx2BulkQueueInFlight(queue);
+		fx2BulkQueueClose(queue);
+	}
+	return inFlight;
+}
+
+static void initStats(StreamStats *stats) {
+	stats->numBytes = 0;
+	stats->numTransfers = 0;
+	stats->maxInFlight = 1;
+	stats->startTime = stats->endTime = sysTimeMicros();
+	stats->checksum = 0x0000;
+	stats->crc32c = 0x00000000;
+	stats->returnCode = 0;
+	stats->numStalls = 0;
+	stats->numDrops = 0;
+	stats->stallMicros = 0;
+	stats->droppedBytes = 0;
+	stats->numEvents = 0;
+}
+
+// Stream the whole of inFile to the given OUT endpoint, using constant memory (transferSize *
+// queueDepth bytes) however big the file is.
+//
+StreamStatus streamOut(
+	FX2Session *session, int epNum, FILE *inFile,
+	const StreamConfig *config, StreamStats *stats)
+{
+	StreamStatus status;
+	OutContext ctx;
+	SysThread *reader;
+	initStats(stats);
+	ctx.file = inFile;
+	ctx.config = config;
+	ctx.checks.checksum = 0x0000;
+	ctx.checks.crc32c = 0x00000000;
+	ctx.fileError = false;
+	checksumInitialise();
+	if ( ringInitialise(&ctx.ring, config->queueDepth, config->transferSize) ) {
+		return STREAM_NO_MEM;
+	}
+	if ( sysThreadCreate(&reader, fileReader, &ctx) ) {
+		ringDestroy(&ctx.ring);
+		return STREAM_THREAD_ERR;
+	}
+	status = usbWriter(session, epNum, &ctx, config, stats);
+	if ( status != STREAM_SUCCESS ) {
+		ringAbort(&ctx.ring);
+	}
+	sysThreadJoin(reader);
+	ringDestroy(&ctx.ring);
+	stats->checksum = ctx.checks.checksum;
+	stats->crc32c = ctx.checks.crc32c;
+	if ( status == STREAM_SUCCESS && ctx.fileError ) {
+		status = STREAM_FILE_ERR;
+	}
+	return status;
+}
+
+// State shared between the USB side and the file writer thread.
+//
+typedef struct {
+	Ring ring;
+	FILE *file;
+	const StreamConfig *config;
+	Checks checks;
+	bool fileError;
+} InContext;
+
+// Consumer: drain ring blocks to the file. This is the only thread which ever waits for the disk.
+//
+static void fileWriter(void *arg) {
+	InContext *ctx = (InContext *)arg;
+	uint8 *block;
+	uint32 length;
+	while ( (block = ringReadBlock(&ctx->ring, 0, &length)) != NULL ) {
+		if ( fwrite(block, 1, length, ctx->file) != length ) {
+			ctx->fileError = true;
+			ringAbort(&ctx->ring);
+			break;
+		}
+		updateChecks(ctx->config, &ctx->checks, block, length);
+		ringReadRelease(&ctx->ring);
+	}
+	fflush(ctx->file);
+}
+
+static void addEvent(StreamStats *stats, long long offset, long long micros, long long numBytes) {
+	if ( stats->numEvents < STREAM_MAX_EVENTS ) {
+		StreamEvent *event = stats->events + stats->numEvents++;
+		event->offset = offset;
+		event->micros = micros;
+		event->numBytes = numBytes;
+	}
+}
+
+// Where each posted IN transfer is going.
+//
+typedef struct {
+	bool isDrop;           // into this slot's scratch buffer rather than a reserved ring block
+	uint32 request;
+	long long submitTime;
+} InTransfer;
+
+// Read from the given IN endpoint into outFile, keeping up to queueDepth transfers posted at once,
+// each into a ring block reserved ahead of the head; as each one completes, its block is committed.
+// The USB side never touches the file: the writer thread drains committed blocks. If the disk falls
+// behind and the ring fills up, either wait for it once everything posted has completed (the device
+// then sees NAKs) or, if dropWhenFull is set, keep reading and throw the data away. Either way each
+// such interval is recorded in the stats.
+//
+StreamStatus streamIn(
+	FX2Session *session, int epNum, FILE *outFile,
+	const StreamConfig *config, StreamStats *stats)
+{
+	StreamStatus status = STREAM_SUCCESS;
+	InContext ctx;
+	SysThread *writer;
+	FX2BulkQueue *queue = NULL;
+	InTransfer *transfers = NULL, *transfer;
+	uint8 *block, *scratch = NULL;
+	uint32 request, pending, inFlight, reserved = 0, oldest = 0, dropsPending = 0;
+	bool dropEnding = false;
+	int returnCode;
+	long long now, bytesPosted = 0, dropStart = -1, dropOffset = 0, dropBytes = 0;
+	initStats(stats);
+	ctx.file = outFile;
+	ctx.config = config;
+	ctx.checks.checksum = 0x0000;
+	ctx.checks.crc32c = 0x00000000;
+	ctx.fileError = false;
+	checksumInitialise();
+	transfers = (InTransfer *)calloc(config->queueDepth, sizeof(InTransfer));
+	if ( config->dropWhenFull ) {
+		scratch = (uint8 *)malloc(config->queueDepth * config->transferSize);
+	}
+	if ( !transfers || (config->dropWhenFull && !scratch) ) {
+		free(scratch);
+		free(transfers);
+		return STREAM_NO_MEM;
+	}
+	if ( ringInitialise(&ctx.ring, config->queueDepth, config->transferSize) ) {
+		free(scratch);
+		free(transfers);
+		return STREAM_NO_MEM;
+	}
+	if ( fx2BulkQueueOpen(session, (uint8)(USB_ENDPOINT_IN | epNum), config->queueDepth, &queue) ) {
+		ringDestroy(&ctx.ring);
+		free(scratch);
+		free(transfers);
+		return STREAM_NO_MEM;
+	}
+	if ( sysThreadCreate(&writer, fileWriter, &ctx) ) {
+		fx2BulkQueueClose(queue);
+		ringDestroy(&ctx.ring);
+		free(scratch);
+		free(transfers);
+		return STREAM_THREAD_ERR;
+	}
+	inFlight = fx2BulkQueueInFlight(queue);
+	for ( ;; ) {
+		// Post as many transfers as there's room for...
+		//
+		while ( (pending = fx2BulkQueuePending(queue)) < config->queueDepth ) {
+			request = config->transferSize;
+			if ( config->maxBytes ) {
+				if ( bytesPosted >= config->maxBytes ) {
+					break;
+				}
+				if ( config->maxBytes - bytesPosted < (long long)request ) {
+					request = (uint32)(config->maxBytes - bytesPosted);
+				}
+			}
+			transfer = transfers + (oldest + pending) % config->queueDepth;
+
+			// Find somewhere to put it
+			//
+			block = ringTryWriteBlock(&ctx.ring, reserved);
+			transfer->isDrop = false;
+			if ( !block && ctx.ring.aborted ) {
+				status = STREAM_FILE_ERR;
+				goto done;
+			} else if ( !block && config->dropWhenFull ) {
+				if ( dropStart < 0 ) {
+					dropStart = sysTimeMicros();
+					dropOffset = bytesPosted;
+					dropBytes = 0;
+					stats->numDrops++;
+				}
+				dropEnding = false;
+				dropsPending++;
+				block = scratch + (transfer - transfers) * config->transferSize;
+				transfer->isDrop = true;
+			} else if ( !block && pending ) {
+				// The device still has work; see whether the disk catches up meanwhile
+				//
+				break;
+			} else if ( !block ) {
+				now = sysTimeMicros();
+				block = ringWriteBlock(&ctx.ring, 0);
+				now = sysTimeMicros() - now;
+				stats->numStalls++;
+				stats->stallMicros += now;
+				addEvent(stats, bytesPosted, now, 0);
+				if ( !block ) {
+					status = STREAM_FILE_ERR;
+					goto done;
+				}
+			}
+
+			transfer->request = request;
+			transfer->submitTime = sysTimeMicros();
+			if ( stats->numTransfers == 0 && pending == 0 ) {
+				stats->startTime = transfer->submitTime;
+			}
+			returnCode = fx2BulkQueueSubmit(queue, block, request);
+			if ( returnCode < 0 ) {
+				stats->returnCode = returnCode;
+				status = STREAM_USB_ERR;
+				goto done;
+			}
+			if ( pending < inFlight && pending + 1 > stats->maxInFlight ) {
+				stats->maxInFlight = pending + 1;
+			}
+			if ( !transfer->isDrop ) {
+				dropEnding = (dropStart >= 0);
+				reserved++;
+			}
+			bytesPosted += request;
+		}
+		if ( pending == 0 ) {
+			break;
+		}
+
+		// ...then wait for the oldest one to complete.
+		//
+		transfer = transfers + oldest;
+		returnCode = fx2BulkQueueReap(queue, config->timeout);
+		if ( returnCode < 0 ) {
+			// With no byte count the stream ends when the device stops sending
+			//
+			stats->returnCode = returnCode;
+			if ( config->maxBytes || stats->numTransfers == 0 ) {
+				status = STREAM_USB_ERR;
+			}
+			break;
+		}
+		if ( transfer->isDrop ) {
+			dropBytes += returnCode;
+			stats->droppedBytes += returnCode;
+			dropsPending--;
+		} else {
+			ringWriteCommit(&ctx.ring, (uint32)returnCode);
+			reserved--;
+		}
+
+		// A drop interval is over once the ring has had room again and all of its discarded
+		// transfers have completed
+		//
+		if ( dropEnding && !dropsPending ) {
+			addEvent(stats, dropOffset, sysTimeMicros() - dropStart, dropBytes);
+			dropStart = -1;
+			dropEnding = false;
+		}
+		bytesPosted -= transfer->request - (uint32)returnCode;
+		stats->endTime = sysTimeMicros();
+		recordLatency(config, stats, stats->endTime - transfer->submitTime);
+		stats->numBytes += returnCode;
+		stats->numTransfers++;
+		oldest = (oldest + 1) % config->queueDepth;
+	}
+done:
+	fx2BulkQueueClose(queue);
+	if ( dropStart >= 0 ) {
+		addEvent(stats, dropOffset, sysTimeMicros() - dropStart, dropBytes);
+	}
+	ringWriteFinish(&ctx.ring);
+	sysThreadJoin(writer);
+	ringDestroy(&ctx.ring);
+	free(scratch);
+	free(transfers);
+	stats->checksum = ctx.checks.checksum;
+	stats->crc32c = ctx.checks.crc32c;
+	if ( status == STREAM_SUCCESS && ctx.fileError ) {
+		status = STREAM_FILE_ERR;
+	}
+	return status;
+}
@@ -0,0 +1,90 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+#include "types.h"
+#include "fx2loader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	typedef enum {
+		STREAM_SUCCESS = 0,
+		STREAM_NO_MEM,
+		STREAM_THREAD_ERR,
+		STREAM_FILE_ERR,
+		STREAM_USB_ERR
+	} StreamStatus;
+
+	typedef struct {
+		uint32 transferSize;   // bytes per bulk transfer
+		uint32 queueDepth;     // number of transfer buffers (and, where supported, transfers in flight)
+		uint32 timeout;        // per-transfer timeout in milliseconds
+		long long maxBytes;    // IN only: stop after this many bytes (zero means until timeout)
+		bool dropWhenFull;     // IN only: discard data rather than stall when the disk falls behind
+		bool wantChecksum;     // compute the 16-bit byte sum of the data
+		bool wantCrc32c;       // compute the CRC32C of the data
+		uint32 *latencies;     // optional: filled with each transfer's latency in microseconds
+		uint32 maxLatencies;   // capacity of latencies[]
+	} StreamConfig;
+
+	// An interval during which the IN stream could not keep up with the device, either because
+	// the reader stalled waiting for the disk (so the device was NAKed), or because data was
+	// thrown away to avoid stalling.
+	//
+	#define STREAM_MAX_EVENTS 64
+	typedef struct {
+		long long offset;      // stream offset at which the interval began
+		long long micros;      // how long it lasted
+		long long numBytes;    // bytes discarded (zero for a stall)
+	} StreamEvent;
+
+	typedef struct {
+		long long numBytes;    // bytes actually transferred
+		long long numTransfers;
+		uint32 maxInFlight;    // most transfers the host controller had at once
+		long long startTime;   // sysTimeMicros() when the first transfer was started
+		long long endTime;     // sysTimeMicros() when the last transfer completed
+		uint16 checksum;       // 16-bit sum of all the bytes transferred
+		uint32 crc32c;         // CRC32C of all the bytes transferred
+		int returnCode;        // libusb return code of the failing transfer, if any
+		uint32 numStalls;      // IN only: number of times the reader waited for a free buffer
+		uint32 numDrops;       // IN only: number of intervals in which data was discarded
+		long long stallMicros; // IN only: total time spent stalled
+		long long droppedBytes;
+		uint32 numEvents;      // number of entries in events[] (capped at STREAM_MAX_EVENTS)
+		StreamEvent events[STREAM_MAX_EVENTS];
+	} StreamStats;
+
+	StreamStatus streamOut(
+		FX2Session *session, int epNum, FILE *inFile,
+		const StreamConfig *config, StreamStats *stats
+	);
+	StreamStatus streamIn(
+		FX2Session *session, int epNum, FILE *outFile,
+		const StreamConfig *config, StreamStats *stats
+	);
+	uint32 streamTransfersInFlight(FX2Session *session, int epNum, bool isIn, uint32 queueDepth);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
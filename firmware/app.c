@@ -25,16 +25,38 @@
 #define SYNCDELAY() SYNCDELAY4;
 #define EP0BUF_SIZE 0x40
 
+// EEPROM writes are gathered here and written a page at a time, so it holds the biggest supported
+// page. EP0 packets are copied out to ep0Stage first, so EP0 can be re-armed before the page write.
+//
+#define MAX_PAGE_SIZE 0x100
+BYTE xdata pageBuf[MAX_PAGE_SIZE];
+BYTE xdata ep0Stage[EP0BUF_SIZE];
+
 #define bmSYNCFIFOS (bmIFCFG1 | bmIFCFG0)
 #define bmBULK bmBIT5
 #define bmDOUBLEBUFFERED bmBIT1
 #define bmSKIP bmBIT7
+#define bmIN bmBIT6
 
 #define bmDYN_OUT (1<<1)
 #define bmENH_PKT (1<<0)
 
 BYTE currentConfiguration;  // Current configuration
 BYTE alternateSetting = 0;  // Alternate settings
+BOOL promWriting = FALSE;   // Whether the EEPROM may still be busy with a write cycle
+WORD promRemaining = 0;     // Bytes still to come in the current sequential read
+WORD gatherAddress;         // EEPROM address of pageBuf[0]
+WORD gatherFill;            // Bytes waiting in pageBuf
+WORD gatherPageSize;        // Page size of the write being gathered
+
+// State of the bulk EEPROM mode, driven from main_loop(). Vendor command 0xA4 starts a write whose
+// data arrives on EP2OUT and ends with a short packet; 0xA5 starts a read which goes out on EP4IN.
+//
+#define BULK_IDLE 0
+#define BULK_WRITE 1
+#define BULK_READ 2
+BYTE bulkMode = BULK_IDLE;
+WORD bulkRemaining;         // Bytes still to send in a bulk read
 
 // Called once at startup
 //
@@ -45,25 +67,86 @@ void main_init(void) {
 	SYNCDELAY();
 	REVCTL = (bmDYN_OUT | bmENH_PKT);
 	SYNCDELAY();
+	EP2CFG = (bmVALID | bmBULK | bmDOUBLEBUFFERED);  // EEPROM data from the host
+	SYNCDELAY();
+	EP4CFG = (bmVALID | bmIN | bmBULK);  // EEPROM data to the host
+	SYNCDELAY();
 	EP6CFG = (bmVALID | bmBULK | bmDOUBLEBUFFERED);
 	SYNCDELAY();
 	FIFORESET = bmNAKALL;
 	SYNCDELAY();
+	FIFORESET = bmNAKALL | 2;  // reset EP2
+	SYNCDELAY();
+	FIFORESET = bmNAKALL | 4;  // reset EP4
+	SYNCDELAY();
 	FIFORESET = bmNAKALL | 6;  // reset EP6
 	SYNCDELAY();
 	FIFORESET = 0x00;
 	SYNCDELAY();
+	OUTPKTEND = bmSKIP | 2;
+	SYNCDELAY();
+	OUTPKTEND = bmSKIP | 2;
+	SYNCDELAY();
 	OUTPKTEND = bmSKIP | 6;
 	SYNCDELAY();
 	OUTPKTEND = bmSKIP | 6;
 	SYNCDELAY();
+	EP2FIFOCFG = 0x00;  // the CPU handles EP2 and EP4 itself
+	SYNCDELAY();
+	EP4FIFOCFG = 0x00;
+	SYNCDELAY();
 	EP6FIFOCFG = bmAUTOOUT;
 	SYNCDELAY();
 }
 
-// Called repeatedly while the device is idle
+BOOL promReadBegin(WORD addr, WORD length);
+BOOL promReadNext(BYTE xdata *buf, WORD count);
+BOOL promWrite(WORD addr, WORD length, const BYTE xdata *buf);
+BOOL promWaitWriteCycle(void);
+void gatherBegin(WORD addr, WORD pageSize);
+void gather(const BYTE xdata *src, WORD count);
+void gatherEnd(void);
+WORD crcUpdate(WORD crc, const BYTE xdata *buf, WORD count);
+
+// Called repeatedly while the device is idle. This is where the bulk EEPROM mode does its work: a
+// packet is taken or given whenever the endpoint has one, so the host can keep the bus busy with
+// 512-byte packets while the I2C side catches up.
 //
-void main_loop(void) { }
+void main_loop(void) {
+	WORD count, packetSize;
+	packetSize = (USBCS & bmHSM) ? 0x200 : 0x40;
+	if ( bulkMode == BULK_WRITE ) {
+		if ( !(EP2468STAT & bmEP2EMPTY) ) {
+			count = MAKEWORD(EP2BCH, EP2BCL);
+			gather(EP2FIFOBUF, count);
+			OUTPKTEND = bmSKIP | 2;  // hand the buffer back to the host
+			SYNCDELAY();
+			if ( count < packetSize ) {
+				// A short packet ends the write
+				//
+				gatherEnd();
+				promWaitWriteCycle();
+				bulkMode = BULK_IDLE;
+			}
+		}
+	} else if ( bulkMode == BULK_READ ) {
+		if ( !(EP2468STAT & bmEP4FULL) ) {
+			count = bulkRemaining < packetSize ? bulkRemaining : packetSize;
+			promReadNext(EP4FIFOBUF, count);
+			EP4BCH = MSB(count);
+			SYNCDELAY();
+			EP4BCL = LSB(count);
+			SYNCDELAY();
+			bulkRemaining -= count;
+			if ( !bulkRemaining ) {
+				bulkMode = BULK_IDLE;
+			}
+		}
+	} else if ( !(EP2468STAT & bmEP2EMPTY) ) {
+		OUTPKTEND = bmSKIP | 2;  // nobody asked for this, so throw it away
+		SYNCDELAY();
+	}
+}
 
 // Called when a Set Configuration command is received
 //
@@ -79,13 +162,62 @@ BYTE handle_get_configuration()
 	return currentConfiguration;
 }
 
-BOOL promRead(WORD addr, BYTE length, BYTE xdata *buf);
-BOOL promWrite(WORD addr, BYTE length, const BYTE xdata *buf);
+// Write the first count bytes of the page buffer, starting at gatherAddress. The previous page's
+// write cycle is waited for first, but this page's is left running, so it overlaps with the host
+// sending the next packet.
+//
+void flushPage(WORD count) {
+	promWaitWriteCycle();
+	promWrite(gatherAddress, count, pageBuf);
+	gatherAddress += count;
+	gatherFill = 0;
+}
+
+// Start gathering a write to addr for an EEPROM with the given page size (a power of two up to
+// MAX_PAGE_SIZE; anything else means 64).
+//
+void gatherBegin(WORD addr, WORD pageSize) {
+	if ( pageSize == 0 || pageSize > MAX_PAGE_SIZE || (pageSize & (pageSize - 1)) ) {
+		pageSize = EP0BUF_SIZE;
+	}
+	gatherAddress = addr;
+	gatherFill = 0;
+	gatherPageSize = pageSize;
+}
+
+// Add count bytes to the write being gathered, writing each page as soon as it's complete. Pages
+// are aligned, so no write wraps around within a page and each page costs exactly one write cycle.
+//
+void gather(const BYTE xdata *src, WORD count) {
+	WORD toBoundary, chunkSize;
+	while ( count ) {
+		toBoundary = gatherPageSize - (gatherAddress & (gatherPageSize - 1));
+		chunkSize = toBoundary - gatherFill;
+		if ( chunkSize > count ) {
+			chunkSize = count;
+		}
+		count -= chunkSize;
+		while ( chunkSize-- ) {
+			pageBuf[gatherFill++] = *src++;
+		}
+		if ( gatherFill == toBoundary ) {
+			flushPage(gatherFill);
+		}
+	}
+}
+
+// Write whatever is left of the write being gathered
+//
+void gatherEnd(void) {
+	if ( gatherFill ) {
+		flushPage(gatherFill);
+	}
+}
 
 // Called when a vendor command is received
 //
 BOOL handle_vendorcommand(BYTE cmd) {
-	WORD address, length;
+	WORD address, length, pageSize;
 	BYTE i, chunkSize;
 	switch(cmd) {
 	case 0x80:
@@ -115,43 +247,144 @@ BOOL handle_vendorcommand(BYTE cmd) {
 	case 0xa2:
 		// Command to talk to the EEPROM
 		//
+		if ( bulkMode != BULK_IDLE ) {
+			return FALSE;  // the bulk mode owns the EEPROM until it's finished
+		}
 		I2CTL |= bm400KHZ;
 		address = SETUPDAT[2];
 		address |= SETUPDAT[3] << 8;
 		length = SETUPDAT[6];
 		length |= SETUPDAT[7] << 8;
 		if ( SETUP_TYPE == 0xc0 ) {
-			// It's an IN operation - read from prom and send to host
+			// It's an IN operation - read from prom and send to host. The whole request is one
+			// sequential read, so the address is only sent once, and the EEPROM is already clocking
+			// out the next byte while the host collects each packet.
 			//
+			promWaitWriteCycle();
+			promReadBegin(address, length);
 			while ( length ) {
 				while ( EP0CS & bmEPBUSY );
 				chunkSize = length < EP0BUF_SIZE ? length : EP0BUF_SIZE;
-				for ( i = 0; i < chunkSize; i++ ) {
-					EP0BUF[i] = 0x23;
-				}
-				promRead(address, chunkSize, EP0BUF);
+				promReadNext(EP0BUF, chunkSize);
 				EP0BCH = 0;
 				SYNCDELAY();
 				EP0BCL = chunkSize;
-				address += chunkSize;
 				length -= chunkSize;
 			}
 		} else if ( SETUP_TYPE == 0x40 ) {
-			// It's an OUT operation - read from host and send to prom
+			// It's an OUT operation - read from host and send to prom. The host may put the EEPROM's
+			// page size in wIndex (a power of two up to MAX_PAGE_SIZE; anything else means 64).
+			// Packets are gathered into page-aligned writes, so no write wraps around within a page
+			// and each page costs exactly one write cycle.
 			//
+			pageSize = SETUPDAT[4];
+			pageSize |= SETUPDAT[5] << 8;
+			gatherBegin(address, pageSize);
+			EP0BCL = 0x00; // allow pc transfer in
 			while ( length ) {
-				EP0BCL = 0x00; // allow pc transfer in
 				while ( EP0CS & bmEPBUSY ); // wait for data
 				chunkSize = EP0BCL;
-				promWrite(address, chunkSize, EP0BUF);
-				address += chunkSize;
+				for ( i = 0; i < chunkSize; i++ ) {
+					ep0Stage[i] = EP0BUF[i];
+				}
 				length -= chunkSize;
+				if ( length ) {
+					EP0BCL = 0x00; // the packet is copied out, so let the next one in right away
+				}
+				gather(ep0Stage, chunkSize);
 			}
+			gatherEnd();
+			promWaitWriteCycle(); // don't complete the status stage until the data is committed
 		}
 		else {
 			return FALSE;
 		}
 		break;
+	case 0xa3:
+		// Bulk EEPROM status: one byte, nonzero while a bulk transfer is still in progress. The
+		// host polls this after a bulk write, to know when the last page has been committed.
+		//
+		if ( SETUP_TYPE == 0xc0 ) {
+			while ( EP0CS & bmEPBUSY );
+			EP0BUF[0] = bulkMode;
+			EP0BCH = 0;
+			SYNCDELAY();
+			EP0BCL = 1;
+		} else {
+			return FALSE;
+		}
+		break;
+	case 0xa4:
+		// Start a bulk EEPROM write at wValue, for an EEPROM with page size wIndex. The data comes
+		// on EP2OUT; main_loop() gathers it into pages, and a short packet ends it.
+		//
+		if ( SETUP_TYPE == 0x40 && bulkMode == BULK_IDLE ) {
+			I2CTL |= bm400KHZ;
+			address = SETUPDAT[2];
+			address |= SETUPDAT[3] << 8;
+			pageSize = SETUPDAT[4];
+			pageSize |= SETUPDAT[5] << 8;
+			gatherBegin(address, pageSize);
+			bulkMode = BULK_WRITE;
+		} else {
+			return FALSE;
+		}
+		break;
+	case 0xa5:
+		// Start a bulk EEPROM read of wIndex bytes from wValue. main_loop() sends it on EP4IN as
+		// one sequential read.
+		//
+		if ( SETUP_TYPE == 0x40 && bulkMode == BULK_IDLE ) {
+			I2CTL |= bm400KHZ;
+			address = SETUPDAT[2];
+			address |= SETUPDAT[3] << 8;
+			length = SETUPDAT[4];
+			length |= SETUPDAT[5] << 8;
+			promWaitWriteCycle();
+			if ( length ) {
+				promReadBegin(address, length);
+				bulkRemaining = length;
+				bulkMode = BULK_READ;
+			}
+		} else {
+			return FALSE;
+		}
+		break;
+	case 0xa6:
+	case 0xa7:
+		// CRC-16/CCITT (initial value 0xFFFF) of wIndex bytes of EEPROM (0xA6) or XDATA (0xA7)
+		// from wValue, sent back little-endian. This lets the host verify what it wrote without
+		// reading it all back. The EEPROM is read in one sequential read, a packet at a time.
+		//
+		if ( SETUP_TYPE == 0xc0 && bulkMode == BULK_IDLE ) {
+			WORD crc = 0xFFFF;
+			address = SETUPDAT[2];
+			address |= SETUPDAT[3] << 8;
+			length = SETUPDAT[4];
+			length |= SETUPDAT[5] << 8;
+			if ( cmd == 0xa6 ) {
+				I2CTL |= bm400KHZ;
+				promWaitWriteCycle();
+				promReadBegin(address, length);
+				while ( length ) {
+					chunkSize = length < EP0BUF_SIZE ? length : EP0BUF_SIZE;
+					promReadNext(ep0Stage, chunkSize);
+					crc = crcUpdate(crc, ep0Stage, chunkSize);
+					length -= chunkSize;
+				}
+			} else {
+				crc = crcUpdate(crc, (const BYTE xdata *)address, length);
+			}
+			while ( EP0CS & bmEPBUSY );
+			EP0BUF[0] = LSB(crc);
+			EP0BUF[1] = MSB(crc);
+			EP0BCH = 0;
+			SYNCDELAY();
+			EP0BCL = 2;
+		} else {
+			return FALSE;
+		}
+		break;
 	default:
 		return FALSE;  // unrecognised command
 	}
@@ -237,9 +470,17 @@ BOOL promWaitForAck()
 	}
 }
 
-BOOL promRead(WORD addr, BYTE length, BYTE xdata *buf) {
+// Start a sequential read of length bytes from addr, to be collected with promReadNext(). Reading
+// I2DAT is what starts the next byte coming in, so the first one is already on its way when this
+// returns.
+//
+BOOL promReadBegin(WORD addr, WORD length) {
 	BYTE i;
-	
+	promRemaining = length;
+	if ( !length ) {
+		return 0;
+	}
+
 	// Wait for I2C idle
 	//
 	while ( I2CS & bmSTOP );
@@ -249,18 +490,18 @@ BOOL promRead(WORD addr, BYTE length, BYTE xdata *buf) {
 	I2CS = bmSTART;
 	I2DAT = 0xA2;  // Write I2C address byte (WRITE)
 	if ( promWaitForAck() ) {
-		return 1;
+		goto fail;
 	}
 	
 	// Send the address, MSB first
 	//
 	I2DAT = MSB(addr);  // Write MSB of address
 	if ( promWaitForAck() ) {
-		return 1;
+		goto fail;
 	}
 	I2DAT = LSB(addr);  // Write LSB of address
 	if ( promWaitForAck() ) {
-		return 1;
+		goto fail;
 	}
 
 	// Send the READ command
@@ -268,43 +509,56 @@ BOOL promRead(WORD addr, BYTE length, BYTE xdata *buf) {
 	I2CS = bmSTART;
 	I2DAT = 0xA3;  // Write I2C address byte (READ)
 	if ( promWaitForDone() ) {
-		return 1;
+		goto fail;
 	}
 
-	// Read dummy byte
+	// Read dummy byte, which starts the first real one
 	//
-	i = I2DAT;
-	if ( promWaitForDone() ) {
-		return 1;
+	if ( length == 1 ) {
+		I2CS |= bmLASTRD;
 	}
+	i = I2DAT;
+	return 0;
+fail:
+	I2CS |= bmSTOP;
+	promRemaining = 0;
+	return 1;
+}
 
-	// Now get the actual data
-	//
-	for ( i = 0; i < (length-1); i++ ) {
-		*(buf+i) = I2DAT;
-		if ( promWaitForDone() ) {
-			return 1;
+// Collect the next count bytes of a sequential read. Each read of I2DAT starts the byte after it,
+// except for the last one, which ends the transaction.
+//
+BOOL promReadNext(BYTE xdata *buf, WORD count) {
+	WORD i;
+	for ( i = 0; i < count; i++ ) {
+		if ( !promRemaining || promWaitForDone() ) {
+			goto fail;
 		}
+		promRemaining--;
+		if ( promRemaining == 1 ) {
+			I2CS |= bmLASTRD;  // the byte this read starts is the last one
+		} else if ( promRemaining == 0 ) {
+			I2CS |= bmSTOP;
+		}
+		buf[i] = I2DAT;
 	}
-
-	// Terminate the read operation and get last byte
-	//
-	I2CS = bmLASTRD;
-	if ( promWaitForDone() ) {
-		return 1;
+	return 0;
+fail:
+	if ( promRemaining ) {
+		I2CS |= bmSTOP;
+		promRemaining = 0;
 	}
-	*(buf+i) = I2DAT;
-	if ( promWaitForDone() ) {
-		return 1;
+	for ( ; i < count; i++ ) {
+		buf[i] = 0xFF;
 	}
-	I2CS = bmSTOP;
-	i = I2DAT;
-
-	return 0;
+	return 1;
 }
 
-BOOL promWrite(WORD addr, BYTE length, const BYTE xdata *buf) {
-	BYTE i;
+// Start an EEPROM write. This returns as soon as the data has gone and the STOP has been sent, so
+// the EEPROM is then busy with its write cycle until promWaitWriteCycle() says otherwise.
+//
+BOOL promWrite(WORD addr, WORD length, const BYTE xdata *buf) {
+	WORD i;
 
 	// Wait for I2C idle
 	//
@@ -332,12 +586,24 @@ BOOL promWrite(WORD addr, BYTE length, const BYTE xdata *buf) {
 	// Write the data
 	//
 	for ( i = 0; i < length; i++ ) {
-        I2DAT = *buf++;
+		I2DAT = *buf++;
 		if ( promWaitForDone() ) {
 			return 1;
 		}
-    }
+	}
 	I2CS |= bmSTOP;
+	promWriting = TRUE;
+	return 0;
+}
+
+// Wait for the EEPROM to finish the write cycle started by promWrite(), if there is one: while it's
+// busy it doesn't ACK its address.
+//
+BOOL promWaitWriteCycle(void) {
+	if ( !promWriting ) {
+		return 0;
+	}
+	promWriting = FALSE;
 
 	// Wait for I2C idle
 	//
@@ -345,7 +611,7 @@ BOOL promWrite(WORD addr, BYTE length, const BYTE xdata *buf) {
 
 	do {
 		I2CS = bmSTART;
-		I2DAT = 0xA2;  // Write I2C address byte (WRITE)                                                                                                                                                                
+		I2DAT = 0xA2;  // Write I2C address byte (WRITE)
 		if ( promWaitForDone() ) {
 			return 1;
 		}
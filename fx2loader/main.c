@@ -21,12 +21,16 @@
 #include "argtable2.h"
 #include "arg_uint.h"
 #include "i2c.h"
+#include "bitset.h"
 #include "usbwrap.h"
 #include "fx2loader.h"
 #include "dump.h"
+#include "sys.h"
+#include "parallel.h"
 
 #define VID 0x04b4
 #define PID 0x8613
+#define MAX_DEVICES 128
 
 typedef enum {
 	SRC_BAD,
@@ -44,15 +48,115 @@ typedef enum {
 	DST_BIXFILE
 } Destination;
 
+// Load the image into every device in parallel and report how each one got on.
+//
+static uint32 loadAll(
+	LoadDevice *devices, uint32 numDevices, uint32 numWorkers,
+	LoadTarget target, const Buffer *image, const Bitset *mask)
+{
+	const long long startTime = sysTimeMicros();
+	long long totalMicros = 0;
+	uint32 i, numOK = 0;
+	if ( loadParallel(devices, numDevices, numWorkers, target, image, mask) ) {
+		fprintf(stderr, "Cannot start loader threads\n");
+		return 27;
+	}
+	for ( i = 0; i < numDevices; i++ ) {
+		if ( devices[i].status == FX2_SUCCESS ) {
+			printf("%-24s OK     %8.3f s\n", devices[i].path, (double)devices[i].micros / 1000000.0);
+			numOK++;
+		} else {
+			printf("%-24s FAILED %8.3f s: %s", devices[i].path, (double)devices[i].micros / 1000000.0, devices[i].error);
+		}
+		totalMicros += devices[i].micros;
+	}
+	printf(
+		"Loaded %lu of %lu devices in %.3f s (%.3f s if done one at a time)\n",
+		numOK, numDevices, (double)(sysTimeMicros() - startTime) / 1000000.0, (double)totalMicros / 1000000.0);
+	return (numOK == numDevices) ? 0 : 23;
+}
+
+// Say how big an EEPROM image came out and how long the FX2 will take to boot from it. If the
+// image was encoded from a data buffer and mask, compare it with what the other encoding gives.
+//
+static void reportEncoding(
+	const Buffer *i2cBuffer, const Buffer *data, const Bitset *mask, I2CEncoding encoding)
+{
+	const I2CEncoding other = (encoding == I2C_ENCODE_GREEDY) ? I2C_ENCODE_OPTIMAL : I2C_ENCODE_GREEDY;
+	I2CImageStats stats, otherStats;
+	Buffer otherBuffer = {0};
+	if ( i2cGetImageStats(i2cBuffer, &stats) ) {
+		return;
+	}
+	printf(
+		"Image is %lu bytes in %lu records; booting from it takes about %.1f ms at %s\n",
+		stats.numBytes, stats.numRecords, (double)stats.bootMicros / 1000.0,
+		(i2cBuffer->data[7] & CONFIG_BYTE_400KHZ) ? "400kHz" : "100kHz");
+	if ( data->length && !bufInitialise(&otherBuffer, 1024, 0x00) ) {
+		if ( !i2cInitialise(&otherBuffer, 0x0000, 0x0000, 0x0000, i2cBuffer->data[7]) &&
+		     !i2cWritePromRecordsBits(&otherBuffer, data, mask, other) &&
+		     !i2cFinalise(&otherBuffer) && !i2cGetImageStats(&otherBuffer, &otherStats) )
+		{
+			// The optimal encoding is never bigger, so the greedy one is never smaller
+			//
+			const bool isGreedy = (other == I2C_ENCODE_GREEDY);
+			printf(
+				"The %s encoding is %lu bytes in %lu records (%ld bytes and %.1f ms %s)\n",
+				isGreedy ? "greedy" : "optimal", otherStats.numBytes, otherStats.numRecords,
+				isGreedy ? (long)otherStats.numBytes - (long)stats.numBytes : (long)stats.numBytes - (long)otherStats.numBytes,
+				(isGreedy ? (double)otherStats.bootMicros - (double)stats.bootMicros : (double)stats.bootMicros - (double)otherStats.bootMicros) / 1000.0,
+				isGreedy ? "more" : "less");
+		}
+		bufDestroy(&otherBuffer);
+	}
+}
+
+// Check the EEPROM holds the supplied image by reading it all back. Returns zero if it does.
+//
+static int verifyByReading(FX2Session *session, const Buffer *i2cBuffer) {
+	Buffer readBack = {0};
+	uint32 i;
+	int retVal = -1;
+	if ( bufInitialise(&readBack, i2cBuffer->length ? i2cBuffer->length : 1, 0x00) ) {
+		fprintf(stderr, "%s\n", bufStrError());
+		return -1;
+	}
+	if ( fx2SessionReadEEPROM(session, i2cBuffer->length, &readBack) ) {
+		fprintf(stderr, "%s\n", fx2StrError());
+		goto cleanup;
+	}
+	for ( i = 0; i < i2cBuffer->length; i++ ) {
+		if ( readBack.data[i] != i2cBuffer->data[i] ) {
+			fprintf(
+				stderr, "EEPROM verify failed at 0x%04lX: wrote 0x%02X but read back 0x%02X\n",
+				i, i2cBuffer->data[i], readBack.data[i]);
+			goto cleanup;
+		}
+	}
+	retVal = 0;
+cleanup:
+	bufDestroy(&readBack);
+	return retVal;
+}
+
 int main(int argc, char *argv[]) {
 
 	struct arg_uint *vidOpt = arg_uint0("v", "vid", "<vendorID>", "  vendor ID");
 	struct arg_uint *pidOpt = arg_uint0("p", "pid", "<productID>", " product ID");
+	struct arg_str *devOpt = arg_strn("d", "device", "<bus:addr>", 0, MAX_DEVICES, "  device location (overrides VID/PID; repeat to load several)");
+	struct arg_lit *allOpt  = arg_lit0("a", "all", "             load every device matching VID/PID in parallel");
+	struct arg_uint *jobOpt = arg_uint0("j", "jobs", "<count>", "      how many devices to load at once (default all)");
+	struct arg_lit *statsOpt = arg_lit0(NULL, "stats", "              report how many bytes and transfers a RAM load took, or how big an EEPROM image is");
+	struct arg_str *encOpt = arg_str0(NULL, "encoding", "<greedy|optimal>", " how to split EEPROM images into records (default greedy)");
+	struct arg_lit *diffOpt = arg_lit0(NULL, "diff", "               only write the EEPROM pages that differ from what's there, then verify them");
+	struct arg_str *knownOpt = arg_str0(NULL, "known", "<file.iic>", "   with --diff, take the current EEPROM contents from this file instead of reading them");
+	struct arg_uint *pageOpt = arg_uint0(NULL, "page-size", "<bytes>", "  EEPROM page size for --diff (default 64)");
+	struct arg_str *verifyOpt = arg_str0(NULL, "verify", "<crc|read>", "   after writing the EEPROM, check it by on-device CRCs or by reading it all back");
 	struct arg_lit *helpOpt  = arg_lit0("h", "help", "            print this help and exit");
 	struct arg_str *srcOpt = arg_str1(NULL, NULL, "<source>", "            where to read from (<eeprom:<kbitSize> | fileName.hex | fileName.bix | fileName.iic>)");
 	struct arg_str *dstOpt = arg_str0(NULL, NULL, "<destination>", "         where to write to (<ram | eeprom | fileName.hex | fileName.bix | fileName.iic> - defaults to \"ram\")");
 	struct arg_end *endOpt   = arg_end(20);
-	void* argTable[] = {vidOpt, pidOpt, helpOpt, srcOpt, dstOpt, endOpt};
+	void* argTable[] = {vidOpt, pidOpt, devOpt, allOpt, jobOpt, statsOpt, encOpt, diffOpt, knownOpt, pageOpt, verifyOpt, helpOpt, srcOpt, dstOpt, endOpt};
 	const char *progName = "fx2loader";
 	uint32 exitCode = 0;
 	int numErrors;
@@ -60,11 +164,22 @@ int main(int argc, char *argv[]) {
 	Source src = SRC_BAD;
 	Destination dst;
 	Buffer sourceData = {0};
-	Buffer sourceMask = {0};
+	Bitset sourceMask = {0};
+	Buffer hexMask = {0};
 	Buffer i2cBuffer = {0};
+	Buffer knownBuffer = {0};
+	FX2EepromStats eepromStats;
+	uint32 pageSize = 64;
+	FX2Session *session = NULL;
+	FX2RamStats ramStats;
+	LoadDevice *devices = NULL;
+	uint32 numDevices = 0;
+	bool multi;
 	uint16 vid, pid;
 	const char *srcExt, *dstExt;
 	int eepromSize = 0;
+	I2CEncoding encoding = I2C_ENCODE_GREEDY;
+	bool verifyCrc = false, verifyRead = false;
 
 	// Parse arguments...
 	//
@@ -137,9 +252,121 @@ int main(int argc, char *argv[]) {
 		dst = DST_RAM;
 	}
 
+	if ( encOpt->count ) {
+		if ( !strcmp(encOpt->sval[0], "optimal") ) {
+			encoding = I2C_ENCODE_OPTIMAL;
+		} else if ( strcmp(encOpt->sval[0], "greedy") ) {
+			fprintf(stderr, "Unrecognised encoding: %s\n", encOpt->sval[0]);
+			exitCode = 28;
+			goto cleanup;
+		}
+	}
+
+	if ( pageOpt->count ) {
+		pageSize = pageOpt->ival[0];
+		if ( pageSize == 0 || (pageSize & (pageSize - 1)) || pageSize > 4096 ) {
+			fprintf(stderr, "The EEPROM page size must be a power of two no bigger than 4096\n");
+			exitCode = 29;
+			goto cleanup;
+		}
+	}
+	if ( (knownOpt->count || pageOpt->count) && !diffOpt->count ) {
+		fprintf(stderr, "The --known and --page-size options only make sense with --diff\n");
+		exitCode = 29;
+		goto cleanup;
+	}
+	if ( verifyOpt->count ) {
+		if ( !strcmp(verifyOpt->sval[0], "crc") ) {
+			verifyCrc = true;
+		} else if ( !strcmp(verifyOpt->sval[0], "read") ) {
+			verifyRead = true;
+		} else {
+			fprintf(stderr, "Unrecognised verify method: %s\n", verifyOpt->sval[0]);
+			exitCode = 29;
+			goto cleanup;
+		}
+		if ( dst != DST_EEPROM ) {
+			fprintf(stderr, "The --verify option only makes sense when writing to eeprom\n");
+			exitCode = 29;
+			goto cleanup;
+		}
+	}
+	if ( diffOpt->count && dst != DST_EEPROM ) {
+		fprintf(stderr, "The --diff option only makes sense when writing to eeprom\n");
+		exitCode = 29;
+		goto cleanup;
+	}
+
 	vid = vidOpt->count ? (uint16)vidOpt->ival[0] : VID;
 	pid = pidOpt->count ? (uint16)pidOpt->ival[0] : PID;
 
+	// Several devices are loaded in parallel, each by its own worker with its own session...
+	//
+	multi = allOpt->count || devOpt->count > 1;
+	if ( multi ) {
+		if ( src == SRC_EEPROM || (dst != DST_RAM && dst != DST_EEPROM) || diffOpt->count || verifyOpt->count ) {
+			fprintf(stderr, "Loading several devices at once only works from a file to ram or eeprom, without --diff or --verify\n");
+			exitCode = 24;
+			goto cleanup;
+		}
+		devices = (LoadDevice *)calloc(MAX_DEVICES, sizeof(LoadDevice));
+		if ( !devices ) {
+			fprintf(stderr, "Cannot allocate device list\n");
+			exitCode = 25;
+			goto cleanup;
+		}
+		if ( allOpt->count ) {
+			char (*paths)[FX2_PATH_MAXLENGTH] = (char (*)[FX2_PATH_MAXLENGTH])calloc(MAX_DEVICES, FX2_PATH_MAXLENGTH);
+			uint32 i;
+			if ( !paths ) {
+				fprintf(stderr, "Cannot allocate device list\n");
+				exitCode = 25;
+				goto cleanup;
+			}
+			if ( fx2ListDevices(vid, pid, paths, MAX_DEVICES, &numDevices) ) {
+				fprintf(stderr, "%s", fx2StrError());
+				free(paths);
+				exitCode = 26;
+				goto cleanup;
+			}
+			if ( numDevices > MAX_DEVICES ) {
+				fprintf(stderr, "Found %lu devices; only loading the first %d\n", numDevices, MAX_DEVICES);
+				numDevices = MAX_DEVICES;
+			}
+			for ( i = 0; i < numDevices; i++ ) {
+				strcpy(devices[i].path, paths[i]);
+			}
+			free(paths);
+			if ( numDevices == 0 ) {
+				fprintf(stderr, "No devices matching %04X:%04X\n", vid, pid);
+				exitCode = 26;
+				goto cleanup;
+			}
+		} else {
+			for ( numDevices = 0; numDevices < (uint32)devOpt->count; numDevices++ ) {
+				if ( strlen(devOpt->sval[numDevices]) >= FX2_PATH_MAXLENGTH ) {
+					fprintf(stderr, "Device path too long: %s\n", devOpt->sval[numDevices]);
+					exitCode = 26;
+					goto cleanup;
+				}
+				strcpy(devices[numDevices].path, devOpt->sval[numDevices]);
+			}
+		}
+	}
+
+	// Otherwise open the device once, if it's needed at all, and use it for everything...
+	//
+	else if ( src == SRC_EEPROM || dst == DST_RAM || dst == DST_EEPROM ) {
+		FX2Status fStatus = devOpt->count ?
+			fx2OpenSessionPath(devOpt->sval[0], &session) :
+			fx2OpenSession(vid, pid, &session);
+		if ( fStatus ) {
+			fprintf(stderr, "%s", fx2StrError());
+			exitCode = 3;
+			goto cleanup;
+		}
+	}
+
 	// Initialise buffers...
 	//
 	if ( bufInitialise(&sourceData, 1024, 0x00) ) {
@@ -147,8 +374,8 @@ int main(int argc, char *argv[]) {
 		exitCode = 10;
 		goto cleanup;
 	}
-	if ( bufInitialise(&sourceMask, 1024, 0x00) ) {
-		fprintf(stderr, "%s\n", bufStrError());
+	if ( bitsetInitialise(&sourceMask, 0x10000) ) {
+		fprintf(stderr, "%s\n", fx2StrError());
 		exitCode = 11;
 		goto cleanup;
 	}
@@ -157,23 +384,35 @@ int main(int argc, char *argv[]) {
 		exitCode = 11;
 		goto cleanup;
 	}
+	if ( bufInitialise(&hexMask, 1024, 0x00) ) {
+		fprintf(stderr, "%s\n", bufStrError());
+		exitCode = 11;
+		goto cleanup;
+	}
 
 	// Read from source...
 	//
 	if ( src == SRC_HEXFILE ) {
-		if ( bufReadFromIntelHexFile(&sourceData, &sourceMask, srcOpt->sval[0]) ) {
+		// The hex reader gives a byte per address in its mask, so pack it into the bitset
+		//
+		if ( bufReadFromIntelHexFile(&sourceData, &hexMask, srcOpt->sval[0]) ) {
 			fprintf(stderr, "%s\n", bufStrError());
 			exitCode = 13;
 			goto cleanup;
 		}
+		if ( bitsetFromMask(&sourceMask, &hexMask) ) {
+			fprintf(stderr, "%s\n", fx2StrError());
+			exitCode = 13;
+			goto cleanup;
+		}
 	} else if ( src == SRC_BIXFILE ) {
 		if ( bufAppendFromBinaryFile(&sourceData, srcOpt->sval[0]) ) {
 			fprintf(stderr, "%s\n", bufStrError());
 			exitCode = 22;
 			goto cleanup;
 		}
-		if ( bufAppendConst(&sourceMask, sourceData.length, 0x01, NULL) ) {
-			fprintf(stderr, "%s\n", bufStrError());
+		if ( bitsetSetRange(&sourceMask, 0, sourceData.length) ) {
+			fprintf(stderr, "%s\n", fx2StrError());
 			exitCode = 22;
 			goto cleanup;
 		}
@@ -184,7 +423,7 @@ int main(int argc, char *argv[]) {
 			goto cleanup;
 		}
 	} else if ( src == SRC_EEPROM ) {
-		if ( fx2ReadEEPROM(vid, pid, eepromSize, &i2cBuffer) ) {
+		if ( fx2SessionReadEEPROMImage(session, eepromSize, &i2cBuffer) ) {
 			fprintf(stderr, "%s\n", fx2StrError());
 			exitCode = 22;
 			goto cleanup;
@@ -198,10 +437,11 @@ int main(int argc, char *argv[]) {
 	// Write to destination...
 	//
 	if ( dst == DST_RAM ) {
-		// If the source data was I2C, write it to data/mask buffers
+		// If the source data was I2C, a single device gets the records sent as they're decoded.
+		// Several devices share decoded data/mask buffers instead.
 		//
-		if ( i2cBuffer.length > 0 ) {
-			if ( i2cReadPromRecords(&sourceData, &sourceMask, &i2cBuffer) ) {
+		if ( i2cBuffer.length > 0 && multi ) {
+			if ( i2cReadPromRecordsBits(&sourceData, &sourceMask, &i2cBuffer) ) {
 				fprintf(stderr, "%s\n", fx2StrError());
 				exitCode = 15;
 				goto cleanup;
@@ -210,11 +450,39 @@ int main(int argc, char *argv[]) {
 
 		// Write the data to RAM
 		//
-		if ( fx2WriteRAM(vid, pid, &sourceData) ) {
+		if ( multi ) {
+			exitCode = loadAll(devices, numDevices, jobOpt->count ? jobOpt->ival[0] : 0, LOAD_RAM, &sourceData, &sourceMask);
+			if ( statsOpt->count ) {
+				// Every device gets the same image, so any that succeeded sent the same
+				//
+				uint32 i = 0;
+				while ( i < numDevices && devices[i].status != FX2_SUCCESS ) {
+					i++;
+				}
+				if ( i < numDevices ) {
+					ramStats = devices[i].ramStats;
+					printf(
+						"Wrote %lu bytes in %lu transfers to each device (the whole image would be %lu bytes in %lu transfers)\n",
+						ramStats.numBytes, ramStats.numTransfers, ramStats.fullBytes, ramStats.fullTransfers);
+				}
+			}
+			goto cleanup;
+		} else if ( i2cBuffer.length > 0 ) {
+			if ( fx2SessionWriteRAMRecords(session, &i2cBuffer, &ramStats) ) {
+				fprintf(stderr, "%s\n", fx2StrError());
+				exitCode = 15;
+				goto cleanup;
+			}
+		} else if ( fx2SessionWriteRAMBits(session, &sourceData, &sourceMask, &ramStats) ) {
 			fprintf(stderr, "%s\n", fx2StrError());
 			exitCode = 15;
 			goto cleanup;
 		}
+		if ( statsOpt->count ) {
+			printf(
+				"Wrote %lu bytes in %lu transfers (the whole image would be %lu bytes in %lu transfers)\n",
+				ramStats.numBytes, ramStats.numTransfers, ramStats.fullBytes, ramStats.fullTransfers);
+		}
 	} else if ( dst == DST_EEPROM ) {
 		// If the source data was *not* I2C, construct I2C data from the raw data/mask buffers
 		//
@@ -224,7 +492,7 @@ int main(int argc, char *argv[]) {
 				exitCode = 12;
 				goto cleanup;
 			}
-			if ( i2cWritePromRecords(&i2cBuffer, &sourceData, &sourceMask) ) {
+			if ( i2cWritePromRecordsBits(&i2cBuffer, &sourceData, &sourceMask, encoding) ) {
 				fprintf(stderr, "%s\n", fx2StrError());
 				exitCode = 19;
 				goto cleanup;
@@ -235,29 +503,75 @@ int main(int argc, char *argv[]) {
 				goto cleanup;
 			}
 		}
+		if ( statsOpt->count ) {
+			reportEncoding(&i2cBuffer, &sourceData, &sourceMask, encoding);
+		}
 
 		// Write the I2C data to the EEPROM
 		//
-		if ( fx2WriteEEPROM(vid, pid, &i2cBuffer) ) {
+		if ( multi ) {
+			exitCode = loadAll(devices, numDevices, jobOpt->count ? jobOpt->ival[0] : 0, LOAD_EEPROM, &i2cBuffer, NULL);
+			goto cleanup;
+		} else if ( diffOpt->count ) {
+			if ( knownOpt->count ) {
+				if ( bufInitialise(&knownBuffer, 1024, 0x00) || bufAppendFromBinaryFile(&knownBuffer, knownOpt->sval[0]) ) {
+					fprintf(stderr, "%s\n", bufStrError());
+					exitCode = 30;
+					goto cleanup;
+				}
+			}
+			if ( fx2SessionUpdateEEPROM(session, &i2cBuffer, knownOpt->count ? &knownBuffer : NULL, pageSize, &eepromStats) ) {
+				fprintf(stderr, "%s\n", fx2StrError());
+				exitCode = 16;
+				goto cleanup;
+			}
+			if ( statsOpt->count ) {
+				printf(
+					"Wrote %lu of %lu pages (%lu bytes) and verified them\n",
+					eepromStats.pagesWritten, eepromStats.numPages, eepromStats.bytesWritten);
+			}
+		} else if ( fx2SessionWriteEEPROM(session, &i2cBuffer) ) {
 			fprintf(stderr, "%s\n", fx2StrError());
 			exitCode = 16;
 			goto cleanup;
 		}
+
+		// Check what was written, if asked to
+		//
+		if ( verifyCrc ) {
+			if ( fx2SessionVerifyEEPROM(session, &i2cBuffer) ) {
+				fprintf(stderr, "%s\n", fx2StrError());
+				exitCode = 31;
+				goto cleanup;
+			}
+		} else if ( verifyRead ) {
+			if ( verifyByReading(session, &i2cBuffer) ) {
+				exitCode = 31;
+				goto cleanup;
+			}
+		}
 	} else if ( dst == DST_HEXFILE ) {
 		// If the source data was I2C, write it to data/mask buffers
 		//
 		if ( i2cBuffer.length > 0 ) {
-			if ( i2cReadPromRecords(&sourceData, &sourceMask, &i2cBuffer) ) {
+			if ( i2cReadPromRecordsBits(&sourceData, &sourceMask, &i2cBuffer) ) {
 				fprintf(stderr, "%s\n", fx2StrError());
 				exitCode = 15;
 				goto cleanup;
 			}
 		}
 
-		// Write the data/mask buffers out as an I8HEX file
+		// Write the data/mask buffers out as an I8HEX file. The hex writer wants a byte per address
+		// in its mask, so expand the bitset for it.
 		//
-		//dump(0x00000000, sourceMask.data, sourceMask.length);
-		if ( bufWriteToIntelHexFile(&sourceData, &sourceMask, dstOpt->sval[0], 16, false) ) {
+		bufZeroLength(&hexMask);
+		if ( bitsetToMask(&sourceMask, &hexMask) ) {
+			fprintf(stderr, "%s\n", bufStrError());
+			exitCode = 17;
+			goto cleanup;
+		}
+		//dump(0x00000000, hexMask.data, hexMask.length);
+		if ( bufWriteToIntelHexFile(&sourceData, &hexMask, dstOpt->sval[0], 16, false) ) {
 			fprintf(stderr, "%s\n", bufStrError());
 			exitCode = 17;
 			goto cleanup;
@@ -266,7 +580,7 @@ int main(int argc, char *argv[]) {
 		// If the source data was I2C, write it to data/mask buffers
 		//
 		if ( i2cBuffer.length > 0 ) {
-			if ( i2cReadPromRecords(&sourceData, &sourceMask, &i2cBuffer) ) {
+			if ( i2cReadPromRecordsBits(&sourceData, &sourceMask, &i2cBuffer) ) {
 				fprintf(stderr, "%s\n", fx2StrError());
 				exitCode = 15;
 				goto cleanup;
@@ -289,7 +603,7 @@ int main(int argc, char *argv[]) {
 				exitCode = 12;
 				goto cleanup;
 			}
-			if ( i2cWritePromRecords(&i2cBuffer, &sourceData, &sourceMask) ) {
+			if ( i2cWritePromRecordsBits(&i2cBuffer, &sourceData, &sourceMask, encoding) ) {
 				fprintf(stderr, "%s\n", fx2StrError());
 				exitCode = 19;
 				goto cleanup;
@@ -300,6 +614,9 @@ int main(int argc, char *argv[]) {
 				goto cleanup;
 			}
 		}
+		if ( statsOpt->count ) {
+			reportEncoding(&i2cBuffer, &sourceData, &sourceMask, encoding);
+		}
 
 		// Write the I2C data out as a binary file
 		//
@@ -315,11 +632,19 @@ int main(int argc, char *argv[]) {
 	}
 
 cleanup:
+	free(devices);
+	fx2CloseSession(session);
+	if ( knownBuffer.data ) {
+		bufDestroy(&knownBuffer);
+	}
 	if ( i2cBuffer.data ) {
 		bufDestroy(&i2cBuffer);
 	}
-	if ( sourceMask.data ) {
-		bufDestroy(&sourceMask);
+	if ( hexMask.data ) {
+		bufDestroy(&hexMask);
+	}
+	if ( sourceMask.words ) {
+		bitsetDestroy(&sourceMask);
 	}
 	if ( sourceData.data ) {
 		bufDestroy(&sourceData);
@@ -0,0 +1,113 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "parallel.h"
+#include "sys.h"
+
+// State shared by the workers. Each one repeatedly claims the next unclaimed device until there
+// are none left, so a slow board only holds up its own worker.
+//
+typedef struct {
+	LoadDevice *devices;
+	uint32 numDevices;
+	uint32 next;
+	SysMutex *lock;
+	LoadTarget target;
+	const Buffer *image;
+	const Bitset *mask;
+} Pool;
+
+static void loadOne(const Pool *pool, LoadDevice *device) {
+	FX2Session *session;
+	const long long startTime = sysTimeMicros();
+	device->status = fx2OpenSessionPath(device->path, &session);
+	if ( device->status ) {
+		strcpy(device->error, fx2StrError());
+	} else {
+		device->status = (pool->target == LOAD_RAM) ?
+			fx2SessionWriteRAMBits(session, pool->image, pool->mask, &device->ramStats) :
+			fx2SessionWriteEEPROM(session, pool->image);
+		if ( device->status ) {
+			strcpy(device->error, fx2SessionError(session)->message);
+		}
+		fx2CloseSession(session);
+	}
+	device->micros = sysTimeMicros() - startTime;
+}
+
+static void worker(void *arg) {
+	Pool *const pool = (Pool *)arg;
+	uint32 index;
+	for ( ; ; ) {
+		sysMutexLock(pool->lock);
+		index = pool->next++;
+		sysMutexUnlock(pool->lock);
+		if ( index >= pool->numDevices ) {
+			break;
+		}
+		loadOne(pool, &pool->devices[index]);
+	}
+}
+
+int loadParallel(
+	LoadDevice *devices, uint32 numDevices, uint32 numWorkers,
+	LoadTarget target, const Buffer *image, const Bitset *mask)
+{
+	Pool pool;
+	SysThread **threads;
+	uint32 i, numStarted = 0;
+	if ( numWorkers == 0 || numWorkers > numDevices ) {
+		numWorkers = numDevices;
+	}
+	for ( i = 0; i < numDevices; i++ ) {
+		devices[i].status = FX2_USBERR;
+		devices[i].micros = 0;
+		strcpy(devices[i].error, "Not attempted\n");
+	}
+	threads = (SysThread **)calloc(numWorkers, sizeof(SysThread *));
+	if ( !threads ) {
+		return -1;
+	}
+	if ( sysMutexCreate(&pool.lock) ) {
+		free(threads);
+		return -1;
+	}
+	pool.devices = devices;
+	pool.numDevices = numDevices;
+	pool.next = 0;
+	pool.target = target;
+	pool.image = image;
+	pool.mask = mask;
+	for ( i = 0; i < numWorkers; i++ ) {
+		if ( sysThreadCreate(&threads[i], worker, &pool) ) {
+			break;
+		}
+		numStarted++;
+	}
+	if ( numStarted == 0 ) {
+		// Couldn't start any threads at all, so do the work on this one
+		//
+		worker(&pool);
+	}
+	for ( i = 0; i < numStarted; i++ ) {
+		sysThreadJoin(threads[i]);
+	}
+	sysMutexDestroy(pool.lock);
+	free(threads);
+	return 0;
+}
@@ -0,0 +1,56 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "types.h"
+#include "buffer.h"
+#include "fx2loader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	typedef enum {
+		LOAD_RAM,
+		LOAD_EEPROM
+	} LoadTarget;
+
+	// One device in a parallel load, and how it got on
+	//
+	typedef struct {
+		char path[FX2_PATH_MAXLENGTH];
+		FX2Status status;
+		long long micros;
+		FX2RamStats ramStats;  // what a RAM load sent
+		char error[FX2_ERR_MAXLENGTH];
+	} LoadDevice;
+
+	// Load the same (already parsed and encoded) image into every device, using a pool of at most
+	// numWorkers threads. The mask is only used for RAM loads, and may be NULL. Returns zero if
+	// every device was attempted; check each one's status.
+	//
+	int loadParallel(
+		LoadDevice *devices, uint32 numDevices, uint32 numWorkers,
+		LoadTarget target, const Buffer *image, const Bitset *mask
+	);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
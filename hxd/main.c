@@ -16,16 +16,104 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #ifdef WIN32
 #include <fcntl.h>
 #include <io.h>
 #pragma warning(disable : 4996)
 #endif
 
+// The input is read a block at a time, and the output is built up in a buffer big enough for a
+// whole block's worth of lines, which is then written with one call. Each 16-byte line comes out
+// as an offset of 8 to 16 hex digits, the bytes in hex, then the printable ones as ASCII; the
+// buffer is sized for the widest offset, so it's big enough wherever the block lies in the input.
+//
+#define BLOCK_SIZE (1024*1024)
+#define LINE_BYTES 16
+#define MAX_OFFSET_DIGITS 16
+#define LINE_LENGTH (MAX_OFFSET_DIGITS + 1 + 3*LINE_BYTES + LINE_BYTES + 1)
+#define OUT_SIZE (BLOCK_SIZE / LINE_BYTES * LINE_LENGTH + 64)
+
+// Two hex digits and a space for every byte value (padded to four so each entry can be copied
+// with a single store), and what each byte value looks like in the ASCII column
+//
+static char hexTable[256][4];
+static char asciiTable[256];
+
+static void initTables(void) {
+	static const char digits[] = "0123456789ABCDEF";
+	int i;
+	for ( i = 0; i < 256; i++ ) {
+		hexTable[i][0] = digits[i >> 4];
+		hexTable[i][1] = digits[i & 15];
+		hexTable[i][2] = ' ';
+		hexTable[i][3] = ' ';
+		asciiTable[i] = (i < 32 || i > 126) ? '.' : (char)i;
+	}
+}
+
+// Write the offset as eight hex digits (or more, once it's past 4GB), then a space.
+//
+static char *putOffset(char *out, unsigned long long offset) {
+	int shift = 24;
+	while ( shift < 56 && (offset >> (shift + 8)) ) {
+		shift += 8;
+	}
+	for ( ; shift >= 0; shift -= 8 ) {
+		const unsigned char byte = (unsigned char)(offset >> shift);
+		*out++ = hexTable[byte][0];
+		*out++ = hexTable[byte][1];
+	}
+	*out++ = ' ';
+	return out;
+}
+
+// Format one full line. Each hex entry is copied four bytes at a time; the spare byte is
+// overwritten by the next entry, or by the first ASCII character.
+//
+static char *putFullLine(char *out, unsigned long long offset, const unsigned char *data) {
+	int i;
+	out = putOffset(out, offset);
+	for ( i = 0; i < LINE_BYTES; i++ ) {
+		memcpy(out, hexTable[data[i]], 4);
+		out += 3;
+	}
+	for ( i = 0; i < LINE_BYTES; i++ ) {
+		out[i] = asciiTable[data[i]];
+	}
+	out[LINE_BYTES] = '\n';
+	return out + LINE_BYTES + 1;
+}
+
+// Format the last line, which may have fewer than LINE_BYTES bytes, padding the hex column.
+//
+static char *putLine(char *out, unsigned long long offset, const unsigned char *data, size_t count) {
+	size_t i;
+	out = putOffset(out, offset);
+	for ( i = 0; i < count; i++ ) {
+		out[0] = hexTable[data[i]][0];
+		out[1] = hexTable[data[i]][1];
+		out[2] = ' ';
+		out += 3;
+	}
+	for ( ; i < LINE_BYTES; i++ ) {
+		out[0] = out[1] = out[2] = ' ';
+		out += 3;
+	}
+	for ( i = 0; i < count; i++ ) {
+		*out++ = asciiTable[data[i]];
+	}
+	*out++ = '\n';
+	return out;
+}
+
 int main(int argc, const char *argv[]) {
 	FILE *input;
-	unsigned char line[16];
-	unsigned int i, bytesRead, offset = 0;
+	unsigned char *block;
+	char *outBuf, *out;
+	size_t bytesRead, fill = 0, i;
+	unsigned long long offset = 0;
+	int retVal = 0;
 
 	if ( argc == 2 ) {
 		input = fopen(argv[1], "rb");
@@ -43,30 +131,59 @@ int main(int argc, const char *argv[]) {
 		exit(1);
 	}
 
-	do {
-		printf("%08X ", offset);
-		bytesRead = fread(line, 1, 16, input);
-		offset += bytesRead;
-		for ( i = 0; i < bytesRead; i++ ) {
-			printf("%02X ", line[i]);
-		}
-		if ( bytesRead != 16 ) {
-			for ( i = 0; i < 16-bytesRead; i++ ) {
-				printf("   ");
+	// Our own buffers are big, so stdio's would only add a copy
+	//
+	setvbuf(input, NULL, _IONBF, 0);
+	setvbuf(stdout, NULL, _IONBF, 0);
+	block = (unsigned char *)malloc(BLOCK_SIZE);
+	outBuf = (char *)malloc(OUT_SIZE);
+	if ( !block || !outBuf ) {
+		fprintf(stderr, "Cannot allocate buffers\n");
+		retVal = 1;
+		goto cleanup;
+	}
+	initTables();
+
+	// Whole lines are formatted straight from the block; any leftover bytes are moved to the
+	// start of the block, to be completed by the next read. A read from a pipe may come up short
+	// of a whole block without it being the end of the input.
+	//
+	for ( ; ; ) {
+		bytesRead = fread(block + fill, 1, BLOCK_SIZE - fill, input);
+		fill += bytesRead;
+		if ( bytesRead == 0 ) {
+			if ( ferror(input) ) {
+				fprintf(stderr, "%s: read error\n", argc == 2 ? argv[1] : "stdin");
+				retVal = 1;
+				goto cleanup;
 			}
+			break;
 		}
-		for ( i = 0; i < bytesRead; i++ ) {
-			if ( line[i] < 32 || line[i] > 126 ) {
-				printf ( "." );
-			} else {
-				printf("%c", line[i]);
-			}
+		out = outBuf;
+		for ( i = 0; i + LINE_BYTES <= fill; i += LINE_BYTES ) {
+			out = putFullLine(out, offset, block + i);
+			offset += LINE_BYTES;
+		}
+		if ( fwrite(outBuf, 1, (size_t)(out - outBuf), stdout) != (size_t)(out - outBuf) ) {
+			retVal = 1;
+			goto cleanup;
 		}
-		printf("\n");
-	} while ( !feof(input) );
+		fill -= i;
+		memmove(block, block + i, fill);
+	}
+
+	// The last line is whatever's left, even if that's nothing
+	//
+	out = putLine(outBuf, offset, block, fill);
+	if ( fwrite(outBuf, 1, (size_t)(out - outBuf), stdout) != (size_t)(out - outBuf) ) {
+		retVal = 1;
+	}
 
+cleanup:
+	free(outBuf);
+	free(block);
 	if ( input != stdin ) {
 		fclose(input);
 	}
-	return 0;
+	return retVal;
 }
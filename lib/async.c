@@ -0,0 +1,114 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include "fx2loader.h"
+
+struct FX2BulkQueue {
+	FX2Session *session;
+	void *backendQueue;   // NULL if the transfers are done synchronously instead
+	uint8 ep;
+	uint32 depth;
+	uint32 oldest;        // slot of the oldest pending transfer
+	uint32 numPending;
+	uint8 **data;         // each slot's buffer and length, for the synchronous fallback
+	uint32 *lengths;
+};
+
+// Open a queue of up to depth bulk transfers on the given endpoint (which includes the direction
+// bit, as in libusb).
+//
+FX2Status fx2BulkQueueOpen(FX2Session *session, uint8 ep, uint32 depth, FX2BulkQueue **queue) {
+	FX2BulkQueue *const newQueue = (FX2BulkQueue *)calloc(1, sizeof(FX2BulkQueue));
+	if ( !newQueue ) {
+		goto allocFailed;
+	}
+	newQueue->data = (uint8 **)calloc(depth, sizeof(uint8 *));
+	newQueue->lengths = (uint32 *)calloc(depth, sizeof(uint32));
+	if ( !newQueue->data || !newQueue->lengths ) {
+		free(newQueue->lengths);
+		free(newQueue->data);
+		free(newQueue);
+		goto allocFailed;
+	}
+	newQueue->session = session;
+	newQueue->ep = ep;
+	newQueue->depth = depth;
+	if ( session->backend->queueOpen ) {
+		newQueue->backendQueue = session->backend->queueOpen(session->device, ep, depth);
+	}
+	*queue = newQueue;
+	return FX2_SUCCESS;
+allocFailed:
+	fx2SetError(&session->error, FX2_BUFERR, FX2_PHASE_NONE, 0, 0x0000, "Cannot allocate bulk queue\n");
+	return FX2_BUFERR;
+}
+
+int fx2BulkQueueSubmit(FX2BulkQueue *queue, uint8 *data, uint32 length) {
+	const uint32 slot = (queue->oldest + queue->numPending) % queue->depth;
+	if ( queue->backendQueue ) {
+		const int returnCode = queue->session->backend->queueSubmit(queue->backendQueue, slot, data, length);
+		if ( returnCode < 0 ) {
+			return returnCode;
+		}
+	}
+	queue->data[slot] = data;
+	queue->lengths[slot] = length;
+	queue->numPending++;
+	return 0;
+}
+
+int fx2BulkQueueReap(FX2BulkQueue *queue, uint32 timeout) {
+	const uint32 slot = queue->oldest;
+	FX2Session *const session = queue->session;
+	int returnCode;
+	if ( queue->backendQueue ) {
+		returnCode = session->backend->queueReap(queue->backendQueue, slot, timeout);
+	} else if ( queue->ep & 0x80 ) {
+		returnCode = session->backend->bulkRead(
+			session->device, queue->ep, queue->data[slot], queue->lengths[slot], timeout);
+	} else {
+		returnCode = session->backend->bulkWrite(
+			session->device, queue->ep, queue->data[slot], queue->lengths[slot], timeout);
+	}
+	queue->oldest = (slot + 1) % queue->depth;
+	queue->numPending--;
+	return returnCode;
+}
+
+uint32 fx2BulkQueuePending(const FX2BulkQueue *queue) {
+	return queue->numPending;
+}
+
+// How many transfers can really be on the bus at once: the depth, or just one if they're being
+// done synchronously.
+//
+uint32 fx2BulkQueueInFlight(const FX2BulkQueue *queue) {
+	return queue->backendQueue ? queue->depth : 1;
+}
+
+// Cancel anything still pending and free the queue. Safe to call with NULL.
+//
+void fx2BulkQueueClose(FX2BulkQueue *queue) {
+	if ( queue ) {
+		if ( queue->backendQueue ) {
+			queue->session->backend->queueClose(queue->backendQueue);
+		}
+		free(queue->lengths);
+		free(queue->data);
+		free(queue);
+	}
+}
@@ -0,0 +1,232 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fx2loader.h"
+#include "bitset.h"
+#include "mask.h"
+
+#ifdef WIN32
+#pragma warning(disable : 4996)
+#define snprintf sprintf_s
+#endif
+
+#define WORD_BITS 64
+#define ALL_ONES (~(BitsetWord)0)
+
+// Index of the lowest set bit of a nonzero word
+//
+static uint32 lowestBit(BitsetWord word) {
+	#ifdef __GNUC__
+		return (uint32)__builtin_ctzll(word);
+	#else
+		uint32 index = 0;
+		while ( !(word & 0xFF) ) {
+			word >>= 8;
+			index += 8;
+		}
+		while ( !(word & 1) ) {
+			word >>= 1;
+			index++;
+		}
+		return index;
+	#endif
+}
+
+static uint32 countBits(BitsetWord word) {
+	#ifdef __GNUC__
+		return (uint32)__builtin_popcountll(word);
+	#else
+		word = word - ((word >> 1) & 0x5555555555555555ULL);
+		word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+		word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+		return (uint32)((word * 0x0101010101010101ULL) >> 56);
+	#endif
+}
+
+// Make sure there is room for the supplied length, and extend the length to it if it's longer.
+//
+static BitsetStatus grow(Bitset *self, uint32 length) {
+	const uint32 wordsNeeded = (length + WORD_BITS - 1) / WORD_BITS;
+	if ( wordsNeeded > self->numWords ) {
+		uint32 newNumWords = self->numWords ? self->numWords : 1;
+		BitsetWord *newWords;
+		while ( newNumWords < wordsNeeded ) {
+			newNumWords *= 2;
+		}
+		newWords = (BitsetWord *)realloc(self->words, newNumWords * sizeof(BitsetWord));
+		if ( !newWords ) {
+			snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "Cannot grow bitset to %lu bits", length);
+			return BITSET_NO_MEM;
+		}
+		memset(newWords + self->numWords, 0, (newNumWords - self->numWords) * sizeof(BitsetWord));
+		self->words = newWords;
+		self->numWords = newNumWords;
+	}
+	if ( length > self->length ) {
+		self->length = length;
+	}
+	return BITSET_SUCCESS;
+}
+
+BitsetStatus bitsetInitialise(Bitset *self, uint32 initialLength) {
+	self->words = NULL;
+	self->numWords = 0;
+	self->length = 0;
+	if ( grow(self, initialLength ? initialLength : WORD_BITS) ) {
+		return BITSET_NO_MEM;
+	}
+	self->length = 0;
+	return BITSET_SUCCESS;
+}
+
+void bitsetDestroy(Bitset *self) {
+	free(self->words);
+	self->words = NULL;
+	self->numWords = 0;
+	self->length = 0;
+}
+
+// Set or clear the bits in [start, end), a word at a time in the middle.
+//
+static void fillRange(Bitset *self, uint32 start, uint32 end, bool value) {
+	uint32 first = start / WORD_BITS;
+	const uint32 last = (end - 1) / WORD_BITS;
+	BitsetWord headMask = ALL_ONES << (start % WORD_BITS);
+	const BitsetWord tailMask = ALL_ONES >> (WORD_BITS - 1 - (end - 1) % WORD_BITS);
+	if ( first == last ) {
+		headMask &= tailMask;
+	}
+	if ( value ) {
+		self->words[first] |= headMask;
+	} else {
+		self->words[first] &= ~headMask;
+	}
+	if ( first == last ) {
+		return;
+	}
+	for ( first++; first < last; first++ ) {
+		self->words[first] = value ? ALL_ONES : 0;
+	}
+	if ( value ) {
+		self->words[last] |= tailMask;
+	} else {
+		self->words[last] &= ~tailMask;
+	}
+}
+
+BitsetStatus bitsetSetRange(Bitset *self, uint32 start, uint32 count) {
+	if ( count == 0 ) {
+		return BITSET_SUCCESS;
+	}
+	if ( grow(self, start + count) ) {
+		return BITSET_NO_MEM;
+	}
+	fillRange(self, start, start + count, true);
+	return BITSET_SUCCESS;
+}
+
+void bitsetClearRange(Bitset *self, uint32 start, uint32 count) {
+	uint32 end = start + count;
+	if ( end > self->length ) {
+		end = self->length;
+	}
+	if ( start < end ) {
+		fillRange(self, start, end, false);
+	}
+}
+
+bool bitsetTest(const Bitset *self, uint32 index) {
+	return (index < self->length && (self->words[index / WORD_BITS] >> (index % WORD_BITS)) & 1) ? true : false;
+}
+
+uint32 bitsetCount(const Bitset *self) {
+	const uint32 numWords = (self->length + WORD_BITS - 1) / WORD_BITS;
+	uint32 count = 0, i;
+	for ( i = 0; i < numWords; i++ ) {
+		count += countBits(self->words[i]);
+	}
+	return count;
+}
+
+uint32 bitsetFindSet(const Bitset *self, uint32 from) {
+	const uint32 numWords = (self->length + WORD_BITS - 1) / WORD_BITS;
+	uint32 index = from / WORD_BITS;
+	BitsetWord word;
+	if ( from >= self->length ) {
+		return from;
+	}
+	word = self->words[index] & (ALL_ONES << (from % WORD_BITS));
+	while ( !word ) {
+		if ( ++index == numWords ) {
+			return self->length;
+		}
+		word = self->words[index];
+	}
+	return index * WORD_BITS + lowestBit(word);
+}
+
+uint32 bitsetFindClear(const Bitset *self, uint32 from) {
+	const uint32 numWords = (self->length + WORD_BITS - 1) / WORD_BITS;
+	uint32 index = from / WORD_BITS, result;
+	BitsetWord word;
+	if ( from >= self->length ) {
+		return from;
+	}
+	word = ~self->words[index] & (ALL_ONES << (from % WORD_BITS));
+	while ( !word ) {
+		if ( ++index == numWords ) {
+			return self->length;
+		}
+		word = ~self->words[index];
+	}
+	result = index * WORD_BITS + lowestBit(word);
+	return (result < self->length) ? result : self->length;
+}
+
+BitsetStatus bitsetFromMask(Bitset *self, const Buffer *mask) {
+	uint32 start, end;
+	memset(self->words, 0, self->numWords * sizeof(BitsetWord));
+	self->length = 0;
+	if ( grow(self, mask->length) ) {
+		return BITSET_NO_MEM;
+	}
+	start = maskFindSet(mask->data, 0, mask->length);
+	while ( start < mask->length ) {
+		end = maskFindClear(mask->data, start, mask->length);
+		fillRange(self, start, end, true);
+		start = maskFindSet(mask->data, end, mask->length);
+	}
+	return BITSET_SUCCESS;
+}
+
+BitsetStatus bitsetToMask(const Bitset *self, Buffer *mask) {
+	uint8 *ptr;
+	uint32 start, end;
+	if ( bufAppendZeros(mask, self->length, &ptr) ) {
+		snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "Buffer error: %s", bufStrError());
+		return BITSET_NO_MEM;
+	}
+	start = bitsetFindSet(self, 0);
+	while ( start < self->length ) {
+		end = bitsetFindClear(self, start);
+		memset(ptr + start, 0x01, end - start);
+		start = bitsetFindSet(self, end);
+	}
+	return BITSET_SUCCESS;
+}
@@ -0,0 +1,68 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BITSET_H
+#define BITSET_H
+
+#include "types.h"
+#include "buffer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	typedef enum {
+		BITSET_SUCCESS,
+		BITSET_NO_MEM
+	} BitsetStatus;
+
+	// A packed address mask: one bit per address, rather than the one byte per address of a
+	// Buffer mask. Like a Buffer, it has a length (one more than the highest address ever marked,
+	// or whatever length it was converted from), and grows as needed. Bits at or beyond the length
+	// are always clear.
+	//
+	typedef unsigned long long BitsetWord;
+	typedef struct {
+		BitsetWord *words;
+		uint32 numWords;
+		uint32 length;
+	} Bitset;
+
+	BitsetStatus bitsetInitialise(Bitset *self, uint32 initialLength);
+	void bitsetDestroy(Bitset *self);
+	BitsetStatus bitsetSetRange(Bitset *self, uint32 start, uint32 count);
+	void bitsetClearRange(Bitset *self, uint32 start, uint32 count);
+	bool bitsetTest(const Bitset *self, uint32 index);
+	uint32 bitsetCount(const Bitset *self);
+
+	// Find the first set (or clear) bit at or after "from". Everything past the end counts as
+	// clear, so bitsetFindSet() returns the length if there is no set bit (or "from" itself, if
+	// that's already past the end), and bitsetFindClear() never returns more than that either.
+	//
+	uint32 bitsetFindSet(const Bitset *self, uint32 from);
+	uint32 bitsetFindClear(const Bitset *self, uint32 from);
+
+	// Adapters to and from byte-per-address masks. bitsetFromMask() replaces the bitset's
+	// contents, and bitsetToMask() appends to the supplied (normally empty) mask buffer.
+	//
+	BitsetStatus bitsetFromMask(Bitset *self, const Buffer *mask);
+	BitsetStatus bitsetToMask(const Bitset *self, Buffer *mask);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
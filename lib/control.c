@@ -0,0 +1,331 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include "fx2loader.h"
+#include "usbwrap.h"
+#include "sys.h"
+
+// libusb-0.1 has no asynchronous control transfers, but usb_control_msg() may be called on the
+// same handle from several threads at once. The kernel then queues the requests on EP0 and sends
+// them back-to-back, so with a few worker threads the bus never sits idle waiting for a round
+// trip through userspace. The chunks may complete in any order, so this is only used for
+// requests which are independent of each other (e.g RAM writes at different addresses); the
+// caller does anything which must be ordered (e.g CPUCS) before or after the whole queue.
+//
+struct FX2ControlQueue {
+	FX2Session *session;
+	uint8 requestType;
+	uint8 bRequest;
+	FX2Phase phase;
+	const FX2Chunk *chunks;
+	uint32 numChunks;
+	uint32 next;
+	FX2Chunk *owned;
+	uint32 capacity;
+	bool closed;
+	SysMutex *lock;
+	SysCond *changed;
+	bool failed;
+	uint32 failIndex;
+	int failCode;
+	SysThread *threads[FX2_MAX_QUEUE_DEPTH];
+	uint32 numStarted;
+};
+
+// Take chunks off the queue and send them until there are none left. If the queue is still open
+// for more chunks, sleep until one is added (or the queue is closed, or a transfer fails) rather
+// than finishing.
+//
+static void queueWorker(void *arg) {
+	FX2ControlQueue *const queue = (FX2ControlQueue *)arg;
+	FX2Chunk chunk;
+	uint32 index;
+	int returnCode;
+	for ( ; ; ) {
+		sysMutexLock(queue->lock);
+		while ( !queue->failed && !queue->closed && queue->next >= queue->numChunks ) {
+			sysCondWait(queue->changed, queue->lock);
+		}
+		if ( queue->failed || queue->next >= queue->numChunks ) {
+			sysMutexUnlock(queue->lock);
+			break;
+		}
+		index = queue->next++;
+		chunk = queue->chunks[index];  // the array may be reallocated once the lock is released
+		sysMutexUnlock(queue->lock);
+		returnCode = fx2SessionControl(
+			queue->session, queue->requestType, queue->bRequest,
+			chunk.address, 0x0000, chunk.data, chunk.length, 5000
+		);
+		if ( returnCode != (int)chunk.length ) {
+			sysMutexLock(queue->lock);
+			if ( !queue->failed || index < queue->failIndex ) {
+				queue->failed = true;
+				queue->failIndex = index;
+				queue->failCode = returnCode;
+			}
+			sysCondBroadcast(queue->changed);
+			sysMutexUnlock(queue->lock);
+		}
+	}
+}
+
+// Set how many control transfers may be queued at once. One means no pipelining at all.
+//
+void fx2SessionSetQueueDepth(FX2Session *session, uint32 depth) {
+	session->queueDepth = depth ? depth : 1;
+}
+
+static FX2Status queueInit(
+	FX2ControlQueue *queue, FX2Session *session, uint8 bRequest, bool isRead, FX2Phase phase)
+{
+	if ( sysMutexCreate(&queue->lock) ) {
+		fx2SetError(&session->error, FX2_BUFERR, phase, 0, 0x0000, "Cannot allocate control queue lock\n");
+		return FX2_BUFERR;
+	}
+	if ( sysCondCreate(&queue->changed) ) {
+		sysMutexDestroy(queue->lock);
+		fx2SetError(&session->error, FX2_BUFERR, phase, 0, 0x0000, "Cannot allocate control queue condition\n");
+		return FX2_BUFERR;
+	}
+	queue->session = session;
+	queue->requestType = (uint8)(
+		(isRead ? USB_ENDPOINT_IN : USB_ENDPOINT_OUT) | USB_TYPE_VENDOR | USB_RECIP_DEVICE);
+	queue->bRequest = bRequest;
+	queue->phase = phase;
+	queue->chunks = NULL;
+	queue->numChunks = 0;
+	queue->next = 0;
+	queue->owned = NULL;
+	queue->capacity = 0;
+	queue->closed = false;
+	queue->failed = false;
+	queue->failIndex = 0;
+	queue->failCode = 0;
+	queue->numStarted = 0;
+	return FX2_SUCCESS;
+}
+
+static void queueStart(FX2ControlQueue *queue, uint32 numThreads) {
+	if ( numThreads > FX2_MAX_QUEUE_DEPTH ) {
+		numThreads = FX2_MAX_QUEUE_DEPTH;
+	}
+	while ( queue->numStarted < numThreads ) {
+		if ( sysThreadCreate(&queue->threads[queue->numStarted], queueWorker, queue) ) {
+			break;
+		}
+		queue->numStarted++;
+	}
+}
+
+// Wait for the workers, then report the first failure (by chunk order, not completion order).
+//
+static FX2Status queueFinish(FX2ControlQueue *queue) {
+	FX2Session *const session = queue->session;
+	const bool isRead = (queue->requestType & USB_ENDPOINT_IN) ? true : false;
+	uint32 i;
+	for ( i = 0; i < queue->numStarted; i++ ) {
+		sysThreadJoin(queue->threads[i]);
+	}
+	sysCondDestroy(queue->changed);
+	sysMutexDestroy(queue->lock);
+	if ( queue->failed ) {
+		const FX2Chunk *const chunk = queue->chunks + queue->failIndex;
+		fx2SetError(
+			&session->error, FX2_USBERR, queue->phase, queue->failCode, chunk->address,
+			"Failed to %s block of %d bytes at 0x%04X - returnCode %d: %s\n",
+			isRead ? "read" : "write", chunk->length, chunk->address, queue->failCode, fx2SessionStrUsbError(session, queue->failCode));
+		return FX2_USBERR;
+	}
+	return FX2_SUCCESS;
+}
+
+// Send (or receive) every chunk, with up to the session's queue depth in flight at once. Returns
+// when all of them have completed, or when the first failure has been recorded in the session.
+//
+FX2Status fx2ControlQueue(
+	FX2Session *session, uint8 bRequest, bool isRead,
+	const FX2Chunk *chunks, uint32 numChunks, FX2Phase phase)
+{
+	FX2ControlQueue queue;
+	uint32 numWorkers = session->queueDepth;
+	FX2Status status = queueInit(&queue, session, bRequest, isRead, phase);
+	if ( status ) {
+		return status;
+	}
+	if ( numWorkers > numChunks ) {
+		numWorkers = numChunks;
+	}
+	if ( numWorkers > FX2_MAX_QUEUE_DEPTH ) {
+		numWorkers = FX2_MAX_QUEUE_DEPTH;
+	}
+	queue.chunks = chunks;
+	queue.numChunks = numChunks;
+	queue.closed = true;
+
+	// The calling thread is one of the workers, so a depth of one starts no threads at all
+	//
+	if ( numWorkers > 1 ) {
+		queueStart(&queue, numWorkers - 1);
+	}
+	queueWorker(&queue);
+	return queueFinish(&queue);
+}
+
+// Start a queue which is fed chunks one at a time with fx2ControlQueueAdd(), so the caller can
+// carry on producing them (e.g decoding a file) while the earlier ones are on the wire. The
+// session's queue depth worth of threads wait for chunks from the start.
+//
+FX2Status fx2ControlQueueOpen(
+	FX2Session *session, uint8 bRequest, bool isRead, FX2Phase phase, FX2ControlQueue **queue)
+{
+	FX2Status status;
+	FX2ControlQueue *const newQueue = (FX2ControlQueue *)malloc(sizeof(FX2ControlQueue));
+	if ( !newQueue ) {
+		fx2SetError(&session->error, FX2_BUFERR, phase, 0, 0x0000, "Cannot allocate control queue\n");
+		return FX2_BUFERR;
+	}
+	status = queueInit(newQueue, session, bRequest, isRead, phase);
+	if ( status ) {
+		free(newQueue);
+		return status;
+	}
+	queueStart(newQueue, session->queueDepth);
+	*queue = newQueue;
+	return FX2_SUCCESS;
+}
+
+// Add a chunk to an open queue. The data must stay put until the queue is closed. If a transfer
+// has already failed there's no point queueing any more, so this returns FX2_USBERR, and the
+// details come from fx2ControlQueueClose().
+//
+FX2Status fx2ControlQueueAdd(FX2ControlQueue *queue, uint16 address, uint8 *data, uint16 length) {
+	FX2Status status = FX2_SUCCESS;
+	sysMutexLock(queue->lock);
+	if ( queue->failed ) {
+		status = FX2_USBERR;
+		goto exit;
+	}
+	if ( queue->numChunks == queue->capacity ) {
+		const uint32 newCapacity = queue->capacity ? 2 * queue->capacity : 16;
+		FX2Chunk *const newChunks = (FX2Chunk *)realloc(queue->owned, newCapacity * sizeof(FX2Chunk));
+		if ( !newChunks ) {
+			fx2SetError(
+				&queue->session->error, FX2_BUFERR, queue->phase, 0, address,
+				"Cannot allocate control queue entries\n");
+			status = FX2_BUFERR;
+			goto exit;
+		}
+		queue->owned = newChunks;
+		queue->chunks = newChunks;
+		queue->capacity = newCapacity;
+	}
+	queue->owned[queue->numChunks].address = address;
+	queue->owned[queue->numChunks].length = length;
+	queue->owned[queue->numChunks].data = data;
+	queue->numChunks++;
+	sysCondSignal(queue->changed);
+exit:
+	sysMutexUnlock(queue->lock);
+	return status;
+}
+
+// Say there are no more chunks coming, wait for the ones already queued, and free the queue. The
+// result is that of the first chunk (in the order they were added) to fail, if any did.
+//
+FX2Status fx2ControlQueueClose(FX2ControlQueue *queue) {
+	FX2Status status;
+	sysMutexLock(queue->lock);
+	queue->closed = true;
+	sysCondBroadcast(queue->changed);
+	sysMutexUnlock(queue->lock);
+	if ( !queue->numStarted ) {
+		queueWorker(queue);  // no threads could be started, so do it all here
+	}
+	status = queueFinish(queue);
+	free(queue->owned);
+	free(queue);
+	return status;
+}
+
+// A batch of arbitrary requests, shared by the threads sending it
+//
+typedef struct {
+	FX2Session *session;
+	FX2Request *requests;
+	uint32 numRequests;
+	uint32 next;
+	SysMutex *lock;
+} Batch;
+
+static void batchWorker(void *arg) {
+	Batch *const batch = (Batch *)arg;
+	FX2Request *request;
+	for ( ; ; ) {
+		sysMutexLock(batch->lock);
+		if ( batch->next >= batch->numRequests ) {
+			sysMutexUnlock(batch->lock);
+			break;
+		}
+		request = batch->requests + batch->next++;
+		sysMutexUnlock(batch->lock);
+		request->returnCode = fx2SessionControl(
+			batch->session, request->requestType, request->request,
+			request->value, request->index, request->data, request->length, request->timeout
+		);
+	}
+}
+
+// Send a batch of unrelated control transfers, with up to the session's queue depth in flight at
+// once, and fill in each one's return code. As with fx2ControlQueue(), they may complete in any
+// order, so the caller must only batch requests which don't depend on each other. Every request
+// is sent even if some fail; the result is FX2_BUFERR only if the batch couldn't be started.
+//
+FX2Status fx2SessionControlBatch(FX2Session *session, FX2Request *requests, uint32 numRequests) {
+	Batch batch;
+	SysThread *threads[FX2_MAX_QUEUE_DEPTH];
+	uint32 numWorkers = session->queueDepth, numStarted = 0, i;
+	if ( sysMutexCreate(&batch.lock) ) {
+		fx2SetError(&session->error, FX2_BUFERR, FX2_PHASE_NONE, 0, 0x0000, "Cannot allocate control batch lock\n");
+		return FX2_BUFERR;
+	}
+	batch.session = session;
+	batch.requests = requests;
+	batch.numRequests = numRequests;
+	batch.next = 0;
+	if ( numWorkers > numRequests ) {
+		numWorkers = numRequests;
+	}
+	if ( numWorkers > FX2_MAX_QUEUE_DEPTH ) {
+		numWorkers = FX2_MAX_QUEUE_DEPTH;
+	}
+
+	// As with fx2ControlQueue(), the calling thread is one of the workers
+	//
+	while ( numStarted + 1 < numWorkers ) {
+		if ( sysThreadCreate(&threads[numStarted], batchWorker, &batch) ) {
+			break;
+		}
+		numStarted++;
+	}
+	batchWorker(&batch);
+	for ( i = 0; i < numStarted; i++ ) {
+		sysThreadJoin(threads[i]);
+	}
+	sysMutexDestroy(batch.lock);
+	return FX2_SUCCESS;
+}
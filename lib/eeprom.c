@@ -15,124 +15,512 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "fx2loader.h"
 #include "usbwrap.h"
 #include "i2c.h"
-
-#ifdef WIN32
-#pragma warning(disable : 4996)
-#define snprintf sprintf_s 
-#endif
-
-extern char fx2ErrorMessage[];
+#include "sys.h"
 
 #define A2_ERROR "This firmware does not seem to support EEPROM operations - try loading an appropriate firmware into RAM first\nDiagnostic information: failed writing %lu bytes to 0x%04X return code %d: %s\n"
+#define BULK_ERROR "Bulk EEPROM %s of %lu bytes at 0x%04X failed with return code %d: %s\n"
 #define BLOCK_SIZE 4096L
+#define BULK_READ_SIZE 0x8000L
+#define BULK_OUT_EP 0x02
+#define FULL_SPEED_PACKET 64
+#define CONFIG_MAXLENGTH 256
+#define BULK_POLL_MICROS 1000
+#define BULK_WAIT_MICROS 5000000L
 
-// Write the supplied reader buffer to EEPROM, using the supplied VID/PID.
+// Find the wMaxPacketSize of the given endpoint from the device's configuration descriptor, which
+// the firmware switches to suit the speed it's running at (EP2OUT is 512 bytes at high speed, 64
+// at full speed). If it can't be found, assume the full-speed size: at worst that costs a
+// zero-length packet the firmware throws away, whereas assuming too big a packet would leave a
+// transfer which ends on a full packet unterminated.
 //
-FX2Status fx2WriteEEPROM(uint16 vid, uint16 pid, const Buffer *i2cBuffer) {
+static uint32 bulkPacketSize(FX2Session *session, uint8 ep) {
+	uint8 config[CONFIG_MAXLENGTH];
+	uint32 i, length, packetSize;
+	int returnCode = fx2SessionControl(
+		session,
+		(USB_ENDPOINT_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE),
+		USB_REQ_GET_DESCRIPTOR, USB_DT_CONFIG << 8, 0x0000, config, CONFIG_MAXLENGTH, 5000
+	);
+	if ( returnCode < 4 || config[1] != USB_DT_CONFIG ) {
+		return FULL_SPEED_PACKET;
+	}
+	length = config[2] | (config[3] << 8);
+	if ( length > (uint32)returnCode ) {
+		length = (uint32)returnCode;
+	}
+	for ( i = 0; i + 2 <= length && config[i] >= 2; i += config[i] ) {
+		if ( config[i + 1] == USB_DT_ENDPOINT && i + 6 <= length && config[i + 2] == ep ) {
+			packetSize = (config[i + 4] | (config[i + 5] << 8)) & 0x07FF;
+			return packetSize ? packetSize : FULL_SPEED_PACKET;
+		}
+	}
+	return FULL_SPEED_PACKET;
+}
+
+// Write to the EEPROM through the firmware's bulk mode: vendor command 0xA4 gives the address and
+// page size, then the data goes to EP2OUT, ending with a short packet (a zero-length one if need
+// be), then 0xA3 is polled until the last page has been committed. If the firmware refuses 0xA4
+// then nothing has been written, and *isSupported is cleared so the caller can fall back to 0xA2.
+//
+static FX2Status bulkWrite(
+	FX2Session *session, uint16 address, const uint8 *bufPtr, uint32 length, uint32 pageSize,
+	bool *isSupported)
+{
+	long long deadline;
+	uint32 packetSize;
+	uint8 busy;
+	int returnCode = fx2SessionControl(
+		session,
+		(USB_ENDPOINT_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE),
+		0xA4, address, (uint16)pageSize, NULL, 0, 5000
+	);
+	*isSupported = (returnCode >= 0);
+	if ( !*isSupported ) {
+		return FX2_USBERR;
+	}
+	packetSize = bulkPacketSize(session, BULK_OUT_EP);
+	returnCode = fx2SessionBulkWrite(session, BULK_OUT_EP, bufPtr, length, 5000 + length / 16);
+	if ( returnCode != (int)length ) {
+		goto fail;
+	}
+	if ( length && length % packetSize == 0 ) {
+		// The data ended on a full packet, so the firmware is still waiting for a short one
+		//
+		returnCode = fx2SessionBulkWrite(session, BULK_OUT_EP, bufPtr, 0, 5000);
+		if ( returnCode != 0 ) {
+			goto fail;
+		}
+	}
+	deadline = sysTimeMicros() + BULK_WAIT_MICROS;
+	for ( ; ; ) {
+		returnCode = fx2SessionControl(
+			session,
+			(USB_ENDPOINT_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE),
+			0xA3, 0x0000, 0x0000, &busy, 1, 5000
+		);
+		if ( returnCode != 1 ) {
+			goto fail;
+		}
+		if ( !busy ) {
+			return FX2_SUCCESS;
+		}
+		if ( sysTimeMicros() > deadline ) {
+			fx2SetError(
+				&session->error, FX2_USBERR, FX2_PHASE_EEPROM_WRITE, 0, address,
+				"Bulk EEPROM write of %lu bytes at 0x%04X did not complete\n", length, address);
+			return FX2_USBERR;
+		}
+		sysSleepMicros(BULK_POLL_MICROS);
+	}
+fail:
+	fx2SetError(
+		&session->error, FX2_USBERR, FX2_PHASE_EEPROM_WRITE, returnCode, address,
+		BULK_ERROR, "write", length, address, returnCode, fx2SessionStrUsbError(session, returnCode));
+	return FX2_USBERR;
+}
+
+// Read from the EEPROM through the firmware's bulk mode: vendor command 0xA5 gives the address and
+// length, then the data comes from EP4IN. Each command reads at most BULK_READ_SIZE, since the
+// length has to fit in wIndex. As with bulkWrite(), *isSupported is cleared if the firmware refuses
+// the first command.
+//
+static FX2Status bulkRead(
+	FX2Session *session, uint16 address, uint8 *bufPtr, uint32 length, bool *isSupported)
+{
+	uint32 chunkSize;
+	int returnCode;
+	*isSupported = true;
+	do {
+		chunkSize = (length > BULK_READ_SIZE) ? BULK_READ_SIZE : length;
+		returnCode = fx2SessionControl(
+			session,
+			(USB_ENDPOINT_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE),
+			0xA5, address, (uint16)chunkSize, NULL, 0, 5000
+		);
+		if ( returnCode < 0 ) {
+			if ( address == 0x0000 ) {
+				*isSupported = false;
+				return FX2_USBERR;
+			}
+			goto fail;
+		}
+		if ( chunkSize ) {
+			returnCode = fx2SessionBulkRead(session, 0x84, bufPtr, chunkSize, 5000);
+			if ( returnCode != (int)chunkSize ) {
+				goto fail;
+			}
+		}
+		length -= chunkSize;
+		bufPtr += chunkSize;
+		address = (uint16)(address + chunkSize);
+	} while ( length );
+	return FX2_SUCCESS;
+fail:
+	fx2SetError(
+		&session->error, FX2_USBERR, FX2_PHASE_EEPROM_READ, returnCode, address,
+		BULK_ERROR, "read", chunkSize, address, returnCode, fx2SessionStrUsbError(session, returnCode));
+	return FX2_USBERR;
+}
+
+// Write the supplied reader buffer to EEPROM, using an already-open session. The firmware's bulk
+// mode is used if it has one, otherwise it's written with 0xA2 a block at a time.
+//
+FX2Status fx2SessionWriteEEPROM(FX2Session *session, const Buffer *i2cBuffer) {
 	FX2Status status;
-	UsbDeviceHandle *deviceHandle;
 	uint16 address = 0x0000;
 	const uint8 *bufPtr;
 	uint32 bytesRemaining;
 	int returnCode;
+	bool isSupported;
+	status = bulkWrite(session, 0x0000, i2cBuffer->data, i2cBuffer->length, 0, &isSupported);
+	if ( isSupported ) {
+		goto exit;
+	}
 	bufPtr = i2cBuffer->data;
 	bytesRemaining = i2cBuffer->length;
-	usbInitialise();
-	if ( usbOpenDevice(vid, pid, 1, 0, 0, &deviceHandle) ) {
-		snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "%s\n", usbStrError());
-		status = FX2_USBERR;
-		goto cleanup;
-	}
-	usb_clear_halt(deviceHandle, 2);
 	while ( bytesRemaining > BLOCK_SIZE ) {
-		returnCode = usb_control_msg(
-			deviceHandle,
+		returnCode = fx2SessionControl(
+			session,
 			(USB_ENDPOINT_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE),
-			0xA2, address, 0x0000, (char*)bufPtr, BLOCK_SIZE, 5000
+			0xA2, address, 0x0000, (uint8*)bufPtr, (uint16)BLOCK_SIZE, 5000
 		);
 		if ( returnCode != BLOCK_SIZE ) {
-			snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, A2_ERROR, BLOCK_SIZE, address, returnCode, usb_strerror());
+			fx2SetError(
+				&session->error, FX2_USBERR, FX2_PHASE_EEPROM_WRITE, returnCode, address,
+				A2_ERROR, BLOCK_SIZE, address, returnCode, fx2SessionStrUsbError(session, returnCode));
 			status = FX2_USBERR;
-			goto cleanup;
+			goto exit;
 		}
 		bytesRemaining -= BLOCK_SIZE;
 		bufPtr += BLOCK_SIZE;
 		address += BLOCK_SIZE;
 	}
-	returnCode = usb_control_msg(
-		deviceHandle,
+	returnCode = fx2SessionControl(
+		session,
 		(USB_ENDPOINT_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE),
-		0xA2, address, 0x0000, (char*)bufPtr, bytesRemaining, 5000
+		0xA2, address, 0x0000, (uint8*)bufPtr, (uint16)bytesRemaining, 5000
 	);
 	if ( returnCode != (int)bytesRemaining ) {
-		snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, A2_ERROR, bytesRemaining, address, returnCode, usb_strerror());
+		fx2SetError(
+			&session->error, FX2_USBERR, FX2_PHASE_EEPROM_WRITE, returnCode, address,
+			A2_ERROR, bytesRemaining, address, returnCode, fx2SessionStrUsbError(session, returnCode));
 		status = FX2_USBERR;
-		goto cleanup;
+		goto exit;
 	}
 
 	status = FX2_SUCCESS;
 
-cleanup:
-	usb_release_interface(deviceHandle, 0);
-	usb_close(deviceHandle);
+exit:
 	return status;
 }
 
-// Read from the EEPROM into the supplied buffer, using the supplied VID/PID.
+// Read from the EEPROM into the supplied buffer, using an already-open session. As with writes,
+// the firmware's bulk mode is used if it has one.
 //
-FX2Status fx2ReadEEPROM(uint16 vid, uint16 pid, uint32 numBytes, Buffer *i2cBuffer) {
+FX2Status fx2SessionReadEEPROM(FX2Session *session, uint32 numBytes, Buffer *i2cBuffer) {
 	FX2Status status;
-	UsbDeviceHandle *deviceHandle;
 	uint16 address = 0x0000;
 	uint8 *bufPtr;
 	int returnCode;
+	bool isSupported;
+	const uint32 start = i2cBuffer->length;
 	if ( bufAppendZeros(i2cBuffer, numBytes, NULL) ) {
-		snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "%s\n", bufStrError());
+		fx2SetError(&session->error, FX2_BUFERR, FX2_PHASE_EEPROM_READ, 0, 0x0000, "%s\n", bufStrError());
 		status = FX2_BUFERR;
 		goto exit;
 	}
-	bufPtr = i2cBuffer->data;
-	usbInitialise();
-	if ( usbOpenDevice(vid, pid, 1, 0, 0, &deviceHandle) ) {
-		snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "%s\n", usbStrError());
-		status = FX2_USBERR;
+	bufPtr = i2cBuffer->data + start;
+	status = bulkRead(session, 0x0000, bufPtr, numBytes, &isSupported);
+	if ( isSupported ) {
 		goto exit;
 	}
-	usb_clear_halt(deviceHandle, 2);
 	while ( numBytes > BLOCK_SIZE ) {
-		returnCode = usb_control_msg(
-			deviceHandle,
+		returnCode = fx2SessionControl(
+			session,
 			(USB_ENDPOINT_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE),
-			0xA2, address, 0x0000, (char*)bufPtr, BLOCK_SIZE, 5000
+			0xA2, address, 0x0000, (uint8*)bufPtr, (uint16)BLOCK_SIZE, 5000
 		);
 		if ( returnCode != BLOCK_SIZE ) {
-			snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, A2_ERROR, BLOCK_SIZE, address, returnCode, usb_strerror());
+			fx2SetError(
+				&session->error, FX2_USBERR, FX2_PHASE_EEPROM_READ, returnCode, address,
+				A2_ERROR, BLOCK_SIZE, address, returnCode, fx2SessionStrUsbError(session, returnCode));
 			status = FX2_USBERR;
-			goto cleanup;
+			goto exit;
 		}
 		numBytes -= BLOCK_SIZE;
 		bufPtr += BLOCK_SIZE;
 		address += BLOCK_SIZE;
 	}
-	returnCode = usb_control_msg(
-		deviceHandle,
+	returnCode = fx2SessionControl(
+		session,
 		(USB_ENDPOINT_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE),
-		0xA2, address, 0x0000, (char*)bufPtr, numBytes, 5000
+		0xA2, address, 0x0000, (uint8*)bufPtr, (uint16)numBytes, 5000
 	);
 	if ( returnCode != (int)numBytes ) {
-		snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, A2_ERROR, numBytes, address, returnCode, usb_strerror());
+		fx2SetError(
+			&session->error, FX2_USBERR, FX2_PHASE_EEPROM_READ, returnCode, address,
+			A2_ERROR, numBytes, address, returnCode, fx2SessionStrUsbError(session, returnCode));
 		status = FX2_USBERR;
-		goto cleanup;
+		goto exit;
 	}
 
 	status = FX2_SUCCESS;
 
-cleanup:
-	usb_release_interface(deviceHandle, 0);
-	usb_close(deviceHandle);
 exit:
 	return status;
 }
+
+// Read length bytes (at most BLOCK_SIZE) from the EEPROM at address into the supplied buffer.
+//
+static FX2Status readBlock(FX2Session *session, uint16 address, uint8 *bufPtr, uint32 length) {
+	const int returnCode = fx2SessionControl(
+		session,
+		(USB_ENDPOINT_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE),
+		0xA2, address, 0x0000, bufPtr, (uint16)length, 5000
+	);
+	if ( returnCode != (int)length ) {
+		fx2SetError(
+			&session->error, FX2_USBERR, FX2_PHASE_EEPROM_READ, returnCode, address,
+			A2_ERROR, length, address, returnCode, fx2SessionStrUsbError(session, returnCode));
+		return FX2_USBERR;
+	}
+	return FX2_SUCCESS;
+}
+
+// Read just the C2 image from the EEPROM, appending it to the supplied buffer. Rather than
+// reading all maxBytes, this reads the header and then follows the chain of record headers, each
+// read fetching one record's data together with the header of the next, and stops after the final
+// (CPUCS) record. So a few KB image takes a handful of short reads instead of a whole-EEPROM read.
+// If the EEPROM doesn't hold a C2 image, or a record claims to run past maxBytes, it falls back
+// to reading everything up to maxBytes.
+//
+FX2Status fx2SessionReadEEPROMImage(FX2Session *session, uint32 maxBytes, Buffer *i2cBuffer) {
+	FX2Status status;
+	const uint32 start = i2cBuffer->length;
+	uint32 offset, recordLength, numBytes;
+	bool isLast;
+	if ( maxBytes < 8+4 ) {
+		return fx2SessionReadEEPROM(session, maxBytes, i2cBuffer);
+	}
+	if ( bufAppendZeros(i2cBuffer, 8+4, NULL) ) {
+		fx2SetError(&session->error, FX2_BUFERR, FX2_PHASE_EEPROM_READ, 0, 0x0000, "%s\n", bufStrError());
+		return FX2_BUFERR;
+	}
+	status = readBlock(session, 0x0000, i2cBuffer->data + start, 8+4);
+	if ( status ) {
+		return status;
+	}
+	if ( i2cBuffer->data[start] != 0xC2 ) {
+		goto readAll;
+	}
+
+	// Invariant: the buffer ends with the header of the record at offset
+	//
+	offset = 8;
+	for ( ; ; ) {
+		const uint8 *const header = i2cBuffer->data + start + offset;
+		isLast = (header[0] & 0x80) ? true : false;
+		recordLength = ((header[0] << 8) + header[1]) & 0x03FF;
+		numBytes = isLast ? recordLength : recordLength + 4;
+		if ( offset + 4 + numBytes > maxBytes ) {
+			goto readAll;
+		}
+		if ( numBytes == 0 ) {
+			break;
+		}
+		if ( bufAppendZeros(i2cBuffer, numBytes, NULL) ) {
+			fx2SetError(&session->error, FX2_BUFERR, FX2_PHASE_EEPROM_READ, 0, 0x0000, "%s\n", bufStrError());
+			return FX2_BUFERR;
+		}
+		status = readBlock(session, (uint16)(offset + 4), i2cBuffer->data + start + offset + 4, numBytes);
+		if ( status ) {
+			return status;
+		}
+		if ( isLast ) {
+			break;
+		}
+		offset += 4 + recordLength;
+	}
+	return FX2_SUCCESS;
+
+readAll:
+	i2cBuffer->length = start;
+	return fx2SessionReadEEPROM(session, maxBytes, i2cBuffer);
+}
+
+// Write length bytes (at most BLOCK_SIZE) to the EEPROM at address. The page size goes in wIndex,
+// so the firmware can split the data into page-aligned writes.
+//
+static FX2Status writeBlock(
+	FX2Session *session, uint16 address, const uint8 *bufPtr, uint32 length, uint32 pageSize)
+{
+	const int returnCode = fx2SessionControl(
+		session,
+		(USB_ENDPOINT_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE),
+		0xA2, address, (uint16)pageSize, (uint8*)bufPtr, (uint16)length, 5000
+	);
+	if ( returnCode != (int)length ) {
+		fx2SetError(
+			&session->error, FX2_USBERR, FX2_PHASE_EEPROM_WRITE, returnCode, address,
+			A2_ERROR, length, address, returnCode, fx2SessionStrUsbError(session, returnCode));
+		return FX2_USBERR;
+	}
+	return FX2_SUCCESS;
+}
+
+// Does the page starting at offset need writing? Anything past the end of what's known to be in
+// the EEPROM does.
+//
+static bool pageDiffers(const Buffer *image, const Buffer *current, uint32 offset, uint32 length) {
+	if ( offset + length > current->length ) {
+		return true;
+	}
+	return memcmp(image->data + offset, current->data + offset, length) ? true : false;
+}
+
+// Write the supplied image to EEPROM, but only the pages which differ from what's already there,
+// then read those pages back to check them. The current contents come from the supplied buffer
+// (e.g a copy of what was last written), or if that's NULL they're read from the EEPROM first.
+//
+// The page size must be a power of two. It's passed on to the firmware, which splits each run of
+// changed pages into page-aligned EEPROM writes.
+//
+FX2Status fx2SessionUpdateEEPROM(
+	FX2Session *session, const Buffer *i2cBuffer, const Buffer *current, uint32 pageSize,
+	FX2EepromStats *stats)
+{
+	FX2Status status = FX2_SUCCESS;
+	FX2EepromStats localStats;
+	Buffer readBuffer = {0};
+	uint8 *changed = NULL;
+	uint8 readBack[BLOCK_SIZE];
+	const uint32 length = i2cBuffer->length;
+	uint32 numPages, page, first, offset, runLength;
+	if ( !stats ) {
+		stats = &localStats;
+	}
+	stats->numPages = 0;
+	stats->pagesWritten = 0;
+	stats->bytesWritten = 0;
+	if ( pageSize == 0 || (pageSize & (pageSize - 1)) || pageSize > BLOCK_SIZE ) {
+		fx2SetError(
+			&session->error, FX2_BUFERR, FX2_PHASE_EEPROM_WRITE, 0, 0x0000,
+			"Unsupported EEPROM page size %lu\n", pageSize);
+		return FX2_BUFERR;
+	}
+	numPages = (length + pageSize - 1) / pageSize;
+	stats->numPages = numPages;
+	if ( !current ) {
+		if ( bufInitialise(&readBuffer, length ? length : 1, 0x00) ) {
+			fx2SetError(&session->error, FX2_BUFERR, FX2_PHASE_EEPROM_READ, 0, 0x0000, "%s\n", bufStrError());
+			return FX2_BUFERR;
+		}
+		status = fx2SessionReadEEPROM(session, length, &readBuffer);
+		if ( status ) {
+			goto exit;
+		}
+		current = &readBuffer;
+	}
+	changed = (uint8 *)calloc(numPages ? numPages : 1, 1);
+	if ( !changed ) {
+		fx2SetError(&session->error, FX2_BUFERR, FX2_PHASE_EEPROM_WRITE, 0, 0x0000, "Cannot allocate page list\n");
+		status = FX2_BUFERR;
+		goto exit;
+	}
+
+	// Write each run of changed pages, up to a block at a time
+	//
+	page = 0;
+	while ( page < numPages ) {
+		offset = page * pageSize;
+		runLength = (offset + pageSize > length) ? length - offset : pageSize;
+		if ( !pageDiffers(i2cBuffer, current, offset, runLength) ) {
+			page++;
+			continue;
+		}
+		first = page;
+		changed[page++] = 1;
+		while ( page < numPages && runLength + pageSize <= BLOCK_SIZE ) {
+			const uint32 pageLength = (offset + runLength + pageSize > length) ? length - offset - runLength : pageSize;
+			if ( !pageDiffers(i2cBuffer, current, offset + runLength, pageLength) ) {
+				break;
+			}
+			changed[page++] = 1;
+			runLength += pageLength;
+		}
+		status = writeBlock(session, (uint16)offset, i2cBuffer->data + offset, runLength, pageSize);
+		if ( status ) {
+			goto exit;
+		}
+		stats->pagesWritten += page - first;
+		stats->bytesWritten += runLength;
+	}
+
+	// Read back everything that was written
+	//
+	page = 0;
+	while ( page < numPages ) {
+		if ( !changed[page] ) {
+			page++;
+			continue;
+		}
+		offset = page * pageSize;
+		runLength = 0;
+		while ( page < numPages && changed[page] && runLength + pageSize <= BLOCK_SIZE ) {
+			runLength += (offset + runLength + pageSize > length) ? length - offset - runLength : pageSize;
+			page++;
+		}
+		status = readBlock(session, (uint16)offset, readBack, runLength);
+		if ( status ) {
+			goto exit;
+		}
+		if ( memcmp(readBack, i2cBuffer->data + offset, runLength) ) {
+			uint32 i = 0;
+			while ( readBack[i] == i2cBuffer->data[offset + i] ) {
+				i++;
+			}
+			fx2SetError(
+				&session->error, FX2_VERIFYERR, FX2_PHASE_EEPROM_VERIFY, 0, offset + i,
+				"EEPROM verify failed at 0x%04lX: wrote 0x%02X but read back 0x%02X\n",
+				offset + i, i2cBuffer->data[offset + i], readBack[i]);
+			status = FX2_VERIFYERR;
+			goto exit;
+		}
+	}
+
+exit:
+	free(changed);
+	if ( readBuffer.data ) {
+		bufDestroy(&readBuffer);
+	}
+	return status;
+}
+
+// Write the supplied reader buffer to EEPROM, using the supplied VID/PID.
+//
+FX2Status fx2WriteEEPROM(uint16 vid, uint16 pid, const Buffer *i2cBuffer) {
+	FX2Session *session;
+	FX2Status status = fx2OpenSession(vid, pid, &session);
+	if ( status == FX2_SUCCESS ) {
+		status = fx2SessionWriteEEPROM(session, i2cBuffer);
+		fx2CloseSession(session);
+	}
+	return status;
+}
+
+// Read from the EEPROM into the supplied buffer, using the supplied VID/PID.
+//
+FX2Status fx2ReadEEPROM(uint16 vid, uint16 pid, uint32 numBytes, Buffer *i2cBuffer) {
+	FX2Session *session;
+	FX2Status status = fx2OpenSession(vid, pid, &session);
+	if ( status == FX2_SUCCESS ) {
+		status = fx2SessionReadEEPROM(session, numBytes, i2cBuffer);
+		fx2CloseSession(session);
+	}
+	return status;
+}
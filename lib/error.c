@@ -14,15 +14,48 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
 #include "fx2loader.h"
 
-// Space for an error message
+#ifdef WIN32
+#pragma warning(disable : 4996)
+#define vsnprintf(buf, size, fmt, args) vsnprintf_s(buf, size, _TRUNCATE, fmt, args)
+#endif
+
+// Space for an error message, one per thread
 //
-char fx2ErrorMessage[FX2_ERR_MAXLENGTH];
+FX2_THREAD_LOCAL char fx2ErrorMessage[FX2_ERR_MAXLENGTH];
 
-// Get the last error message, or junk if no error occurred.
+// Get the last error message raised on the calling thread, or junk if no error occurred.
 //
 const char *fx2StrError(void) {
 	return fx2ErrorMessage;
 }
 
+// Get the last error raised on the supplied session.
+//
+const FX2Error *fx2SessionError(const FX2Session *session) {
+	return &session->error;
+}
+
+// Record an error in the calling thread's message buffer and, if supplied, a session's error.
+//
+void fx2SetError(
+	FX2Error *error, FX2Status status, FX2Phase phase, int usbCode, uint32 address,
+	const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vsnprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, format, args);
+	va_end(args);
+	if ( error ) {
+		error->status = status;
+		error->phase = phase;
+		error->usbCode = usbCode;
+		error->address = address;
+		strcpy(error->message, fx2ErrorMessage);
+	}
+}
+
@@ -20,28 +20,288 @@
 #include <stddef.h>
 #include "types.h"
 #include "buffer.h"
+#include "bitset.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
+	// Thread safety: each session may only be used by one thread at a time, but any number of
+	// sessions may be used concurrently, each from its own thread. Opening and closing sessions is
+	// serialised internally, and the i2c*() functions only touch the buffers they are given, so
+	// they may be called from any thread. Errors are recorded in the session they occurred on
+	// (see fx2SessionError()) and in a per-thread message (see fx2StrError()), so one thread's
+	// failure never overwrites another's.
+	//
 	typedef enum {
 		FX2_SUCCESS = 0,
 		FX2_USBERR,
-		FX2_BUFERR
+		FX2_BUFERR,
+		FX2_VERIFYERR
 	} FX2Status;
-	
+
+	// What the library was doing when an error occurred.
+	//
+	typedef enum {
+		FX2_PHASE_NONE = 0,
+		FX2_PHASE_OPEN,
+		FX2_PHASE_CPU_RESET,
+		FX2_PHASE_RAM_WRITE,
+		FX2_PHASE_RAM_READ,
+		FX2_PHASE_CPU_RUN,
+		FX2_PHASE_EEPROM_WRITE,
+		FX2_PHASE_EEPROM_READ,
+		FX2_PHASE_EEPROM_VERIFY
+	} FX2Phase;
+
+	#define FX2_ERR_MAXLENGTH 1024
+	#define FX2_PATH_MAXLENGTH 256
+
+	// The most recent error on a session.
+	//
+	typedef struct {
+		FX2Status status;
+		FX2Phase phase;
+		int usbCode;          // return code of the failing libusb call, or zero
+		uint32 address;       // RAM or EEPROM address being accessed
+		char message[FX2_ERR_MAXLENGTH];
+	} FX2Error;
+
+	// An open connection to one FX2LP. Open it once and pass it to as many RAM and EEPROM
+	// operations as you like; the bus is only enumerated when the session is opened. A session
+	// talks either to a real device through libusb, or to a simulated one (see mock.c).
+	//
+	typedef struct FX2Session FX2Session;
+
 	// Defined in error.c:
 	const char *fx2StrError(void);
+	const FX2Error *fx2SessionError(const FX2Session *session);
+
+	// RAM loads and readback keep up to this many control transfers queued at once (see
+	// fx2SessionSetQueueDepth()), so the bus isn't left idle between them.
+	//
+	#define FX2_DEFAULT_QUEUE_DEPTH 4
+	#define FX2_MAX_QUEUE_DEPTH 32
+
+	// One arbitrary control transfer for fx2SessionControlBatch(). The return code is filled in:
+	// the number of bytes transferred, or a negative libusb error code.
+	//
+	typedef struct {
+		uint8 requestType;
+		uint8 request;
+		uint16 value;
+		uint16 index;
+		uint8 *data;
+		uint16 length;
+		uint32 timeout;
+		int returnCode;
+	} FX2Request;
+
+	// Defined in control.c:
+	void fx2SessionSetQueueDepth(FX2Session *session, uint32 depth);
+	FX2Status fx2SessionControlBatch(FX2Session *session, FX2Request *requests, uint32 numRequests);
+
+	struct usb_dev_handle;
+
+	// Defined in session.c. A path of "mock" opens a simulated device with the default timing.
+	// The raw transfer functions return the number of bytes transferred, or a negative libusb
+	// error code, which fx2SessionStrUsbError() describes; fx2SessionUsbHandle() returns NULL for
+	// a simulated device.
+	//
+	FX2Status fx2OpenSession(uint16 vid, uint16 pid, FX2Session **session);
+	FX2Status fx2OpenSessionPath(const char *path, FX2Session **session);
+	FX2Status fx2ListDevices(
+		uint16 vid, uint16 pid, char paths[][FX2_PATH_MAXLENGTH], uint32 maxDevices, uint32 *numDevices);
+	void fx2CloseSession(FX2Session *session);
+	int fx2SessionControl(
+		FX2Session *session, uint8 requestType, uint8 request, uint16 value, uint16 index,
+		uint8 *data, uint16 length, uint32 timeout);
+	int fx2SessionBulkWrite(FX2Session *session, uint8 ep, const uint8 *data, uint32 length, uint32 timeout);
+	int fx2SessionBulkRead(FX2Session *session, uint8 ep, uint8 *data, uint32 length, uint32 timeout);
+	int fx2SessionClearHalt(FX2Session *session, uint8 ep);
+	const char *fx2SessionStrUsbError(FX2Session *session, int returnCode);
+	struct usb_dev_handle *fx2SessionUsbHandle(FX2Session *session);
+
+	// A queue of bulk transfers on one endpoint, with up to depth of them submitted at once so the
+	// bus isn't left idle while the host turns each one around. Transfers complete in the order
+	// they were submitted. A real device uses usbdevfs URBs on Linux and the libusb-win32 async API
+	// on Windows, and a simulated one overlaps its transfers' latencies; anywhere else (or if the
+	// device can't be opened that way) each transfer only starts when it is reaped, so just one is
+	// ever in flight. While a queue is open on a real device, it owns the device's interface.
+	//
+	typedef struct FX2BulkQueue FX2BulkQueue;
+
+	// Defined in async.c. A submitted buffer must stay put until its transfer is reaped, and no
+	// more than depth transfers may be pending at once. Submitting returns zero or a negative
+	// libusb error code; reaping waits for the oldest pending transfer and returns the number of
+	// bytes transferred or a negative libusb error code. Closing cancels whatever is still pending.
+	//
+	FX2Status fx2BulkQueueOpen(FX2Session *session, uint8 ep, uint32 depth, FX2BulkQueue **queue);
+	int fx2BulkQueueSubmit(FX2BulkQueue *queue, uint8 *data, uint32 length);
+	int fx2BulkQueueReap(FX2BulkQueue *queue, uint32 timeout);
+	uint32 fx2BulkQueuePending(const FX2BulkQueue *queue);
+	uint32 fx2BulkQueueInFlight(const FX2BulkQueue *queue);
+	void fx2BulkQueueClose(FX2BulkQueue *queue);
+
+	// Timing and fault model for a simulated FX2LP. Each transfer occupies the (shared) bus for
+	// length/bytesPerSecond, then completes latencyMicros later, so transfers queued concurrently
+	// overlap their latencies just as on a real host controller. EEPROM writes are split at the
+	// page boundaries given by the request's wIndex (64 bytes by default) like the supplied
+	// firmware splits them, and each piece costs one write cycle; a piece which runs off the end of
+	// a real EEPROM page (if eepromPageSize is smaller) wraps around within that page, as it would
+	// on a 24LC-series part. Bulk EEPROM transfers (vendor commands 0xA3-0xA5, with the data on
+	// EP2OUT and EP4IN) are timed like any other bulk transfer, and their write cycles run in the
+	// background, as they do in the firmware.
+	//
+	typedef struct {
+		long latencyMicros;         // round trip per transfer
+		uint32 bytesPerSecond;      // bus bandwidth, or zero for infinite
+		uint32 eepromSize;          // bytes
+		uint32 eepromPageSize;      // bytes per EEPROM page
+		long writeCycleMicros;      // EEPROM write cycle time
+		bool supportsEEPROM;        // whether the (pretend) firmware handles 0xA2
+		bool supportsBulkEEPROM;    // ...and the bulk EEPROM commands too
+		bool supportsCrc;           // ...and the CRC commands (0xA6 and 0xA7)
+		long failAddress;           // a RAM write covering this address fails, or -1
+		int failCode;               // ...with this return code
+	} FX2MockConfig;
+
+	// What a simulated FX2LP has seen so far.
+	//
+	typedef struct {
+		uint32 numControl;          // control transfers of any kind
+		uint32 numRamWrites;        // 0xA0 writes, not counting CPUCS
+		uint32 ramBytes;            // bytes written by those
+		uint32 numEepromWrites;     // 0xA2 writes and bulk EEPROM writes
+		uint32 numPageWrites;       // EEPROM write cycles
+		uint32 maxInFlight;         // most transfers in progress at once
+		uint32 numOrderingErrors;   // CPUCS writes during RAM transfers, or RAM writes out of reset
+		long long bulkOutBytes;     // bytes sunk by EP6 (or any OUT endpoint), or written by EP2
+		long long bulkInBytes;      // bytes sourced by EP8 (or any IN endpoint), or read by EP4
+		uint32 numStrayBulkOut;     // EP2 writes with no bulk EEPROM write to take them
+		bool inReset;               // current CPUCS reset bit
+	} FX2MockStats;
+
+	typedef enum {
+		FX2_MOCK_RAM,
+		FX2_MOCK_EEPROM
+	} FX2MockMemory;
+
+	// Defined in mock.c:
+	void fx2MockDefaultConfig(FX2MockConfig *config);
+	FX2Status fx2OpenMockSession(const FX2MockConfig *config, FX2Session **session);
+	void fx2MockGetStats(const FX2Session *session, FX2MockStats *stats);
+	uint8 *fx2MockMemory(FX2Session *session, FX2MockMemory which, uint32 *length);
+
+	// What a RAM write sent, and what sending the whole buffer would have cost.
+	//
+	typedef struct {
+		uint32 numBytes;
+		uint32 numTransfers;
+		uint32 fullBytes;
+		uint32 fullTransfers;
+	} FX2RamStats;
 
 	// Defined in ram.c:
+	FX2Status fx2SessionWriteRAM(
+		FX2Session *session, const Buffer *sourceData, const Buffer *sourceMask, FX2RamStats *stats);
+	FX2Status fx2SessionWriteRAMBits(
+		FX2Session *session, const Buffer *sourceData, const Bitset *mask, FX2RamStats *stats);
+	FX2Status fx2SessionWriteRAMRecords(FX2Session *session, const Buffer *i2cBuffer, FX2RamStats *stats);
+	FX2Status fx2SessionReadRAM(FX2Session *session, uint16 address, uint32 numBytes, Buffer *destData);
 	FX2Status fx2WriteRAM(uint16 vid, uint16 pid, const Buffer *sourceData);
 
+	// What a differential EEPROM update did: how many pages the image covers, and how many of them
+	// (and how many bytes) actually had to be written.
+	//
+	typedef struct {
+		uint32 numPages;
+		uint32 pagesWritten;
+		uint32 bytesWritten;
+	} FX2EepromStats;
+
 	// Defined in eeprom.c:
+	FX2Status fx2SessionWriteEEPROM(FX2Session *session, const Buffer *i2cBuffer);
+	FX2Status fx2SessionReadEEPROM(FX2Session *session, uint32 numBytes, Buffer *i2cBuffer);
+	FX2Status fx2SessionReadEEPROMImage(FX2Session *session, uint32 maxBytes, Buffer *i2cBuffer);
+	FX2Status fx2SessionUpdateEEPROM(
+		FX2Session *session, const Buffer *i2cBuffer, const Buffer *current, uint32 pageSize,
+		FX2EepromStats *stats);
 	FX2Status fx2WriteEEPROM(uint16 vid, uint16 pid, const Buffer *i2cBuffer);
 	FX2Status fx2ReadEEPROM(uint16 vid, uint16 pid, uint32 numBytes, Buffer *i2cBuffer);
 
+	// Which memory a firmware CRC covers.
+	//
+	typedef enum {
+		FX2_MEM_EEPROM,
+		FX2_MEM_XDATA
+	} FX2Memory;
+
+	#define FX2_CRC_INIT 0xFFFF
+
+	// Defined in crc.c:
+	uint16 fx2Crc16(uint16 crc, const uint8 *data, uint32 length);
+	FX2Status fx2SessionGetCrc(
+		FX2Session *session, FX2Memory memory, uint16 address, uint16 length, uint16 *crc);
+	FX2Status fx2SessionVerifyEEPROM(FX2Session *session, const Buffer *i2cBuffer);
+
 	#ifdef FX2LOADER_PRIVATE
-		#define FX2_ERR_MAXLENGTH 1024
+		#ifdef WIN32
+			#define FX2_THREAD_LOCAL __declspec(thread)
+		#else
+			#define FX2_THREAD_LOCAL __thread
+		#endif
+		extern FX2_THREAD_LOCAL char fx2ErrorMessage[FX2_ERR_MAXLENGTH];
+		// The operations a session needs from whatever is on the other end of it
+		//
+		typedef struct {
+			int (*control)(
+				void *device, uint8 requestType, uint8 request, uint16 value, uint16 index,
+				uint8 *data, uint16 length, uint32 timeout);
+			int (*bulkWrite)(void *device, uint8 ep, const uint8 *data, uint32 length, uint32 timeout);
+			int (*bulkRead)(void *device, uint8 ep, uint8 *data, uint32 length, uint32 timeout);
+			int (*clearHalt)(void *device, uint8 ep);
+			const char *(*strError)(void *device, int returnCode);
+			void (*close)(void *device);
+
+			// Asynchronous bulk transfers for an FX2BulkQueue, each in one of depth slots. A
+			// backend which can't do them has a NULL queueOpen, and queueOpen may also fail by
+			// returning NULL; either way the queue falls back to synchronous transfers.
+			//
+			void *(*queueOpen)(void *device, uint8 ep, uint32 depth);
+			int (*queueSubmit)(void *queue, uint32 slot, uint8 *data, uint32 length);
+			int (*queueReap)(void *queue, uint32 slot, uint32 timeout);
+			void (*queueClose)(void *queue);
+		} FX2Backend;
+		struct FX2Session {
+			const FX2Backend *backend;
+			void *device;
+			FX2Error error;
+			uint32 queueDepth;
+		};
+		FX2Status fx2WrapDevice(const FX2Backend *backend, void *device, FX2Session **session);
+
+		// One control transfer's worth of data
+		//
+		typedef struct {
+			uint16 address;
+			uint16 length;
+			uint8 *data;
+		} FX2Chunk;
+		FX2Status fx2ControlQueue(
+			FX2Session *session, uint8 bRequest, bool isRead,
+			const FX2Chunk *chunks, uint32 numChunks, FX2Phase phase);
+
+		// The same, but fed one chunk at a time, with the transfers starting as soon as they're
+		// added.
+		//
+		typedef struct FX2ControlQueue FX2ControlQueue;
+		FX2Status fx2ControlQueueOpen(
+			FX2Session *session, uint8 bRequest, bool isRead, FX2Phase phase, FX2ControlQueue **queue);
+		FX2Status fx2ControlQueueAdd(FX2ControlQueue *queue, uint16 address, uint8 *data, uint16 length);
+		FX2Status fx2ControlQueueClose(FX2ControlQueue *queue);
+		void fx2SetError(
+			FX2Error *error, FX2Status status, FX2Phase phase, int usbCode, uint32 address,
+			const char *format, ...);
 	#endif
 
 #ifdef __cplusplus
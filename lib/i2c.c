@@ -15,16 +15,17 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "fx2loader.h"
 #include "i2c.h"
+#include "bitset.h"
 
 #ifdef WIN32
 #pragma warning(disable : 4996)
 #define snprintf sprintf_s 
 #endif
 
-extern char fx2ErrorMessage[];
-
 #define LSB(x) ((x) & 0xFF)
 #define MSB(x) ((x) >> 8)
 
@@ -45,16 +46,29 @@ I2CStatus i2cInitialise(Buffer *buf, uint16 vid, uint16 pid, uint16 did, uint8 c
 	return I2C_SUCCESS;
 }
 
+// Bitset searches which stop at the supplied limit.
+//
+static uint32 findSet(const Bitset *mask, uint32 from, uint32 limit) {
+	const uint32 result = bitsetFindSet(mask, from);
+	return (result < limit) ? result : limit;
+}
+
+static uint32 findClear(const Bitset *mask, uint32 from, uint32 limit) {
+	const uint32 result = bitsetFindClear(mask, from);
+	return (result < limit) ? result : limit;
+}
+
 // Dump the selected range of the HexReader buffers as I2C records to the supplied buffer. This will
 // split up large chunks into chunks 1023 bytes or smaller so chunk lengths fit in ten bits.
 // (see TRM 3.4.3)
 //
-static I2CStatus dumpChunk(Buffer *destination, const Buffer *sourceData, const Buffer *sourceMask,
+static I2CStatus dumpChunk(Buffer *destination, const Buffer *sourceData, const Bitset *sourceMask,
                            uint16 address, uint16 length) {
 	BufferStatus bStatus;
-	uint8 *chunkHeader;
-	size_t i, startBlock;
+	uint8 *chunkHeader, *chunkData;
 	I2CStatus iStatus;
+	uint32 clear, set;
+	const uint32 end = (uint32)address + length;
 	if ( length == 0 ) {
 		return I2C_SUCCESS;
 	}
@@ -72,31 +86,33 @@ static I2CStatus dumpChunk(Buffer *destination, const Buffer *sourceData, const
 	chunkHeader[1] = LSB(length);
 	chunkHeader[2] = MSB(address);
 	chunkHeader[3] = LSB(address);
-	startBlock = destination->length;
-	bufAppendBlock(destination, sourceData->data + address, length);
-	for ( i = 0; i < length; i++ ) {
-		if ( sourceMask->data[address + i] == 0x00 ) {
-			destination->data[startBlock + i] = 0x00;
-		}
+	bStatus = bufAppendZeros(destination, length, &chunkData);
+	if ( bStatus != BUF_SUCCESS ) {
+		snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "Buffer error: %s", bufStrError());
+		return I2C_BUFFER_ERROR;
+	}
+
+	// Copy the whole range, then blank out the unmasked runs within it
+	//
+	memcpy(chunkData, sourceData->data + address, length);
+	clear = findClear(sourceMask, address, end);
+	while ( clear < end ) {
+		set = (clear < sourceMask->length) ? findSet(sourceMask, clear, end) : end;
+		memset(chunkData + clear - address, 0x00, set - clear);
+		clear = findClear(sourceMask, set, end);
 	}
 	return I2C_SUCCESS;
 }
 
-// Build EEPROM records from the data/mask source buffers and write to the destination buffer.
+// Split the masked data into records using a simple local rule: break on a gap of four or more
+// unmasked bytes.
 //
-I2CStatus i2cWritePromRecords(Buffer *destination, const Buffer *sourceData, const Buffer *sourceMask) {
-	uint16 i, chunkStart;
+static I2CStatus writeGreedy(Buffer *destination, const Buffer *sourceData, const Bitset *sourceMask) {
+	const uint32 length = sourceData->length;
+	uint32 i, next, chunkStart;
 	I2CStatus status;
-	if ( destination->length != 8 || destination->data[0] != 0xC2 ) {
-		snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "i2cWritePromRecords(): the buffer was not initialised");
-		return I2C_NOT_INITIALISED;
-	}
-
-	i = 0;
-	while ( !sourceMask->data[i] && i < sourceData->length ) {
-		i++;
-	}
-	if ( i == sourceData->length ) {
+	i = findSet(sourceMask, 0, length);
+	if ( i == length ) {
 		return I2C_SUCCESS;  // There are no data
 	}
 
@@ -106,11 +122,9 @@ I2CStatus i2cWritePromRecords(Buffer *destination, const Buffer *sourceData, con
 	do {
 		// Find the end of this block of ones
 		//
-		while ( sourceMask->data[i] && i < sourceData->length ) {
-			i++;
-		}
-		if ( i == sourceData->length ) {
-			status = dumpChunk(destination, sourceData, sourceMask, chunkStart, (uint16)sourceData->length - chunkStart);
+		i = findClear(sourceMask, i, length);
+		if ( i == length ) {
+			status = dumpChunk(destination, sourceData, sourceMask, (uint16)chunkStart, (uint16)(length - chunkStart));
 			if ( status != I2C_SUCCESS ) {
 				return status;
 			}
@@ -124,85 +138,254 @@ I2CStatus i2cWritePromRecords(Buffer *destination, const Buffer *sourceData, con
 		// length is 1023 bytes, it's actually good to break on FOUR bytes - it costs nothing
 		// extra, but it hopefully keeps the number of forced (1023-byte) breaks to a minimum.
 		//
-		if ( i < sourceData->length-4 ) {
+		if ( i < length-4 ) {
 			// We are not within five bytes of the end
 			//
-			if ( !sourceMask->data[i] && !sourceMask->data[i+1] && !sourceMask->data[i+2] && !sourceMask->data[i+3] ) {
-				// Yes, let's split it - dump the current block and start a fresh one
+			next = bitsetFindSet(sourceMask, i);
+			if ( next - i >= 4 ) {
+				// Yes, let's split it - dump the current block and start a fresh one at the next
+				// block of ones
 				//
-				status = dumpChunk(destination, sourceData, sourceMask, chunkStart, i - chunkStart);
+				status = dumpChunk(destination, sourceData, sourceMask, (uint16)chunkStart, (uint16)(i - chunkStart));
 				if ( status != I2C_SUCCESS ) {
 					return status;
 				}
-				
-				// Skip these four...we know they're zero
-				//
-				i += 4;
-				
-				// Find the next block of ones
-				//
-				while ( i < sourceMask->length && !sourceMask->data[i] ) {
-					i++;
-				}
-				chunkStart = i;
-			} else {
-				// This is four or fewer zeros - not worth splitting for so skip over them
-				//
-				while ( !sourceMask->data[i] ) {
-					i++;
-				}
+				chunkStart = next;
 			}
+
+			// Otherwise this is fewer than four zeros - not worth splitting for so skip over them
+			//
+			i = next;
 		} else {
 			// We are within four bytes of the end - include the remainder, whatever it is
 			//
-			status = dumpChunk(destination, sourceData, sourceMask, chunkStart, (uint16)sourceMask->length - chunkStart);
+			status = dumpChunk(destination, sourceData, sourceMask, (uint16)chunkStart, (uint16)(sourceMask->length - chunkStart));
 			if ( status != I2C_SUCCESS ) {
 				return status;
 			}
 			break;
 		}
-	} while ( i < sourceData->length );
+	} while ( i < length );
 	
 	return I2C_SUCCESS;
 }
 
-// Read EEPROM records from the source buffer and write the decoded data to the data/mask destination buffers.
+// Split the masked data into the records with the fewest total bytes. A record covering masked
+// bytes p[k]..p[j-1] costs its four-byte header plus every byte in between, and may be at most
+// 1023 bytes long, so the cheapest encoding of the first j masked bytes is:
 //
-I2CStatus i2cReadPromRecords(Buffer *destData, Buffer *destMask, const Buffer *source) {
-	uint16 chunkAddress, chunkLength;
-	const uint8 *ptr = source->data;
-	const uint8 *const ptrEnd = ptr + source->length;
-	BufferStatus bStatus;
-	if ( source->length < 8+5 || ptr[0] != 0xC2 ) {
+//   cost[j] = min over k of ( cost[k] - p[k] ) + p[j-1] + 5, where p[j-1] - p[k] < 1023
+//
+// The window of allowed k only ever slides forwards, so a deque of candidates kept in increasing
+// order of cost[k] - p[k] gives each minimum in constant time, and the whole thing is O(n).
+//
+static I2CStatus writeOptimal(Buffer *destination, const Buffer *sourceData, const Bitset *sourceMask) {
+	I2CStatus status = I2C_SUCCESS;
+	const uint32 length = sourceData->length;
+	uint32 *pos = NULL, *cost = NULL, *from = NULL, *deque = NULL;
+	uint32 numMasked = 0, head = 0, tail = 0, numRecords, i, j, k, end;
+	i = findSet(sourceMask, 0, length);
+	while ( i < length ) {
+		end = findClear(sourceMask, i, length);
+		numMasked += end - i;
+		i = findSet(sourceMask, end, length);
+	}
+	if ( numMasked == 0 ) {
+		return I2C_SUCCESS;  // There are no data
+	}
+	pos = (uint32 *)malloc(numMasked * sizeof(uint32));
+	cost = (uint32 *)malloc((numMasked + 1) * sizeof(uint32));
+	from = (uint32 *)malloc((numMasked + 1) * sizeof(uint32));
+	deque = (uint32 *)malloc(numMasked * sizeof(uint32));
+	if ( !pos || !cost || !from || !deque ) {
+		snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "Cannot allocate record layout tables");
+		status = I2C_BUFFER_ERROR;
+		goto cleanup;
+	}
+	i = findSet(sourceMask, 0, length);
+	j = 0;
+	while ( i < length ) {
+		end = findClear(sourceMask, i, length);
+		while ( i < end ) {
+			pos[j++] = i++;
+		}
+		i = findSet(sourceMask, end, length);
+	}
+
+	// cost[k] - p[k] may be negative, so compare cost[k] + p[j] against cost[j] + p[k] instead
+	//
+	cost[0] = 0;
+	for ( j = 1; j <= numMasked; j++ ) {
+		k = j - 1;
+		while ( tail > head && cost[deque[tail-1]] + pos[k] > cost[k] + pos[deque[tail-1]] ) {
+			tail--;
+		}
+		deque[tail++] = k;
+		while ( pos[deque[head]] + 1022 < pos[j-1] ) {
+			head++;
+		}
+		k = deque[head];
+		cost[j] = cost[k] + 4 + pos[j-1] - pos[k] + 1;
+		from[j] = k;
+	}
+
+	// Walk back from the end to find where each record starts, then write them out in order
+	//
+	numRecords = 0;
+	for ( j = numMasked; j > 0; j = from[j] ) {
+		deque[numRecords++] = j;
+	}
+	while ( numRecords-- ) {
+		j = deque[numRecords];
+		k = from[j];
+		status = dumpChunk(destination, sourceData, sourceMask, (uint16)pos[k], (uint16)(pos[j-1] - pos[k] + 1));
+		if ( status != I2C_SUCCESS ) {
+			goto cleanup;
+		}
+	}
+cleanup:
+	free(deque);
+	free(from);
+	free(cost);
+	free(pos);
+	return status;
+}
+
+static bool isInitialised(const Buffer *destination) {
+	if ( destination->length != 8 || destination->data[0] != 0xC2 ) {
+		snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "i2cWritePromRecords(): the buffer was not initialised");
+		return false;
+	}
+	return true;
+}
+
+// Build EEPROM records from the data buffer and packed mask and write to the destination buffer,
+// splitting the data into records as directed.
+//
+I2CStatus i2cWritePromRecordsBits(
+	Buffer *destination, const Buffer *sourceData, const Bitset *sourceMask, I2CEncoding encoding)
+{
+	if ( !isInitialised(destination) ) {
+		return I2C_NOT_INITIALISED;
+	}
+	return (encoding == I2C_ENCODE_OPTIMAL) ?
+		writeOptimal(destination, sourceData, sourceMask) :
+		writeGreedy(destination, sourceData, sourceMask);
+}
+
+// Build EEPROM records from the data/mask source buffers and write to the destination buffer,
+// splitting the data into records as directed.
+//
+I2CStatus i2cWritePromRecordsWith(
+	Buffer *destination, const Buffer *sourceData, const Buffer *sourceMask, I2CEncoding encoding)
+{
+	I2CStatus status;
+	Bitset mask;
+	if ( !isInitialised(destination) ) {
+		return I2C_NOT_INITIALISED;
+	}
+	if ( bitsetInitialise(&mask, sourceMask->length) || bitsetFromMask(&mask, sourceMask) ) {
+		bitsetDestroy(&mask);
+		return I2C_BUFFER_ERROR;
+	}
+	status = i2cWritePromRecordsBits(destination, sourceData, &mask, encoding);
+	bitsetDestroy(&mask);
+	return status;
+}
+
+// Build EEPROM records from the data/mask source buffers and write to the destination buffer.
+//
+I2CStatus i2cWritePromRecords(Buffer *destination, const Buffer *sourceData, const Buffer *sourceMask) {
+	return i2cWritePromRecordsWith(destination, sourceData, sourceMask, I2C_ENCODE_GREEDY);
+}
+
+// Get ready to walk the records of a C2 image.
+//
+I2CStatus i2cReaderInit(I2CRecordReader *reader, const Buffer *source) {
+	if ( source->length < 8+5 || source->data[0] != 0xC2 ) {
 		snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "i2cReadPromRecords(): the EEPROM records appear to be corrupt");
 		return I2C_NOT_INITIALISED;
 	}
+	reader->ptr = source->data + 8;  // skip over the header
+	reader->end = source->data + source->length;
+	return I2C_SUCCESS;
+}
+
+// Get the next data record. Returns I2C_END_OF_RECORDS on reaching the final (CPUCS) record or the
+// end of the buffer, or I2C_RECORD_CORRUPT if a record runs off the end of the buffer.
+//
+I2CStatus i2cReaderNext(I2CRecordReader *reader, uint16 *address, const uint8 **data, uint16 *length) {
+	const uint8 *const ptr = reader->ptr;
+	uint16 chunkLength;
+	if ( ptr >= reader->end ) {
+		return I2C_END_OF_RECORDS;
+	}
+	if ( reader->end - ptr < 4 ) {
+		goto corrupt;
+	}
+	chunkLength = (uint16)((ptr[0] << 8) + ptr[1]);
+	if ( chunkLength & 0x8000 ) {
+		return I2C_END_OF_RECORDS;
+	}
+	chunkLength &= 0x03FF;
+	if ( reader->end - ptr - 4 < chunkLength ) {
+		goto corrupt;
+	}
+	*address = (uint16)((ptr[2] << 8) + ptr[3]);
+	*data = ptr + 4;
+	*length = chunkLength;
+	reader->ptr = ptr + 4 + chunkLength;
+	return I2C_SUCCESS;
+corrupt:
+	snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "i2cReadPromRecords(): a record runs off the end of the image");
+	return I2C_RECORD_CORRUPT;
+}
+
+// Read EEPROM records from the source buffer and write the decoded data to the data buffer and
+// packed mask. Both must be empty.
+//
+I2CStatus i2cReadPromRecordsBits(Buffer *destData, Bitset *destMask, const Buffer *source) {
+	I2CRecordReader reader;
+	uint16 chunkAddress, chunkLength;
+	const uint8 *chunkData;
+	I2CStatus status = i2cReaderInit(&reader, source);
+	if ( status != I2C_SUCCESS ) {
+		return status;
+	}
 	if ( destData->length != 0 || destMask->length != 0 ) {
 		snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "i2cReadPromRecords(): the destination buffer is not empty");
 		return I2C_DEST_BUFFER_NOT_EMPTY;
 	}
-	ptr += 8;  // skip over the header
-	while ( ptr < ptrEnd ) {
-		chunkLength = ((ptr[0] << 8) + ptr[1]);
-		chunkAddress = (ptr[2] << 8) + ptr[3];
-		if ( chunkLength & 0x8000 ) {
-			break;
-		}
-		chunkLength &= 0x03FF;
-		ptr += 4;
-		bStatus = bufCopyBlock(destData, chunkAddress, ptr, chunkLength);
-		if ( bStatus != BUF_SUCCESS ) {
+	while ( (status = i2cReaderNext(&reader, &chunkAddress, &chunkData, &chunkLength)) == I2C_SUCCESS ) {
+		if ( bufCopyBlock(destData, chunkAddress, chunkData, chunkLength) != BUF_SUCCESS ) {
 			snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "Buffer error: %s", bufStrError());
 			return I2C_BUFFER_ERROR;
 		}
-		bStatus = bufSetBlock(destMask, chunkAddress, 0x01, chunkLength);
-		if ( bStatus != BUF_SUCCESS ) {
-			snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "Buffer error: %s", bufStrError());
+		if ( bitsetSetRange(destMask, chunkAddress, chunkLength) ) {
 			return I2C_BUFFER_ERROR;
 		}
-		ptr += chunkLength;
 	}
-	return I2C_SUCCESS;
+	return (status == I2C_END_OF_RECORDS) ? I2C_SUCCESS : status;
+}
+
+// Read EEPROM records from the source buffer and write the decoded data to the data/mask destination buffers.
+//
+I2CStatus i2cReadPromRecords(Buffer *destData, Buffer *destMask, const Buffer *source) {
+	I2CStatus status;
+	Bitset mask;
+	if ( destMask->length != 0 ) {
+		snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "i2cReadPromRecords(): the destination buffer is not empty");
+		return I2C_DEST_BUFFER_NOT_EMPTY;
+	}
+	if ( bitsetInitialise(&mask, 0x10000) ) {
+		return I2C_BUFFER_ERROR;
+	}
+	status = i2cReadPromRecordsBits(destData, &mask, source);
+	if ( status == I2C_SUCCESS && bitsetToMask(&mask, destMask) ) {
+		status = I2C_BUFFER_ERROR;
+	}
+	bitsetDestroy(&mask);
+	return status;
 }
 
 // Finalise the I2C buffers. This involves writing the final record which resets the chip.
@@ -226,3 +409,32 @@ I2CStatus i2cFinalise(Buffer *buf) {
 	lastRecord[4] = 0x00;
 	return I2C_SUCCESS;
 }
+
+// Measure an encoded image. The boot loader reads the whole thing in one sequential I2C read, at
+// nine bus clocks per byte (eight data bits and an ACK) plus the few bytes it takes to set the
+// EEPROM's address pointer.
+//
+I2CStatus i2cGetImageStats(const Buffer *buf, I2CImageStats *stats) {
+	const uint8 *ptr = buf->data;
+	const uint8 *const ptrEnd = ptr + buf->length;
+	uint16 chunkLength;
+	uint32 clockRate;
+	if ( buf->length < 8 || ptr[0] != 0xC2 ) {
+		snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "i2cGetImageStats(): the buffer was not initialised");
+		return I2C_NOT_INITIALISED;
+	}
+	clockRate = (ptr[7] & CONFIG_BYTE_400KHZ) ? 400000UL : 100000UL;
+	stats->numBytes = buf->length;
+	stats->numRecords = 0;
+	ptr += 8;
+	while ( ptr + 4 <= ptrEnd ) {
+		chunkLength = (uint16)((ptr[0] << 8) + ptr[1]);
+		if ( chunkLength & 0x8000 ) {
+			break;
+		}
+		stats->numRecords++;
+		ptr += 4 + (chunkLength & 0x03FF);
+	}
+	stats->bootMicros = (uint32)(((double)(buf->length + 4) * 9.0 * 1000000.0) / clockRate);
+	return I2C_SUCCESS;
+}
@@ -18,6 +18,7 @@
 #define I2C_H
 
 #include "buffer.h"
+#include "bitset.h"
 #include "types.h"
 
 #define CONFIG_BYTE_DISCON (1<<6)
@@ -31,13 +32,53 @@ extern "C" {
 		I2C_SUCCESS,
 		I2C_BUFFER_ERROR,
 		I2C_NOT_INITIALISED,
-		I2C_DEST_BUFFER_NOT_EMPTY
+		I2C_DEST_BUFFER_NOT_EMPTY,
+		I2C_END_OF_RECORDS,
+		I2C_RECORD_CORRUPT
 	} I2CStatus;
 
+	// How to split the masked data into records. GREEDY is the original rule (break on a gap of
+	// four or more unmasked bytes, and wherever a record hits 1023 bytes); OPTIMAL finds the layout
+	// with the fewest total bytes.
+	//
+	typedef enum {
+		I2C_ENCODE_GREEDY,
+		I2C_ENCODE_OPTIMAL
+	} I2CEncoding;
+
+	// What an encoded image costs: its size, how many data records it has, and roughly how long
+	// the FX2's boot loader will take to read it at the bus speed selected by its config byte.
+	//
+	typedef struct {
+		uint32 numBytes;
+		uint32 numRecords;
+		uint32 bootMicros;
+	} I2CImageStats;
+
+	// Walks the data records of a C2 image one at a time, without copying them anywhere: each
+	// record's data points into the source buffer, so that must stay put while it's in use.
+	//
+	typedef struct {
+		const uint8 *ptr;
+		const uint8 *end;
+	} I2CRecordReader;
+
 	I2CStatus i2cInitialise(Buffer *buf, uint16 vid, uint16 pid, uint16 did, uint8 configByte);
 	I2CStatus i2cWritePromRecords(Buffer *destination, const Buffer *sourceData, const Buffer *sourceMask);
+	I2CStatus i2cWritePromRecordsWith(
+		Buffer *destination, const Buffer *sourceData, const Buffer *sourceMask, I2CEncoding encoding);
 	I2CStatus i2cReadPromRecords(Buffer *destData, Buffer *destMask, const Buffer *source);
+
+	// The same, but with the mask as a Bitset. The Buffer-mask versions above convert to and from
+	// one of these.
+	//
+	I2CStatus i2cWritePromRecordsBits(
+		Buffer *destination, const Buffer *sourceData, const Bitset *sourceMask, I2CEncoding encoding);
+	I2CStatus i2cReadPromRecordsBits(Buffer *destData, Bitset *destMask, const Buffer *source);
+	I2CStatus i2cReaderInit(I2CRecordReader *reader, const Buffer *source);
+	I2CStatus i2cReaderNext(I2CRecordReader *reader, uint16 *address, const uint8 **data, uint16 *length);
 	I2CStatus i2cFinalise(Buffer *buf);
+	I2CStatus i2cGetImageStats(const Buffer *buf, I2CImageStats *stats);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,64 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include "mask.h"
+
+// Each mask is read a 64-bit word at a time (through memcpy(), so alignment doesn't matter and
+// the compiler turns it into a single load). Byte order doesn't matter either: once a word is
+// known to contain what we're looking for, the byte loop finds exactly where.
+//
+typedef unsigned long long MaskWord;
+
+#define LOW_SEVEN 0x7F7F7F7F7F7F7F7FULL
+#define HIGH_BITS 0x8080808080808080ULL
+
+// Set the top bit of each byte of the result whose byte in the word is nonzero; adding 0x7F to
+// the low seven bits carries into the top bit unless they're all zero.
+//
+static MaskWord nonzeroBytes(MaskWord word) {
+	return (((word & LOW_SEVEN) + LOW_SEVEN) | word) & HIGH_BITS;
+}
+
+uint32 maskFindSet(const uint8 *mask, uint32 from, uint32 length) {
+	MaskWord word;
+	while ( from + 8 <= length ) {
+		memcpy(&word, mask + from, 8);
+		if ( word ) {
+			break;
+		}
+		from += 8;
+	}
+	while ( from < length && !mask[from] ) {
+		from++;
+	}
+	return from;
+}
+
+uint32 maskFindClear(const uint8 *mask, uint32 from, uint32 length) {
+	MaskWord word;
+	while ( from + 8 <= length ) {
+		memcpy(&word, mask + from, 8);
+		if ( nonzeroBytes(word) != HIGH_BITS ) {
+			break;
+		}
+		from += 8;
+	}
+	while ( from < length && mask[from] ) {
+		from++;
+	}
+	return from;
+}
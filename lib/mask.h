@@ -0,0 +1,37 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MASK_H
+#define MASK_H
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// Kernels for byte-per-address masks (zero means unused, anything else means used), working
+	// on eight bytes at a time. The find functions return the index of the first used (or unused)
+	// byte at or after "from", or "length" if there isn't one.
+	//
+	uint32 maskFindSet(const uint8 *mask, uint32 from, uint32 length);
+	uint32 maskFindClear(const uint8 *mask, uint32 from, uint32 length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,550 @@
+/*
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "fx2loader.h"
+#include "sys.h"
+
+#define RAM_SIZE 0x10000
+#define CPUCS 0xE600
+#define EP0_PACKET 64
+#define MOCK_FILL 0xEE
+#define MOCK_MAX_PAGE 0x100
+#define MOCK_BULK_PACKET 512
+
+// The firmware's high-speed configuration descriptor: one interface with EP2OUT and EP4IN for bulk
+// EEPROM transfers, and EP6OUT for streaming.
+//
+static const uint8 configDescriptor[] = {
+	0x09, 0x02, 39, 0x00, 0x01, 0x01, 0x00, 0x80, 250,
+	0x09, 0x04, 0x00, 0x00, 0x03, 0xFF, 0x00, 0x00, 0x00,
+	0x07, 0x05, 0x02, 0x02, MOCK_BULK_PACKET & 0xFF, MOCK_BULK_PACKET >> 8, 0x00,
+	0x07, 0x05, 0x84, 0x02, MOCK_BULK_PACKET & 0xFF, MOCK_BULK_PACKET >> 8, 0x00,
+	0x07, 0x05, 0x06, 0x02, MOCK_BULK_PACKET & 0xFF, MOCK_BULK_PACKET >> 8, 0x00
+};
+
+// libusb-0.1 returns -errno on failure
+//
+#define MOCK_EPIPE -32
+
+// One simulated FX2LP. Everything is protected by the lock except the configuration, which never
+// changes, and the memories, whose transfers the caller is responsible for not overlapping.
+//
+typedef struct {
+	FX2MockConfig config;
+	SysMutex *lock;
+	uint8 ram[RAM_SIZE];
+	uint8 *eeprom;
+	uint32 numInFlight;
+	uint32 numRamInFlight;
+	long long busFreeAt;
+	long long firmwareFreeAt;
+	enum { BULK_IDLE, BULK_WRITE, BULK_READ } bulkMode;
+	uint32 bulkAddress;         // where the bulk write or read started
+	uint32 bulkLength;          // bytes gathered so far, or still to read
+	uint16 bulkPageSize;        // wIndex of the 0xA4 that started the bulk write
+	uint8 *bulkBuf;             // gathered bulk write data
+	FX2MockStats stats;
+	const char *lastError;
+} MockDevice;
+
+void fx2MockDefaultConfig(FX2MockConfig *config) {
+	config->latencyMicros = 250;
+	config->bytesPerSecond = 35000000UL;
+	config->eepromSize = 0x4000;
+	config->eepromPageSize = 64;
+	config->writeCycleMicros = 5000;
+	config->supportsEEPROM = true;
+	config->supportsBulkEEPROM = true;
+	config->supportsCrc = true;
+	config->failAddress = -1;
+	config->failCode = MOCK_EPIPE;
+}
+
+// Book a transfer of the supplied size onto the shared bus timeline, returning when it will have
+// finished on the wire. Called with the lock held.
+//
+static long long occupyBus(MockDevice *dev, uint32 numBytes) {
+	const long long now = sysTimeMicros();
+	long long start = (dev->busFreeAt > now) ? dev->busFreeAt : now;
+	if ( dev->config.bytesPerSecond ) {
+		start += (long long)numBytes * 1000000LL / (long long)dev->config.bytesPerSecond;
+	}
+	dev->busFreeAt = start;
+	return start;
+}
+
+static void beginTransfer(MockDevice *dev) {
+	dev->numInFlight++;
+	if ( dev->numInFlight > dev->stats.maxInFlight ) {
+		dev->stats.maxInFlight = dev->numInFlight;
+	}
+}
+
+// Wait (without the lock) until the supplied time, then retire the transfer.
+//
+static void endTransfer(MockDevice *dev, long long doneAt, bool isRam) {
+	const long long remaining = doneAt - sysTimeMicros();
+	if ( remaining > 0 ) {
+		sysSleepMicros((long)remaining);
+	}
+	sysMutexLock(dev->lock);
+	dev->numInFlight--;
+	if ( isRam ) {
+		dev->numRamInFlight--;
+	}
+	sysMutexUnlock(dev->lock);
+}
+
+// An EEPROM write as the firmware does it: the data is gathered into writes which never cross a
+// boundary of the page size the host gave in wIndex (64 if it gave none, or a bad one), and each
+// such write costs a write cycle. If the part's real pages are smaller than that, bytes which run
+// off the end of a real page wrap around to its start, just as they do on a 24LC-series part.
+// Returns how many write cycles it took. Called with the lock held.
+//
+static uint32 eepromWrite(MockDevice *dev, uint32 address, const uint8 *data, uint32 length, uint16 index) {
+	const uint32 pageSize = dev->config.eepromPageSize ? dev->config.eepromPageSize : dev->config.eepromSize;
+	const uint32 firmwarePage = (index && index <= MOCK_MAX_PAGE && !(index & (index - 1))) ? index : EP0_PACKET;
+	uint32 chunkSize, pageBase, i, numCycles = 0;
+	while ( length ) {
+		chunkSize = firmwarePage - address % firmwarePage;
+		if ( chunkSize > length ) {
+			chunkSize = length;
+		}
+		pageBase = address - address % pageSize;
+		for ( i = 0; i < chunkSize; i++ ) {
+			dev->eeprom[pageBase + (address - pageBase + i) % pageSize] = data[i];
+		}
+		dev->stats.numPageWrites++;
+		numCycles++;
+		address += chunkSize;
+		data += chunkSize;
+		length -= chunkSize;
+	}
+	return numCycles;
+}
+
+static int mockControl(
+	void *device, uint8 requestType, uint8 request, uint16 value, uint16 index,
+	uint8 *data, uint16 length, uint32 timeout)
+{
+	MockDevice *const dev = (MockDevice *)device;
+	const bool isRead = (requestType & 0x80) ? true : false;
+	const uint32 address = value;
+	long long doneAt;
+	bool isRam = false;
+	(void)timeout;
+	sysMutexLock(dev->lock);
+	dev->stats.numControl++;
+	if ( (requestType & 0x60) == 0x00 ) {
+		// Standard requests: only GET_DESCRIPTOR for the configuration descriptor is implemented
+		//
+		if ( request != 0x06 || !isRead || (value >> 8) != 0x02 ) {
+			dev->lastError = "Simulated STALL: unsupported standard request";
+			goto stall;
+		}
+		if ( length > sizeof(configDescriptor) ) {
+			length = sizeof(configDescriptor);
+		}
+		memcpy(data, configDescriptor, length);
+	} else if ( request == 0xA0 && address == CPUCS && !isRead && length >= 1 ) {
+		// CPUCS: only the reset bit is implemented
+		//
+		if ( dev->numRamInFlight ) {
+			dev->stats.numOrderingErrors++;
+		}
+		dev->stats.inReset = (data[0] & 0x01) ? true : false;
+	} else if ( request == 0xA0 ) {
+		// RAM load or readback
+		//
+		if ( address + length > RAM_SIZE ) {
+			dev->lastError = "Simulated STALL: RAM access out of range";
+			goto stall;
+		}
+		if ( !isRead ) {
+			if ( dev->config.failAddress >= (long)address && dev->config.failAddress < (long)(address + length) ) {
+				dev->lastError = "Simulated failure";
+				sysMutexUnlock(dev->lock);
+				return dev->config.failCode;
+			}
+			if ( !dev->stats.inReset ) {
+				dev->stats.numOrderingErrors++;
+			}
+			memcpy(dev->ram + address, data, length);
+			dev->stats.numRamWrites++;
+			dev->stats.ramBytes += length;
+		} else {
+			memcpy(data, dev->ram + address, length);
+		}
+		dev->numRamInFlight++;
+		isRam = true;
+	} else if ( request == 0xA2 && dev->config.supportsEEPROM ) {
+		// EEPROM access through the firmware
+		//
+		if ( dev->bulkMode != BULK_IDLE ) {
+			dev->lastError = "Simulated STALL: bulk EEPROM transfer in progress";
+			goto stall;
+		}
+		if ( address + length > dev->config.eepromSize ) {
+			dev->lastError = "Simulated STALL: EEPROM access out of range";
+			goto stall;
+		}
+		doneAt = occupyBus(dev, length);
+		if ( dev->firmwareFreeAt > doneAt ) {
+			doneAt = dev->firmwareFreeAt;
+		}
+		if ( isRead ) {
+			memcpy(data, dev->eeprom + address, length);
+		} else {
+			const uint32 numCycles = eepromWrite(dev, address, data, length, index);
+			dev->stats.numEepromWrites++;
+			doneAt += dev->config.writeCycleMicros * (long)numCycles;
+		}
+		dev->firmwareFreeAt = doneAt;
+		beginTransfer(dev);
+		sysMutexUnlock(dev->lock);
+		endTransfer(dev, doneAt + dev->config.latencyMicros, false);
+		return length;
+	} else if ( request == 0xA3 && isRead && dev->config.supportsBulkEEPROM && dev->config.supportsEEPROM ) {
+		// Bulk EEPROM status: nonzero while the firmware is still busy
+		//
+		if ( length >= 1 ) {
+			data[0] = (dev->bulkMode != BULK_IDLE || dev->firmwareFreeAt > sysTimeMicros()) ? 1 : 0;
+			length = 1;
+		}
+	} else if ( (request == 0xA4 || request == 0xA5) && !isRead && dev->config.supportsBulkEEPROM && dev->config.supportsEEPROM ) {
+		// Start a bulk EEPROM write at wValue (page size in wIndex), or a read of wIndex bytes
+		//
+		if ( dev->bulkMode != BULK_IDLE ) {
+			dev->lastError = "Simulated STALL: bulk EEPROM transfer already in progress";
+			goto stall;
+		}
+		if ( request == 0xA4 ) {
+			dev->bulkMode = BULK_WRITE;
+			dev->bulkLength = 0;
+			dev->bulkPageSize = index;
+		} else {
+			if ( address + index > dev->config.eepromSize ) {
+				dev->lastError = "Simulated STALL: EEPROM access out of range";
+				goto stall;
+			}
+			dev->bulkMode = index ? BULK_READ : BULK_IDLE;
+			dev->bulkLength = index;
+		}
+		dev->bulkAddress = address;
+	} else if ( (request == 0xA6 || request == 0xA7) && isRead && dev->config.supportsCrc && dev->config.supportsEEPROM ) {
+		// CRC of wIndex bytes of EEPROM (0xA6) or XDATA (0xA7) from wValue, little-endian
+		//
+		const uint8 *const memory = (request == 0xA6) ? dev->eeprom : dev->ram;
+		const uint32 memorySize = (request == 0xA6) ? dev->config.eepromSize : RAM_SIZE;
+		uint16 crc;
+		if ( address + index > memorySize || length < 2 ) {
+			dev->lastError = "Simulated STALL: CRC out of range";
+			goto stall;
+		}
+		crc = fx2Crc16(FX2_CRC_INIT, memory + address, index);
+		data[0] = (uint8)crc;
+		data[1] = (uint8)(crc >> 8);
+		length = 2;
+	} else if ( request == 0x80 && isRead ) {
+		// The firmware's calculator command: sum, difference, product and quotient of wValue and
+		// wIndex, as little-endian words
+		//
+		const uint16 results[] = {
+			(uint16)(value + index), (uint16)(value - index),
+			(uint16)(value * index), (uint16)(index ? value / index : 0)
+		};
+		uint16 i;
+		for ( i = 0; i < length && i < 8; i++ ) {
+			data[i] = (uint8)(results[i/2] >> (8 * (i & 1)));
+		}
+		length = i;
+	} else {
+		dev->lastError = "Simulated STALL: unsupported request";
+		goto stall;
+	}
+	doneAt = occupyBus(dev, length);
+	beginTransfer(dev);
+	sysMutexUnlock(dev->lock);
+	endTransfer(dev, doneAt + dev->config.latencyMicros, isRam);
+	return length;
+stall:
+	sysMutexUnlock(dev->lock);
+	return MOCK_EPIPE;
+}
+
+// Bulk OUT endpoints are a sink; bulk IN endpoints source a counting pattern, continuing from
+// wherever the last read left off. The exception is a bulk EEPROM transfer: then EP2OUT takes the
+// data to write, which ends with a short packet, and EP4IN gives the data read. The data moves as
+// soon as a transfer starts, but it only completes at the time it returns in doneAt, so several of
+// them can be in flight at once.
+//
+static int startBulkWrite(MockDevice *dev, uint8 ep, const uint8 *data, uint32 length, long long *doneAt) {
+	sysMutexLock(dev->lock);
+	if ( ep & 0x80 ) {
+		dev->lastError = "Simulated STALL: write to an IN endpoint";
+		sysMutexUnlock(dev->lock);
+		return MOCK_EPIPE;
+	}
+	*doneAt = occupyBus(dev, length);
+	dev->stats.bulkOutBytes += length;
+	if ( ep == 0x02 && dev->bulkMode == BULK_WRITE ) {
+		if ( dev->bulkAddress + dev->bulkLength + length > dev->config.eepromSize ) {
+			dev->bulkMode = BULK_IDLE;
+			dev->lastError = "Simulated STALL: EEPROM access out of range";
+			sysMutexUnlock(dev->lock);
+			return MOCK_EPIPE;
+		}
+		memcpy(dev->bulkBuf + dev->bulkLength, data, length);
+		dev->bulkLength += length;
+		if ( length % MOCK_BULK_PACKET || !length ) {
+			// Short packet: the firmware writes the pages as they fill, so their write cycles
+			// start from whenever the firmware was last free, and the last one finishes later
+			//
+			const uint32 numCycles = eepromWrite(dev, dev->bulkAddress, dev->bulkBuf, dev->bulkLength, dev->bulkPageSize);
+			if ( dev->firmwareFreeAt < sysTimeMicros() ) {
+				dev->firmwareFreeAt = sysTimeMicros();
+			}
+			dev->firmwareFreeAt += dev->config.writeCycleMicros * (long)numCycles;
+			if ( dev->firmwareFreeAt < *doneAt ) {
+				dev->firmwareFreeAt = *doneAt;
+			}
+			dev->stats.numEepromWrites++;
+			dev->bulkMode = BULK_IDLE;
+		}
+	} else if ( ep == 0x02 ) {
+		dev->stats.numStrayBulkOut++;
+	}
+	*doneAt += dev->config.latencyMicros;
+	beginTransfer(dev);
+	sysMutexUnlock(dev->lock);
+	return (int)length;
+}
+
+static int startBulkRead(MockDevice *dev, uint8 ep, uint8 *data, uint32 length, long long *doneAt) {
+	uint8 value;
+	uint32 i;
+	sysMutexLock(dev->lock);
+	if ( !(ep & 0x80) ) {
+		dev->lastError = "Simulated STALL: read from an OUT endpoint";
+		sysMutexUnlock(dev->lock);
+		return MOCK_EPIPE;
+	}
+	if ( ep == 0x84 && dev->bulkMode == BULK_READ ) {
+		if ( length > dev->bulkLength ) {
+			length = dev->bulkLength;
+		}
+		memcpy(data, dev->eeprom + dev->bulkAddress, length);
+		dev->bulkAddress += length;
+		dev->bulkLength -= length;
+		if ( !dev->bulkLength ) {
+			dev->bulkMode = BULK_IDLE;
+		}
+	} else {
+		value = (uint8)dev->stats.bulkInBytes;
+		for ( i = 0; i < length; i++ ) {
+			data[i] = value++;
+		}
+	}
+	*doneAt = occupyBus(dev, length) + dev->config.latencyMicros;
+	dev->stats.bulkInBytes += length;
+	beginTransfer(dev);
+	sysMutexUnlock(dev->lock);
+	return (int)length;
+}
+
+static int mockBulkWrite(void *device, uint8 ep, const uint8 *data, uint32 length, uint32 timeout) {
+	MockDevice *const dev = (MockDevice *)device;
+	long long doneAt;
+	const int returnCode = startBulkWrite(dev, ep, data, length, &doneAt);
+	(void)timeout;
+	if ( returnCode >= 0 ) {
+		endTransfer(dev, doneAt, false);
+	}
+	return returnCode;
+}
+
+static int mockBulkRead(void *device, uint8 ep, uint8 *data, uint32 length, uint32 timeout) {
+	MockDevice *const dev = (MockDevice *)device;
+	long long doneAt;
+	const int returnCode = startBulkRead(dev, ep, data, length, &doneAt);
+	(void)timeout;
+	if ( returnCode >= 0 ) {
+		endTransfer(dev, doneAt, false);
+	}
+	return returnCode;
+}
+
+// A bulk queue on a simulated device just remembers when each of its transfers completes.
+//
+typedef struct {
+	MockDevice *dev;
+	uint8 ep;
+	uint32 depth;
+	long long *doneAt;
+	int *results;
+	bool *pending;
+} MockQueue;
+
+static void *mockQueueOpen(void *device, uint8 ep, uint32 depth) {
+	MockQueue *const queue = (MockQueue *)calloc(1, sizeof(MockQueue));
+	if ( !queue ) {
+		return NULL;
+	}
+	queue->doneAt = (long long *)calloc(depth, sizeof(long long));
+	queue->results = (int *)calloc(depth, sizeof(int));
+	queue->pending = (bool *)calloc(depth, sizeof(bool));
+	if ( !queue->doneAt || !queue->results || !queue->pending ) {
+		free(queue->pending);
+		free(queue->results);
+		free(queue->doneAt);
+		free(queue);
+		return NULL;
+	}
+	queue->dev = (MockDevice *)device;
+	queue->ep = ep;
+	queue->depth = depth;
+	return queue;
+}
+
+static int mockQueueSubmit(void *queue, uint32 slot, uint8 *data, uint32 length) {
+	MockQueue *const self = (MockQueue *)queue;
+	const int returnCode = (self->ep & 0x80) ?
+		startBulkRead(self->dev, self->ep, data, length, &self->doneAt[slot]) :
+		startBulkWrite(self->dev, self->ep, data, length, &self->doneAt[slot]);
+	if ( returnCode < 0 ) {
+		return returnCode;
+	}
+	self->results[slot] = returnCode;
+	self->pending[slot] = true;
+	return 0;
+}
+
+static int mockQueueReap(void *queue, uint32 slot, uint32 timeout) {
+	MockQueue *const self = (MockQueue *)queue;
+	(void)timeout;
+	endTransfer(self->dev, self->doneAt[slot], false);
+	self->pending[slot] = false;
+	return self->results[slot];
+}
+
+// Cancelled transfers leave the bus straight away.
+//
+static void mockQueueClose(void *queue) {
+	MockQueue *const self = (MockQueue *)queue;
+	uint32 i;
+	for ( i = 0; i < self->depth; i++ ) {
+		if ( self->pending[i] ) {
+			endTransfer(self->dev, 0, false);
+		}
+	}
+	free(self->pending);
+	free(self->results);
+	free(self->doneAt);
+	free(self);
+}
+
+static int mockClearHalt(void *device, uint8 ep) {
+	(void)device;
+	(void)ep;
+	return 0;
+}
+
+static const char *mockStrError(void *device, int returnCode) {
+	const MockDevice *const dev = (const MockDevice *)device;
+	const char *message;
+	(void)returnCode;
+	sysMutexLock(dev->lock);
+	message = dev->lastError;
+	sysMutexUnlock(dev->lock);
+	return message;
+}
+
+static void mockClose(void *device) {
+	MockDevice *const dev = (MockDevice *)device;
+	sysMutexDestroy(dev->lock);
+	free(dev->bulkBuf);
+	free(dev->eeprom);
+	free(dev);
+}
+
+static const FX2Backend mockBackend = {
+	mockControl, mockBulkWrite, mockBulkRead, mockClearHalt, mockStrError, mockClose,
+	mockQueueOpen, mockQueueSubmit, mockQueueReap, mockQueueClose
+};
+
+// Open a session on a new simulated FX2LP, with its RAM and EEPROM filled with 0xEE and its CPU
+// running. Each call gives a separate device.
+//
+FX2Status fx2OpenMockSession(const FX2MockConfig *config, FX2Session **session) {
+	MockDevice *const dev = (MockDevice *)calloc(1, sizeof(MockDevice));
+	if ( !dev ) {
+		goto allocFailed;
+	}
+	dev->config = *config;
+	dev->eeprom = (uint8 *)malloc(config->eepromSize ? config->eepromSize : 1);
+	dev->bulkBuf = (uint8 *)malloc(config->eepromSize ? config->eepromSize : 1);
+	if ( !dev->eeprom || !dev->bulkBuf ) {
+		free(dev->bulkBuf);
+		free(dev->eeprom);
+		free(dev);
+		goto allocFailed;
+	}
+	if ( sysMutexCreate(&dev->lock) ) {
+		free(dev->bulkBuf);
+		free(dev->eeprom);
+		free(dev);
+		goto allocFailed;
+	}
+	memset(dev->ram, MOCK_FILL, RAM_SIZE);
+	memset(dev->eeprom, MOCK_FILL, config->eepromSize);
+	dev->lastError = "No error";
+	return fx2WrapDevice(&mockBackend, dev, session);
+allocFailed:
+	fx2SetError(NULL, FX2_BUFERR, FX2_PHASE_OPEN, 0, 0x0000, "Cannot allocate simulated FX2\n");
+	return FX2_BUFERR;
+}
+
+// Get a snapshot of a simulated device's counters. A real device gives all zeros.
+//
+void fx2MockGetStats(const FX2Session *session, FX2MockStats *stats) {
+	if ( session->backend == &mockBackend ) {
+		MockDevice *const dev = (MockDevice *)session->device;
+		sysMutexLock(dev->lock);
+		*stats = dev->stats;
+		sysMutexUnlock(dev->lock);
+	} else {
+		memset(stats, 0, sizeof(FX2MockStats));
+	}
+}
+
+// Get direct access to a simulated device's RAM or EEPROM, e.g to check what a load left behind.
+// Returns NULL for a real device.
+//
+uint8 *fx2MockMemory(FX2Session *session, FX2MockMemory which, uint32 *length) {
+	MockDevice *dev;
+	if ( session->backend != &mockBackend ) {
+		return NULL;
+	}
+	dev = (MockDevice *)session->device;
+	if ( which == FX2_MOCK_EEPROM ) {
+		*length = dev->config.eepromSize;
+		return dev->eeprom;
+	}
+	*length = RAM_SIZE;
+	return dev->ram;
+}
@@ -15,81 +15,280 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "fx2loader.h"
 #include "usbwrap.h"
 #include "i2c.h"
+#include "bitset.h"
 
-#ifdef WIN32
-#pragma warning(disable : 4996)
-#define snprintf sprintf_s
-#endif
+// A new 0xA0 transfer costs a SETUP and a STATUS stage plus a round trip through the host
+// controller, which takes longer than sending a few hundred bytes of padding. So gaps in the mask
+// shorter than this are sent anyway, merging the ranges either side into one transfer.
+//
+#define MERGE_GAP 256
+#define BLOCK_SIZE 4096
 
-extern char fx2ErrorMessage[];
+static FX2Status setReset(FX2Session *session, bool inReset) {
+	uint8 byte = inReset ? 0x01 : 0x00;
+	int returnCode = fx2SessionControl(
+		session,
+		(USB_ENDPOINT_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE),
+		0xA0, 0xE600, 0x0000, &byte, 1, 5000
+	);
+	if ( returnCode != 1 && inReset ) {
+		fx2SetError(
+			&session->error, FX2_USBERR, FX2_PHASE_CPU_RESET, returnCode, 0xE600,
+			"Failed to put the CPU in reset - usb_control_msg() failed returnCode %d: %s\n", returnCode, fx2SessionStrUsbError(session, returnCode));
+		return FX2_USBERR;
+	}
 
-// Write the supplied reader buffer to RAM, using the supplied VID/PID.
+	// Taking the CPU out of reset may make it renumerate before the request completes, so
+	// failure is expected there and is ignored.
+	//
+	return FX2_SUCCESS;
+}
+
+// A growable list of the chunks making up a RAM load.
 //
-FX2Status fx2WriteRAM(uint16 vid, uint16 pid, const Buffer *sourceData) {
+typedef struct {
+	FX2Chunk *chunks;
+	uint32 numChunks;
+	uint32 capacity;
+} ChunkList;
+
+// Split a contiguous range of RAM into chunks of at most BLOCK_SIZE bytes.
+//
+static FX2Status addRange(
+	FX2Session *session, ChunkList *list, uint16 address, uint8 *bufPtr, uint32 length)
+{
+	uint16 chunkSize;
+	while ( length ) {
+		if ( list->numChunks == list->capacity ) {
+			const uint32 newCapacity = list->capacity ? 2 * list->capacity : 16;
+			FX2Chunk *const newChunks = (FX2Chunk *)realloc(list->chunks, newCapacity * sizeof(FX2Chunk));
+			if ( !newChunks ) {
+				fx2SetError(
+					&session->error, FX2_BUFERR, FX2_PHASE_RAM_WRITE, 0, address,
+					"Cannot allocate RAM chunk list\n");
+				return FX2_BUFERR;
+			}
+			list->chunks = newChunks;
+			list->capacity = newCapacity;
+		}
+		chunkSize = (uint16)((length > BLOCK_SIZE) ? BLOCK_SIZE : length);
+		list->chunks[list->numChunks].address = address;
+		list->chunks[list->numChunks].length = chunkSize;
+		list->chunks[list->numChunks].data = bufPtr;
+		list->numChunks++;
+		length -= chunkSize;
+		bufPtr += chunkSize;
+		address = (uint16)(address + chunkSize);
+	}
+	return FX2_SUCCESS;
+}
+
+// Write the supplied reader buffer to RAM, using an already-open session. If a mask is supplied,
+// only the bytes it marks as used are sent, apart from short gaps which are cheaper to
+// send than to skip. The stats (if not NULL) report what was actually sent, and what sending the
+// whole buffer would have cost.
+//
+// The CPU is put into reset first and released last, but everything in between is queued up to
+// the session's queue depth, so the load is limited by bus bandwidth rather than round trips.
+//
+FX2Status fx2SessionWriteRAMBits(
+	FX2Session *session, const Buffer *sourceData, const Bitset *mask, FX2RamStats *stats)
+{
 	FX2Status status;
-	UsbDeviceHandle *deviceHandle;
-	uint16 address = 0x0000;
-	const uint8 *bufPtr = sourceData->data;
-	int bytesRemaining = sourceData->length;
-	int returnCode;
-	char byte = 0x01;
-	usbInitialise();
-	if ( usbOpenDevice(vid, pid, 1, 0, 0, &deviceHandle) ) {
-		snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "Opening FX2 device failed: %s\n", usbStrError());
-		status = FX2_USBERR;
-		goto exit;
+	FX2RamStats localStats;
+	ChunkList list = {NULL, 0, 0};
+	uint8 *const data = sourceData->data;
+	const uint32 length = sourceData->length;
+	uint32 start, end, next, i;
+	if ( !stats ) {
+		stats = &localStats;
 	}
-	usb_clear_halt(deviceHandle, 2);
-	returnCode = usb_control_msg(
-		deviceHandle,
-		(USB_ENDPOINT_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE),
-		0xA0, 0xE600, 0x0000, &byte, 1, 5000
-	);
-	if ( returnCode != 1 ) {
-		snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "Failed to put the CPU in reset - usb_control_msg() failed returnCode %d: %s\n", returnCode, usb_strerror());
-		status = FX2_USBERR;
-		goto cleanupUsb;
-	}
-	while ( bytesRemaining > 4096 ) {
-		returnCode = usb_control_msg(
-			deviceHandle,
-			(USB_ENDPOINT_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE),
-			0xA0, address, 0x0000, (char*)bufPtr, 4096, 5000
-		);
-		if ( returnCode != 4096 ) {
-			snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "Failed to write block of 4096 bytes at 0x%04X\n", address);
-			status = FX2_USBERR;
-			goto cleanupUsb;
+	stats->numBytes = 0;
+	stats->numTransfers = 0;
+	stats->fullBytes = length;
+	stats->fullTransfers = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	// Work out what needs sending
+	//
+	if ( !mask ) {
+		status = addRange(session, &list, 0x0000, data, length);
+		if ( status ) {
+			goto exit;
+		}
+	} else {
+		const uint32 limit = (length < mask->length) ? length : mask->length;
+		start = 0;
+		for ( ; ; ) {
+			// Find the start of the next used range, then its end, then keep swallowing
+			// following ranges for as long as the gaps between them are short
+			//
+			start = bitsetFindSet(mask, start);
+			if ( start >= limit ) {
+				break;
+			}
+			end = start;
+			for ( ; ; ) {
+				end = bitsetFindClear(mask, end);
+				if ( end >= limit ) {
+					end = limit;
+					break;
+				}
+				next = bitsetFindSet(mask, end);
+				if ( next >= limit || next - end > MERGE_GAP ) {
+					break;
+				}
+				end = next;
+			}
+			status = addRange(session, &list, (uint16)start, data + start, end - start);
+			if ( status ) {
+				goto exit;
+			}
+			start = end;
 		}
-		bytesRemaining -= 4096;
-		bufPtr += 4096;
-		address += 4096;
 	}
-	returnCode = usb_control_msg(
-		deviceHandle,
-		(USB_ENDPOINT_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE),
-		0xA0, address, 0x0000, (char*)bufPtr, bytesRemaining, 5000
-	);
-	if ( returnCode != bytesRemaining ) {
-		snprintf(fx2ErrorMessage, FX2_ERR_MAXLENGTH, "Failed to write block of %d bytes at 0x%04X\n", bytesRemaining, address);
-		status = FX2_USBERR;
-		goto cleanupUsb;
-	}
-	byte = 0x00;
-	usb_control_msg(
-		deviceHandle,
-		(USB_ENDPOINT_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE),
-		0xA0, 0xE600, 0x0000, &byte, 1, 5000
-	);
 
-	status = FX2_SUCCESS;
+	// Send it
+	//
+	status = setReset(session, true);
+	if ( status ) {
+		goto exit;
+	}
+	status = fx2ControlQueue(session, 0xA0, false, list.chunks, list.numChunks, FX2_PHASE_RAM_WRITE);
+	if ( status ) {
+		goto exit;
+	}
+	for ( i = 0; i < list.numChunks; i++ ) {
+		stats->numBytes += list.chunks[i].length;
+	}
+	stats->numTransfers = list.numChunks;
+	status = setReset(session, false);
 
-cleanupUsb:
-	usb_release_interface(deviceHandle, 0);
-	usb_close(deviceHandle);
 exit:
+	free(list.chunks);
+	return status;
+}
+
+// The same, with a byte-per-address mask (nonzero meaning used) instead of a Bitset.
+//
+FX2Status fx2SessionWriteRAM(
+	FX2Session *session, const Buffer *sourceData, const Buffer *sourceMask, FX2RamStats *stats)
+{
+	FX2Status status;
+	Bitset mask;
+	if ( !sourceMask ) {
+		return fx2SessionWriteRAMBits(session, sourceData, NULL, stats);
+	}
+	if ( bitsetInitialise(&mask, sourceMask->length) || bitsetFromMask(&mask, sourceMask) ) {
+		fx2SetError(
+			&session->error, FX2_BUFERR, FX2_PHASE_RAM_WRITE, 0, 0x0000,
+			"Cannot allocate RAM mask\n");
+		bitsetDestroy(&mask);
+		return FX2_BUFERR;
+	}
+	status = fx2SessionWriteRAMBits(session, sourceData, &mask, stats);
+	bitsetDestroy(&mask);
+	return status;
+}
+
+// Write a C2 image (e.g an .iic file or an EEPROM dump) straight to RAM, sending each record as soon
+// as it's decoded rather than decoding the whole thing into data/mask buffers first. The records
+// are sent from where they sit in the image, so nothing is copied. The stats report what was sent,
+// and what sending everything up to the highest address written would have cost.
+//
+FX2Status fx2SessionWriteRAMRecords(FX2Session *session, const Buffer *i2cBuffer, FX2RamStats *stats) {
+	FX2Status status, closeStatus;
+	FX2RamStats localStats;
+	FX2ControlQueue *queue;
+	I2CRecordReader reader;
+	I2CStatus iStatus;
+	uint16 address, length;
+	const uint8 *data;
+	char message[FX2_ERR_MAXLENGTH];
+	if ( !stats ) {
+		stats = &localStats;
+	}
+	stats->numBytes = 0;
+	stats->numTransfers = 0;
+	stats->fullBytes = 0;
+	stats->fullTransfers = 0;
+	if ( i2cReaderInit(&reader, i2cBuffer) ) {
+		goto badImage;
+	}
+	status = setReset(session, true);
+	if ( status ) {
+		return status;
+	}
+	status = fx2ControlQueueOpen(session, 0xA0, false, FX2_PHASE_RAM_WRITE, &queue);
+	if ( status ) {
+		return status;
+	}
+
+	// The queue only reads from the records, so it's safe to hand it the image's own storage
+	//
+	while ( (iStatus = i2cReaderNext(&reader, &address, &data, &length)) == I2C_SUCCESS ) {
+		if ( !length ) {
+			continue;
+		}
+		status = fx2ControlQueueAdd(queue, address, (uint8 *)data, length);
+		if ( status ) {
+			break;
+		}
+		stats->numBytes += length;
+		stats->numTransfers++;
+		if ( (uint32)address + length > stats->fullBytes ) {
+			stats->fullBytes = (uint32)address + length;
+		}
+	}
+	closeStatus = fx2ControlQueueClose(queue);
+	if ( closeStatus ) {
+		return closeStatus;
+	}
+	if ( status ) {
+		return status;
+	}
+	if ( iStatus != I2C_END_OF_RECORDS ) {
+		goto badImage;
+	}
+	stats->fullTransfers = (stats->fullBytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	return setReset(session, false);
+badImage:
+	strcpy(message, fx2StrError());
+	fx2SetError(&session->error, FX2_BUFERR, FX2_PHASE_RAM_WRITE, 0, 0x0000, "%s\n", message);
+	return FX2_BUFERR;
+}
+
+// Read numBytes of RAM starting at address, appending them to the supplied buffer. The CPU is left
+// as it is, so this works both in reset and with a firmware which supports 0xA0 reads.
+//
+FX2Status fx2SessionReadRAM(FX2Session *session, uint16 address, uint32 numBytes, Buffer *destData) {
+	FX2Status status;
+	ChunkList list = {NULL, 0, 0};
+	uint8 *bufPtr;
+	if ( bufAppendZeros(destData, numBytes, &bufPtr) ) {
+		fx2SetError(&session->error, FX2_BUFERR, FX2_PHASE_RAM_READ, 0, address, "%s\n", bufStrError());
+		return FX2_BUFERR;
+	}
+	status = addRange(session, &list, address, bufPtr, numBytes);
+	if ( status == FX2_SUCCESS ) {
+		status = fx2ControlQueue(session, 0xA0, true, list.chunks, list.numChunks, FX2_PHASE_RAM_READ);
+	}
+	free(list.chunks);
+	return status;
+}
+
+// Write the supplied reader buffer to RAM, using the supplied VID/PID.
+//
+FX2Status fx2WriteRAM(uint16 vid, uint16 pid, const Buffer *sourceData) {
+	FX2Session *session;
+	FX2Status status = fx2OpenSession(vid, pid, &session);
+	if ( status == FX2_SUCCESS ) {
+		status = fx2SessionWriteRAM(session, sourceData, NULL, NULL);
+		fx2CloseSession(session);
+	}
 	return status;
 }
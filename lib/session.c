@@ -0,0 +1,516 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE  // for the usbdevfs ioctl()s
+#endif
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+#endif
+#include "fx2loader.h"
+#include "usbwrap.h"
+#include "sys.h"
+
+// The libusb backend, for real devices
+//
+static int usbControl(
+	void *device, uint8 requestType, uint8 request, uint16 value, uint16 index,
+	uint8 *data, uint16 length, uint32 timeout)
+{
+	return usb_control_msg(
+		(UsbDeviceHandle *)device, requestType, request, value, index, (char*)data, length, (int)timeout);
+}
+
+static int usbBulkWrite(void *device, uint8 ep, const uint8 *data, uint32 length, uint32 timeout) {
+	return usb_bulk_write((UsbDeviceHandle *)device, ep, (char*)data, (int)length, (int)timeout);
+}
+
+static int usbBulkRead(void *device, uint8 ep, uint8 *data, uint32 length, uint32 timeout) {
+	return usb_bulk_read((UsbDeviceHandle *)device, ep, (char*)data, (int)length, (int)timeout);
+}
+
+static int usbClearHalt(void *device, uint8 ep) {
+	return usb_clear_halt((UsbDeviceHandle *)device, ep);
+}
+
+// libusb-0.1 returns -errno, so describe a failure from its own return code rather than with
+// usb_strerror(), whose single buffer is shared by every session in the process.
+//
+static const char *usbStrErrorFor(void *device, int returnCode) {
+	(void)device;
+	return (returnCode < 0) ? strerror(-returnCode) : "Short transfer";
+}
+
+static void usbClose(void *device) {
+	usb_release_interface((UsbDeviceHandle *)device, 0);
+	usb_close((UsbDeviceHandle *)device);
+}
+
+#if defined(__linux__)
+// libusb-0.1 has no asynchronous API on Linux, so a bulk queue submits URBs to usbdevfs itself,
+// through a file descriptor of its own on the device node. The kernel only lets one open file
+// claim an interface, so the claim is handed over from the libusb handle while the queue is open.
+//
+typedef struct {
+	UsbDeviceHandle *deviceHandle;
+	int fd;
+	uint8 ep;
+	uint32 depth;
+	struct usbdevfs_urb *urbs;
+	bool *pending;
+} UsbQueue;
+
+static void *usbQueueOpen(void *device, uint8 ep, uint32 depth) {
+	UsbDeviceHandle *const deviceHandle = (UsbDeviceHandle *)device;
+	struct usb_device *const dev = usb_device(deviceHandle);
+	UsbQueue *const queue = (UsbQueue *)calloc(1, sizeof(UsbQueue));
+	unsigned int iface = 0;
+	char path[FX2_PATH_MAXLENGTH];
+	if ( !queue ) {
+		return NULL;
+	}
+	queue->urbs = (struct usbdevfs_urb *)calloc(depth, sizeof(struct usbdevfs_urb));
+	queue->pending = (bool *)calloc(depth, sizeof(bool));
+	if ( !queue->urbs || !queue->pending ) {
+		goto fail;
+	}
+	queue->deviceHandle = deviceHandle;
+	queue->ep = ep;
+	queue->depth = depth;
+	if ( snprintf(path, sizeof(path), "/dev/bus/usb/%s/%s", dev->bus->dirname, dev->filename) >= (int)sizeof(path) ) {
+		goto fail;
+	}
+	queue->fd = open(path, O_RDWR);
+	if ( queue->fd < 0 ) {
+		// Older systems only have usbfs mounted under /proc
+		//
+		if ( snprintf(path, sizeof(path), "/proc/bus/usb/%s/%s", dev->bus->dirname, dev->filename) >= (int)sizeof(path) ) {
+			goto fail;
+		}
+		queue->fd = open(path, O_RDWR);
+		if ( queue->fd < 0 ) {
+			goto fail;
+		}
+	}
+	usb_release_interface(deviceHandle, 0);
+	if ( ioctl(queue->fd, USBDEVFS_CLAIMINTERFACE, &iface) < 0 ) {
+		close(queue->fd);
+		usb_claim_interface(deviceHandle, 0);
+		goto fail;
+	}
+	return queue;
+fail:
+	free(queue->pending);
+	free(queue->urbs);
+	free(queue);
+	return NULL;
+}
+
+static int usbQueueSubmit(void *queue, uint32 slot, uint8 *data, uint32 length) {
+	UsbQueue *const self = (UsbQueue *)queue;
+	struct usbdevfs_urb *const urb = self->urbs + slot;
+	memset(urb, 0, sizeof(struct usbdevfs_urb));
+	urb->type = USBDEVFS_URB_TYPE_BULK;
+	urb->endpoint = self->ep;
+	urb->buffer = data;
+	urb->buffer_length = (int)length;
+	if ( ioctl(self->fd, USBDEVFS_SUBMITURB, urb) < 0 ) {
+		return -errno;
+	}
+	self->pending[slot] = true;
+	return 0;
+}
+
+// Reap whichever URB completes first, waiting at most the given number of milliseconds (or for
+// ever, if negative).
+//
+static int reapAny(UsbQueue *self, int timeout) {
+	struct usbdevfs_urb *urb;
+	struct pollfd pollFd;
+	int returnCode;
+	for ( ;; ) {
+		if ( ioctl(self->fd, USBDEVFS_REAPURBNDELAY, &urb) == 0 ) {
+			self->pending[urb - self->urbs] = false;
+			return 0;
+		}
+		if ( errno != EAGAIN ) {
+			return -errno;
+		}
+		pollFd.fd = self->fd;
+		pollFd.events = POLLOUT;
+		pollFd.revents = 0;
+		returnCode = poll(&pollFd, 1, timeout);
+		if ( returnCode == 0 ) {
+			return -ETIMEDOUT;
+		} else if ( returnCode < 0 && errno != EINTR ) {
+			return -errno;
+		}
+	}
+}
+
+// Discard a pending URB, and wait for the kernel to give it back.
+//
+static void cancelUrb(UsbQueue *self, uint32 slot) {
+	ioctl(self->fd, USBDEVFS_DISCARDURB, self->urbs + slot);
+	while ( self->pending[slot] ) {
+		if ( reapAny(self, -1) < 0 ) {
+			break;
+		}
+	}
+}
+
+// URBs on one endpoint complete in order, but others may be reaped on the way to this one.
+//
+static int usbQueueReap(void *queue, uint32 slot, uint32 timeout) {
+	UsbQueue *const self = (UsbQueue *)queue;
+	const long long deadline = sysTimeMicros() + 1000LL * timeout;
+	long long remaining;
+	int returnCode;
+	while ( self->pending[slot] ) {
+		remaining = -1;
+		if ( timeout ) {
+			remaining = (deadline - sysTimeMicros() + 999) / 1000;
+			if ( remaining < 0 ) {
+				remaining = 0;
+			}
+		}
+		returnCode = reapAny(self, (int)remaining);
+		if ( returnCode == -ETIMEDOUT ) {
+			cancelUrb(self, slot);
+			return returnCode;
+		} else if ( returnCode < 0 ) {
+			return returnCode;
+		}
+	}
+	return self->urbs[slot].status ? self->urbs[slot].status : self->urbs[slot].actual_length;
+}
+
+static void usbQueueClose(void *queue) {
+	UsbQueue *const self = (UsbQueue *)queue;
+	unsigned int iface = 0;
+	uint32 i;
+	for ( i = 0; i < self->depth; i++ ) {
+		if ( self->pending[i] ) {
+			cancelUrb(self, i);
+		}
+	}
+	ioctl(self->fd, USBDEVFS_RELEASEINTERFACE, &iface);
+	close(self->fd);
+	usb_claim_interface(self->deviceHandle, 0);
+	free(self->pending);
+	free(self->urbs);
+	free(self);
+}
+#elif defined(WIN32)
+// libusb-win32 has a proper asynchronous API, with one context per slot.
+//
+typedef struct {
+	uint32 depth;
+	void **contexts;
+	bool *pending;
+} UsbQueue;
+
+static void usbQueueClose(void *queue);
+
+static void *usbQueueOpen(void *device, uint8 ep, uint32 depth) {
+	UsbQueue *const queue = (UsbQueue *)calloc(1, sizeof(UsbQueue));
+	uint32 i;
+	if ( !queue ) {
+		return NULL;
+	}
+	queue->depth = depth;
+	queue->contexts = (void **)calloc(depth, sizeof(void *));
+	queue->pending = (bool *)calloc(depth, sizeof(bool));
+	if ( !queue->contexts || !queue->pending ) {
+		goto fail;
+	}
+	for ( i = 0; i < depth; i++ ) {
+		if ( usb_bulk_setup_async((UsbDeviceHandle *)device, &queue->contexts[i], ep) < 0 ) {
+			goto fail;
+		}
+	}
+	return queue;
+fail:
+	usbQueueClose(queue);
+	return NULL;
+}
+
+static int usbQueueSubmit(void *queue, uint32 slot, uint8 *data, uint32 length) {
+	UsbQueue *const self = (UsbQueue *)queue;
+	const int returnCode = usb_submit_async(self->contexts[slot], (char*)data, (int)length);
+	if ( returnCode < 0 ) {
+		return returnCode;
+	}
+	self->pending[slot] = true;
+	return 0;
+}
+
+// On a timeout, usb_reap_async() cancels the transfer itself.
+//
+static int usbQueueReap(void *queue, uint32 slot, uint32 timeout) {
+	UsbQueue *const self = (UsbQueue *)queue;
+	self->pending[slot] = false;
+	return usb_reap_async(self->contexts[slot], (int)timeout);
+}
+
+static void usbQueueClose(void *queue) {
+	UsbQueue *const self = (UsbQueue *)queue;
+	uint32 i;
+	if ( self->contexts && self->pending ) {
+		for ( i = 0; i < self->depth; i++ ) {
+			if ( self->contexts[i] ) {
+				if ( self->pending[i] ) {
+					usb_cancel_async(self->contexts[i]);
+				}
+				usb_free_async(&self->contexts[i]);
+			}
+		}
+	}
+	free(self->pending);
+	free(self->contexts);
+	free(self);
+}
+#endif
+
+static const FX2Backend usbBackend = {
+	usbControl, usbBulkWrite, usbBulkRead, usbClearHalt, usbStrErrorFor, usbClose,
+	#if defined(__linux__) || defined(WIN32)
+		usbQueueOpen, usbQueueSubmit, usbQueueReap, usbQueueClose
+	#else
+		NULL, NULL, NULL, NULL
+	#endif
+};
+
+// Allocate a session around an already-opened device, which is closed again on failure.
+//
+FX2Status fx2WrapDevice(const FX2Backend *backend, void *device, FX2Session **session) {
+	FX2Session *const newSession = (FX2Session *)malloc(sizeof(FX2Session));
+	if ( !newSession ) {
+		fx2SetError(NULL, FX2_BUFERR, FX2_PHASE_OPEN, 0, 0x0000, "Cannot allocate FX2 session\n");
+		backend->close(device);
+		return FX2_BUFERR;
+	}
+	newSession->backend = backend;
+	newSession->device = device;
+	memset(&newSession->error, 0, sizeof(FX2Error));
+	newSession->queueDepth = FX2_DEFAULT_QUEUE_DEPTH;
+	*session = newSession;
+	return FX2_SUCCESS;
+}
+
+static FX2Status wrapHandle(UsbDeviceHandle *deviceHandle, FX2Session **session) {
+	usb_clear_halt(deviceHandle, 2);
+	return fx2WrapDevice(&usbBackend, deviceHandle, session);
+}
+
+// Open the first device matching the supplied VID/PID. The bus is only enumerated once; every
+// operation on the returned session reuses the same device handle. The libusb-0.1 bus list is
+// global, so enumeration is serialised across threads.
+//
+FX2Status fx2OpenSession(uint16 vid, uint16 pid, FX2Session **session) {
+	UsbDeviceHandle *deviceHandle;
+	int uStatus;
+	sysGlobalLock();
+	usbInitialise();
+	uStatus = usbOpenDevice(vid, pid, 1, 0, 0, &deviceHandle);
+	if ( uStatus ) {
+		fx2SetError(
+			NULL, FX2_USBERR, FX2_PHASE_OPEN, uStatus, 0x0000,
+			"Opening FX2 device %04X:%04X failed: %s\n", vid, pid, usbStrError());
+		sysGlobalUnlock();
+		return FX2_USBERR;
+	}
+	sysGlobalUnlock();
+	return wrapHandle(deviceHandle, session);
+}
+
+// Compare a libusb bus or device name with the one in a path. Names must either match exactly, or
+// both be decimal numbers with the same value (so "1:5" finds Linux's "001:005").
+//
+static bool nameMatches(const char *name, const char *wanted, size_t wantedLength) {
+	unsigned long nameNum, wantedNum;
+	char *end;
+	if ( strlen(name) == wantedLength && !strncmp(name, wanted, wantedLength) ) {
+		return true;
+	}
+	nameNum = strtoul(name, &end, 10);
+	if ( end == name || *end != '\0' ) {
+		return false;
+	}
+	wantedNum = strtoul(wanted, &end, 10);
+	if ( end == wanted || end != wanted + wantedLength ) {
+		return false;
+	}
+	return nameNum == wantedNum;
+}
+
+// Open the device at the supplied "bus:address" location (e.g "1:5" or "001:005"), so that one of
+// several identical boards can be picked out. Paths returned by fx2ListDevices() also work, and
+// "mock" opens a simulated device with the default timing model.
+//
+FX2Status fx2OpenSessionPath(const char *path, FX2Session **session) {
+	struct usb_bus *bus;
+	struct usb_device *device;
+	UsbDeviceHandle *deviceHandle;
+	int returnCode;
+	const char *const colon = strchr(path, ':');
+	const char *addrString;
+	if ( !strcmp(path, "mock") ) {
+		FX2MockConfig config;
+		fx2MockDefaultConfig(&config);
+		return fx2OpenMockSession(&config, session);
+	}
+	if ( !colon || colon == path || colon[1] == '\0' ) {
+		fx2SetError(
+			NULL, FX2_USBERR, FX2_PHASE_OPEN, 0, 0x0000,
+			"Malformed device path \"%s\" - expected <bus>:<address>\n", path);
+		return FX2_USBERR;
+	}
+	addrString = colon + 1;
+	sysGlobalLock();
+	usbInitialise();
+	usb_find_busses();
+	usb_find_devices();
+	for ( bus = usb_get_busses(); bus; bus = bus->next ) {
+		if ( !nameMatches(bus->dirname, path, (size_t)(colon - path)) ) {
+			continue;
+		}
+		for ( device = bus->devices; device; device = device->next ) {
+			if ( nameMatches(device->filename, addrString, strlen(addrString)) ) {
+				goto found;
+			}
+		}
+	}
+	sysGlobalUnlock();
+	fx2SetError(NULL, FX2_USBERR, FX2_PHASE_OPEN, 0, 0x0000, "No device at %s\n", path);
+	return FX2_USBERR;
+
+found:
+	// usb_open() gives no return code, so its usb_strerror() text is read before anyone else can
+	// overwrite it
+	//
+	deviceHandle = usb_open(device);
+	if ( !deviceHandle ) {
+		fx2SetError(
+			NULL, FX2_USBERR, FX2_PHASE_OPEN, 0, 0x0000,
+			"Opening device at %s failed: %s\n", path, usb_strerror());
+		sysGlobalUnlock();
+		return FX2_USBERR;
+	}
+	sysGlobalUnlock();
+	returnCode = usb_set_configuration(deviceHandle, 1);
+	if ( !returnCode ) {
+		returnCode = usb_claim_interface(deviceHandle, 0);
+	}
+	if ( returnCode ) {
+		fx2SetError(
+			NULL, FX2_USBERR, FX2_PHASE_OPEN, returnCode, 0x0000,
+			"Claiming device at %s failed: %s\n", path, usbStrErrorFor(deviceHandle, returnCode));
+		usb_close(deviceHandle);
+		return FX2_USBERR;
+	}
+	usb_set_altinterface(deviceHandle, 0);
+	return wrapHandle(deviceHandle, session);
+}
+
+// Find every device matching the supplied VID/PID, and write a path for each one which can later
+// be given to fx2OpenSessionPath(). At most maxDevices paths are written, but numDevices is set
+// to the total number found.
+//
+FX2Status fx2ListDevices(
+	uint16 vid, uint16 pid, char paths[][FX2_PATH_MAXLENGTH], uint32 maxDevices, uint32 *numDevices)
+{
+	struct usb_bus *bus;
+	struct usb_device *device;
+	uint32 count = 0;
+	sysGlobalLock();
+	usbInitialise();
+	usb_find_busses();
+	usb_find_devices();
+	for ( bus = usb_get_busses(); bus; bus = bus->next ) {
+		for ( device = bus->devices; device; device = device->next ) {
+			if ( device->descriptor.idVendor == vid && device->descriptor.idProduct == pid ) {
+				if ( count < maxDevices ) {
+					if ( strlen(bus->dirname) + strlen(device->filename) + 2 > FX2_PATH_MAXLENGTH ) {
+						sysGlobalUnlock();
+						fx2SetError(
+							NULL, FX2_USBERR, FX2_PHASE_OPEN, 0, 0x0000,
+							"Device path %s:%s is too long\n", bus->dirname, device->filename);
+						return FX2_USBERR;
+					}
+					strcpy(paths[count], bus->dirname);
+					strcat(paths[count], ":");
+					strcat(paths[count], device->filename);
+				}
+				count++;
+			}
+		}
+	}
+	sysGlobalUnlock();
+	*numDevices = count;
+	return FX2_SUCCESS;
+}
+
+// Release the device and free the session. Safe to call with NULL.
+//
+void fx2CloseSession(FX2Session *session) {
+	if ( session ) {
+		session->backend->close(session->device);
+		free(session);
+	}
+}
+
+// Raw transfers, for tools which speak their own protocol to the device
+//
+int fx2SessionControl(
+	FX2Session *session, uint8 requestType, uint8 request, uint16 value, uint16 index,
+	uint8 *data, uint16 length, uint32 timeout)
+{
+	return session->backend->control(session->device, requestType, request, value, index, data, length, timeout);
+}
+
+int fx2SessionBulkWrite(FX2Session *session, uint8 ep, const uint8 *data, uint32 length, uint32 timeout) {
+	return session->backend->bulkWrite(session->device, ep, data, length, timeout);
+}
+
+int fx2SessionBulkRead(FX2Session *session, uint8 ep, uint8 *data, uint32 length, uint32 timeout) {
+	return session->backend->bulkRead(session->device, ep, data, length, timeout);
+}
+
+int fx2SessionClearHalt(FX2Session *session, uint8 ep) {
+	return session->backend->clearHalt(session->device, ep);
+}
+
+// Describe a failed transfer on this session, given the return code of the call that failed.
+//
+const char *fx2SessionStrUsbError(FX2Session *session, int returnCode) {
+	return session->backend->strError(session->device, returnCode);
+}
+
+// Get the libusb handle underneath a session, for things the session API doesn't cover. Returns
+// NULL for a simulated device.
+//
+struct usb_dev_handle *fx2SessionUsbHandle(FX2Session *session) {
+	return (session->backend == &usbBackend) ? (struct usb_dev_handle *)session->device : NULL;
+}
@@ -0,0 +1,353 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#if defined(__linux__)
+#define _GNU_SOURCE  // for sched_setaffinity()
+#elif !defined(WIN32)
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include <stdlib.h>
+#include "sys.h"
+#ifdef WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+#endif
+
+struct SysThread {
+	#ifdef WIN32
+		HANDLE handle;
+	#else
+		pthread_t thread;
+	#endif
+	SysThreadFunc func;
+	void *arg;
+};
+
+struct SysMutex {
+	#ifdef WIN32
+		CRITICAL_SECTION section;
+	#else
+		pthread_mutex_t mutex;
+	#endif
+};
+
+struct SysCond {
+	#ifdef WIN32
+		CONDITION_VARIABLE cond;
+	#else
+		pthread_cond_t cond;
+	#endif
+};
+
+// Both platforms want a thread entry point with a different signature, so go via a trampoline.
+//
+#ifdef WIN32
+static DWORD WINAPI threadEntry(LPVOID param) {
+	SysThread *thread = (SysThread *)param;
+	thread->func(thread->arg);
+	return 0;
+}
+#else
+static void *threadEntry(void *param) {
+	SysThread *thread = (SysThread *)param;
+	thread->func(thread->arg);
+	return NULL;
+}
+#endif
+
+// Start a new thread running func(arg). Returns zero on success.
+//
+int sysThreadCreate(SysThread **thread, SysThreadFunc func, void *arg) {
+	SysThread *newThread = (SysThread *)malloc(sizeof(SysThread));
+	if ( !newThread ) {
+		return -1;
+	}
+	newThread->func = func;
+	newThread->arg = arg;
+	#ifdef WIN32
+		newThread->handle = CreateThread(NULL, 0, threadEntry, newThread, 0, NULL);
+		if ( !newThread->handle ) {
+			free(newThread);
+			return -1;
+		}
+	#else
+		if ( pthread_create(&newThread->thread, NULL, threadEntry, newThread) ) {
+			free(newThread);
+			return -1;
+		}
+	#endif
+	*thread = newThread;
+	return 0;
+}
+
+// Wait for the thread to exit, then free it.
+//
+void sysThreadJoin(SysThread *thread) {
+	#ifdef WIN32
+		WaitForSingleObject(thread->handle, INFINITE);
+		CloseHandle(thread->handle);
+	#else
+		pthread_join(thread->thread, NULL);
+	#endif
+	free(thread);
+}
+
+int sysMutexCreate(SysMutex **mutex) {
+	SysMutex *newMutex = (SysMutex *)malloc(sizeof(SysMutex));
+	if ( !newMutex ) {
+		return -1;
+	}
+	#ifdef WIN32
+		InitializeCriticalSection(&newMutex->section);
+	#else
+		if ( pthread_mutex_init(&newMutex->mutex, NULL) ) {
+			free(newMutex);
+			return -1;
+		}
+	#endif
+	*mutex = newMutex;
+	return 0;
+}
+
+void sysMutexLock(SysMutex *mutex) {
+	#ifdef WIN32
+		EnterCriticalSection(&mutex->section);
+	#else
+		pthread_mutex_lock(&mutex->mutex);
+	#endif
+}
+
+void sysMutexUnlock(SysMutex *mutex) {
+	#ifdef WIN32
+		LeaveCriticalSection(&mutex->section);
+	#else
+		pthread_mutex_unlock(&mutex->mutex);
+	#endif
+}
+
+void sysMutexDestroy(SysMutex *mutex) {
+	#ifdef WIN32
+		DeleteCriticalSection(&mutex->section);
+	#else
+		pthread_mutex_destroy(&mutex->mutex);
+	#endif
+	free(mutex);
+}
+
+int sysCondCreate(SysCond **cond) {
+	SysCond *newCond = (SysCond *)malloc(sizeof(SysCond));
+	if ( !newCond ) {
+		return -1;
+	}
+	#ifdef WIN32
+		InitializeConditionVariable(&newCond->cond);
+	#else
+		if ( pthread_cond_init(&newCond->cond, NULL) ) {
+			free(newCond);
+			return -1;
+		}
+	#endif
+	*cond = newCond;
+	return 0;
+}
+
+void sysCondWait(SysCond *cond, SysMutex *mutex) {
+	#ifdef WIN32
+		SleepConditionVariableCS(&cond->cond, &mutex->section, INFINITE);
+	#else
+		pthread_cond_wait(&cond->cond, &mutex->mutex);
+	#endif
+}
+
+void sysCondSignal(SysCond *cond) {
+	#ifdef WIN32
+		WakeConditionVariable(&cond->cond);
+	#else
+		pthread_cond_signal(&cond->cond);
+	#endif
+}
+
+void sysCondBroadcast(SysCond *cond) {
+	#ifdef WIN32
+		WakeAllConditionVariable(&cond->cond);
+	#else
+		pthread_cond_broadcast(&cond->cond);
+	#endif
+}
+
+void sysCondDestroy(SysCond *cond) {
+	#ifndef WIN32
+		pthread_cond_destroy(&cond->cond);
+	#endif
+	free(cond);
+}
+
+#ifdef WIN32
+	static CRITICAL_SECTION globalSection;
+	static volatile LONG globalState = 0;  // 0 = uninitialised, 1 = initialising, 2 = ready
+#else
+	static pthread_mutex_t globalMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void sysGlobalLock(void) {
+	#ifdef WIN32
+		if ( globalState != 2 ) {
+			if ( InterlockedCompareExchange(&globalState, 1, 0) == 0 ) {
+				InitializeCriticalSection(&globalSection);
+				InterlockedExchange(&globalState, 2);
+			} else {
+				while ( globalState != 2 ) {
+					Sleep(0);
+				}
+			}
+		}
+		EnterCriticalSection(&globalSection);
+	#else
+		pthread_mutex_lock(&globalMutex);
+	#endif
+}
+
+void sysGlobalUnlock(void) {
+	#ifdef WIN32
+		LeaveCriticalSection(&globalSection);
+	#else
+		pthread_mutex_unlock(&globalMutex);
+	#endif
+}
+
+void sysMemoryBarrier(void) {
+	#ifdef WIN32
+		MemoryBarrier();
+	#else
+		__sync_synchronize();
+	#endif
+}
+
+long long sysTimeMicros(void) {
+	#ifdef WIN32
+		LARGE_INTEGER count, freq;
+		QueryPerformanceCounter(&count);
+		QueryPerformanceFrequency(&freq);
+		return (long long)((double)count.QuadPart * 1000000.0 / (double)freq.QuadPart);
+	#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	#endif
+}
+
+long long sysCpuMicros(void) {
+	#ifdef WIN32
+		FILETIME creationTime, exitTime, kernelTime, userTime;
+		ULARGE_INTEGER kernel, user;
+		GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime);
+		kernel.LowPart = kernelTime.dwLowDateTime;
+		kernel.HighPart = kernelTime.dwHighDateTime;
+		user.LowPart = userTime.dwLowDateTime;
+		user.HighPart = userTime.dwHighDateTime;
+		return (long long)((kernel.QuadPart + user.QuadPart) / 10);  // 100ns units
+	#else
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return
+			(long long)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+			usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+	#endif
+}
+
+void sysSleepMicros(long micros) {
+	#ifdef WIN32
+		Sleep((DWORD)((micros + 999) / 1000));
+	#else
+		struct timespec ts;
+		ts.tv_sec = micros / 1000000;
+		ts.tv_nsec = (micros % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+	#endif
+}
+
+void sysYield(void) {
+	#ifdef WIN32
+		SwitchToThread();
+	#else
+		sched_yield();
+	#endif
+}
+
+static int compareMicros(const void *a, const void *b) {
+	const uint32 x = *(const uint32 *)a;
+	const uint32 y = *(const uint32 *)b;
+	return (x > y) - (x < y);
+}
+
+// Sort an array of timings (e.g per-transfer latencies) into ascending order, for sysPercentile().
+//
+void sysSortMicros(uint32 *micros, uint32 count) {
+	qsort(micros, count, sizeof(uint32), compareMicros);
+}
+
+// Nearest-rank percentile (p from 0 to 1) of an already-sorted array, or zero if it's empty.
+//
+uint32 sysPercentile(const uint32 *sorted, uint32 count, double p) {
+	uint32 rank;
+	if ( count == 0 ) {
+		return 0;
+	}
+	rank = (uint32)(p * count + 0.999999);
+	if ( rank < 1 ) {
+		rank = 1;
+	} else if ( rank > count ) {
+		rank = count;
+	}
+	return sorted[rank - 1];
+}
+
+// Keep the calling thread on the given CPU, to take migrations out of latency measurements.
+// Returns nonzero if that's not possible (or not supported).
+//
+int sysPinToCpu(int cpu) {
+	#ifdef WIN32
+		return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) ? 0 : -1;
+	#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return sched_setaffinity(0, sizeof(set), &set);
+	#else
+		(void)cpu;
+		return -1;
+	#endif
+}
+
+// Give the calling thread the highest realtime priority (SCHED_FIFO on POSIX), so nothing else
+// gets in between it and the bus. Usually needs root. Returns nonzero if it can't be done.
+//
+int sysSetRealtime(void) {
+	#ifdef WIN32
+		if ( !SetPriorityClass(GetCurrentProcess(), REALTIME_PRIORITY_CLASS) ) {
+			return -1;
+		}
+		return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) ? 0 : -1;
+	#else
+		struct sched_param param;
+		param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+		return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) ? -1 : 0;
+	#endif
+}
@@ -0,0 +1,87 @@
+/* 
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SYS_H
+#define SYS_H
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// Thin portability layer over the Win32 and POSIX thread, lock and clock APIs, so the tools
+	// can overlap file I/O with USB transfers without sprinkling #ifdefs everywhere.
+	//
+	typedef struct SysThread SysThread;
+	typedef struct SysMutex SysMutex;
+	typedef struct SysCond SysCond;
+	typedef void (*SysThreadFunc)(void *arg);
+
+	int sysThreadCreate(SysThread **thread, SysThreadFunc func, void *arg);
+	void sysThreadJoin(SysThread *thread);
+
+	int sysMutexCreate(SysMutex **mutex);
+	void sysMutexLock(SysMutex *mutex);
+	void sysMutexUnlock(SysMutex *mutex);
+	void sysMutexDestroy(SysMutex *mutex);
+
+	// Condition variable, for a thread to sleep until another one changes something guarded by
+	// a mutex. The mutex must be held when calling sysCondWait(); as usual, a wakeup doesn't
+	// guarantee the condition holds, so wait in a loop.
+	//
+	int sysCondCreate(SysCond **cond);
+	void sysCondWait(SysCond *cond, SysMutex *mutex);
+	void sysCondSignal(SysCond *cond);
+	void sysCondBroadcast(SysCond *cond);
+	void sysCondDestroy(SysCond *cond);
+
+	// A single process-wide lock which needs no creating, for serialising calls into code that
+	// isn't reentrant (e.g libusb-0.1's device enumeration).
+	//
+	void sysGlobalLock(void);
+	void sysGlobalUnlock(void);
+
+	// Full memory barrier, for publishing data between a producer and a consumer thread.
+	//
+	void sysMemoryBarrier(void);
+
+	// Monotonic time in microseconds since some arbitrary point in the past.
+	//
+	long long sysTimeMicros(void);
+
+	// User plus kernel CPU time consumed by the whole process so far, in microseconds.
+	//
+	long long sysCpuMicros(void);
+	void sysSleepMicros(long micros);
+	void sysYield(void);
+
+	// Latency statistics for benchmarks: sort an array of timings, then pick percentiles from it.
+	//
+	void sysSortMicros(uint32 *micros, uint32 count);
+	uint32 sysPercentile(const uint32 *sorted, uint32 count, double p);
+
+	// Scheduling controls for benchmarks. Both apply to the calling thread and return nonzero on
+	// failure.
+	//
+	int sysPinToCpu(int cpu);
+	int sysSetRealtime(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
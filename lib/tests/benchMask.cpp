@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "../mask.h"
+#include "../sys.h"
+#include "naiveMask.h"
+
+#define IMAGE_SIZE 0x10000
+#define NUM_PASSES 200
+
+// Walk every run of a 64KiB firmware-like image and copy the used bytes out of it, first a byte at
+// a time and then with the word kernels (copying each run they find in one go), and report how
+// long each took. This is a timing, not a test, so it is built separately from runTests by
+// "make bench".
+//
+int main(void) {
+	static uint8 mask[IMAGE_SIZE], src[IMAGE_SIZE], dest1[IMAGE_SIZE], dest2[IMAGE_SIZE];
+	long long naiveMicros, wordMicros;
+	uint32 pass, i, end, naiveRuns = 0, wordRuns = 0;
+	makeMask(mask, IMAGE_SIZE, 600, 42);
+	for ( i = 0; i < IMAGE_SIZE; i++ ) {
+		src[i] = (uint8)(i ^ (i >> 8));
+	}
+
+	naiveMicros = sysTimeMicros();
+	for ( pass = 0; pass < NUM_PASSES; pass++ ) {
+		i = naiveFindSet(mask, 0, IMAGE_SIZE);
+		while ( i < IMAGE_SIZE ) {
+			end = naiveFindClear(mask, i, IMAGE_SIZE);
+			naiveRuns++;
+			i = naiveFindSet(mask, end, IMAGE_SIZE);
+		}
+		for ( i = 0; i < IMAGE_SIZE; i++ ) {
+			if ( mask[i] ) {
+				dest1[i] = src[i];
+			}
+		}
+	}
+	naiveMicros = sysTimeMicros() - naiveMicros;
+
+	wordMicros = sysTimeMicros();
+	for ( pass = 0; pass < NUM_PASSES; pass++ ) {
+		i = maskFindSet(mask, 0, IMAGE_SIZE);
+		while ( i < IMAGE_SIZE ) {
+			end = maskFindClear(mask, i, IMAGE_SIZE);
+			wordRuns++;
+			memcpy(dest2 + i, src + i, end - i);
+			i = maskFindSet(mask, end, IMAGE_SIZE);
+		}
+	}
+	wordMicros = sysTimeMicros() - wordMicros;
+
+	if ( naiveRuns != wordRuns || memcmp(dest1, dest2, IMAGE_SIZE) ) {
+		fprintf(stderr, "Word kernels disagree with the byte loop!\n");
+		return 1;
+	}
+	printf(
+		"Mask scan+copy of 64KiB: byte loop %.1f us, word kernels %.1f us (%.1fx)\n",
+		(double)naiveMicros / NUM_PASSES, (double)wordMicros / NUM_PASSES,
+		wordMicros ? (double)naiveMicros / (double)wordMicros : 0.0);
+	return 0;
+}
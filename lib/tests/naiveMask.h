@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef NAIVEMASK_H
+#define NAIVEMASK_H
+
+#include "types.h"
+
+// Byte-at-a-time versions, as the encoder used to do it
+//
+static uint32 naiveFindSet(const uint8 *mask, uint32 from, uint32 length) {
+	while ( from < length && !mask[from] ) {
+		from++;
+	}
+	return from;
+}
+
+static uint32 naiveFindClear(const uint8 *mask, uint32 from, uint32 length) {
+	while ( from < length && mask[from] ) {
+		from++;
+	}
+	return from;
+}
+
+// Fill a mask with alternating used and unused runs. The run lengths are random up to maxRun, and
+// the used bytes are random nonzero values so the kernels can't rely on them being 0x01.
+//
+static void makeMask(uint8 *mask, uint32 length, uint32 maxRun, uint32 seed) {
+	uint32 i = 0, runLength, j;
+	bool used = false;
+	while ( i < length ) {
+		seed = seed * 1103515245 + 12345;
+		runLength = (seed >> 16) % maxRun + 1;
+		for ( j = 0; j < runLength && i < length; j++, i++ ) {
+			seed = seed * 1103515245 + 12345;
+			mask[i] = used ? (uint8)((seed >> 16) % 255 + 1) : 0x00;
+		}
+		used = !used;
+	}
+}
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <UnitTest++.h>
+#include "../bitset.h"
+#include "types.h"
+
+#define NUM_BITS 700
+
+// Check a bitset against a byte-per-bit reference, including every search.
+//
+static void checkAgainst(const Bitset *bits, const uint8 *expected, uint32 length) {
+	uint32 i, count = 0, next;
+	CHECK_EQUAL(length, bits->length);
+	for ( i = 0; i < length; i++ ) {
+		CHECK_EQUAL(expected[i] ? true : false, bitsetTest(bits, i));
+		count += expected[i];
+		for ( next = i; next < length && !expected[next]; next++ );
+		CHECK_EQUAL(next, bitsetFindSet(bits, i));
+		for ( next = i; next < length && expected[next]; next++ );
+		CHECK_EQUAL(next, bitsetFindClear(bits, i));
+	}
+	CHECK_EQUAL(count, bitsetCount(bits));
+	CHECK_EQUAL(false, bitsetTest(bits, length));
+	CHECK_EQUAL(length + 5, bitsetFindSet(bits, length + 5));
+}
+
+TEST(Bitset_testRanges) {
+	static uint8 expected[NUM_BITS];
+	Bitset bits;
+	uint32 seed = 1, trial, start, count, length = 0;
+	memset(expected, 0, NUM_BITS);
+	CHECK_EQUAL(BITSET_SUCCESS, bitsetInitialise(&bits, 0));
+	for ( trial = 0; trial < 200; trial++ ) {
+		seed = seed * 1103515245 + 12345;
+		start = (seed >> 8) % (NUM_BITS - 150);
+		seed = seed * 1103515245 + 12345;
+		count = (seed >> 8) % 150;
+		if ( (trial % 3) == 2 ) {
+			bitsetClearRange(&bits, start, count);
+			if ( start < length ) {
+				memset(expected + start, 0, ((start + count < length) ? start + count : length) - start);
+			}
+		} else {
+			CHECK_EQUAL(BITSET_SUCCESS, bitsetSetRange(&bits, start, count));
+			memset(expected + start, 1, count);
+			if ( count && start + count > length ) {
+				length = start + count;
+			}
+		}
+		if ( (trial % 20) == 0 ) {
+			checkAgainst(&bits, expected, length);
+		}
+	}
+	checkAgainst(&bits, expected, length);
+	bitsetDestroy(&bits);
+}
+
+TEST(Bitset_testMaskAdapters) {
+	Buffer mask, back;
+	Bitset bits;
+	uint32 i;
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&mask, 1024, 0x00));
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&back, 1024, 0x00));
+	CHECK_EQUAL(BUF_SUCCESS, bufAppendZeros(&mask, 333, NULL));
+	for ( i = 0; i < 333; i++ ) {
+		mask.data[i] = ((i / 7) % 3 == 1 || i == 64 || i == 127) ? (uint8)(i | 1) : 0x00;
+	}
+	CHECK_EQUAL(BITSET_SUCCESS, bitsetInitialise(&bits, 0));
+	CHECK_EQUAL(BITSET_SUCCESS, bitsetSetRange(&bits, 1000, 10));  // replaced by the conversion
+	CHECK_EQUAL(BITSET_SUCCESS, bitsetFromMask(&bits, &mask));
+	CHECK_EQUAL(333UL, bits.length);
+	CHECK_EQUAL(333UL, bitsetFindSet(&bits, 330));
+	CHECK_EQUAL(BITSET_SUCCESS, bitsetToMask(&bits, &back));
+	CHECK_EQUAL(333UL, back.length);
+	for ( i = 0; i < 333; i++ ) {
+		CHECK_EQUAL(mask.data[i] ? 0x01 : 0x00, back.data[i]);
+	}
+	bitsetDestroy(&bits);
+	bufDestroy(&back);
+	bufDestroy(&mask);
+}
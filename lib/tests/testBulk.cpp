@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <UnitTest++.h>
+#include "../fx2loader.h"
+#include "../sys.h"
+#include "types.h"
+
+#define NUM_TRANSFERS 16
+#define TRANSFER_SIZE 512
+
+// Read NUM_TRANSFERS transfers from EP8IN through a queue of the supplied depth, with a simulated
+// 2ms round trip, checking they arrive in order. Returns how long it took.
+//
+static long long timeQueuedReads(uint32 depth) {
+	static uint8 buffers[NUM_TRANSFERS][TRANSFER_SIZE];
+	FX2MockConfig config;
+	FX2MockStats mockStats;
+	FX2Session *session;
+	FX2BulkQueue *queue;
+	uint32 submitted = 0, reaped = 0, i;
+	long long elapsed;
+	fx2MockDefaultConfig(&config);
+	config.latencyMicros = 2000;
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	CHECK_EQUAL(FX2_SUCCESS, fx2BulkQueueOpen(session, 0x88, depth, &queue));
+	CHECK_EQUAL(depth, fx2BulkQueueInFlight(queue));
+	elapsed = sysTimeMicros();
+	while ( reaped < NUM_TRANSFERS ) {
+		while ( submitted < NUM_TRANSFERS && fx2BulkQueuePending(queue) < depth ) {
+			CHECK_EQUAL(0, fx2BulkQueueSubmit(queue, buffers[submitted], TRANSFER_SIZE));
+			submitted++;
+		}
+		CHECK_EQUAL(TRANSFER_SIZE, fx2BulkQueueReap(queue, 1000));
+		reaped++;
+	}
+	elapsed = sysTimeMicros() - elapsed;
+	CHECK_EQUAL(0UL, fx2BulkQueuePending(queue));
+	fx2BulkQueueClose(queue);
+	for ( i = 0; i < NUM_TRANSFERS; i++ ) {
+		// The counting pattern carries on from one transfer to the next
+		//
+		CHECK_EQUAL((uint8)(i * TRANSFER_SIZE), buffers[i][0]);
+		CHECK_EQUAL((uint8)(i * TRANSFER_SIZE + TRANSFER_SIZE - 1), buffers[i][TRANSFER_SIZE - 1]);
+	}
+	fx2MockGetStats(session, &mockStats);
+	CHECK_EQUAL(depth, mockStats.maxInFlight);
+	fx2CloseSession(session);
+	return elapsed;
+}
+
+TEST(Bulk_testQueueHidesLatency) {
+	// Sixteen round trips one after another, but only four when they're in flight four at a time
+	//
+	const long long serial = timeQueuedReads(1);
+	const long long queued = timeQueuedReads(4);
+	CHECK(serial >= NUM_TRANSFERS * 2000);
+	CHECK(queued < serial / 2);
+}
+
+TEST(Bulk_testQueueCancel) {
+	// Closing a queue with transfers still pending retires them
+	//
+	uint8 block[TRANSFER_SIZE] = {0};
+	FX2MockConfig config;
+	FX2MockStats mockStats;
+	FX2Session *session;
+	FX2BulkQueue *queue;
+	fx2MockDefaultConfig(&config);
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	CHECK_EQUAL(FX2_SUCCESS, fx2BulkQueueOpen(session, 0x06, 4, &queue));
+	CHECK_EQUAL(0, fx2BulkQueueSubmit(queue, block, TRANSFER_SIZE));
+	CHECK_EQUAL(0, fx2BulkQueueSubmit(queue, block, TRANSFER_SIZE));
+	CHECK_EQUAL(2UL, fx2BulkQueuePending(queue));
+	fx2BulkQueueClose(queue);
+
+	// Nothing is left in flight, so one more synchronous write is the only one
+	//
+	CHECK_EQUAL(TRANSFER_SIZE, fx2SessionBulkWrite(session, 0x06, block, TRANSFER_SIZE, 1000));
+	fx2MockGetStats(session, &mockStats);
+	CHECK_EQUAL(2UL, mockStats.maxInFlight);
+	CHECK_EQUAL(3LL * TRANSFER_SIZE, mockStats.bulkOutBytes);
+	fx2CloseSession(session);
+}
@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <UnitTest++.h>
+#include "../fx2loader.h"
+#include "../i2c.h"
+#include "types.h"
+
+TEST(EEPROM_testRoundTrip) {
+	FX2MockConfig config;
+	FX2MockStats mockStats;
+	FX2Session *session;
+	Buffer image, readBack;
+	uint8 *eeprom;
+	uint32 eepromSize, i;
+	fx2MockDefaultConfig(&config);
+	config.writeCycleMicros = 0;
+	config.supportsBulkEEPROM = false;  // old firmware: everything goes through 0xA2
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&image, 5000, 0x00));
+	CHECK_EQUAL(BUF_SUCCESS, bufAppendZeros(&image, 5000, NULL));
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&readBack, 1024, 0x00));
+	for ( i = 0; i < 5000; i++ ) {
+		image.data[i] = (uint8)(i * 7);
+	}
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionWriteEEPROM(session, &image));
+	eeprom = fx2MockMemory(session, FX2_MOCK_EEPROM, &eepromSize);
+	CHECK_EQUAL(0x4000UL, eepromSize);
+	CHECK_ARRAY_EQUAL(image.data, eeprom, 5000);
+	CHECK_EQUAL(0xEE, eeprom[5000]);
+	fx2MockGetStats(session, &mockStats);
+	CHECK_EQUAL(2UL, mockStats.numEepromWrites);    // one 4KiB block, then the rest...
+	CHECK_EQUAL(79UL, mockStats.numPageWrites);     // ...written a 64-byte packet at a time
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionReadEEPROM(session, 5000, &readBack));
+	CHECK_EQUAL(5000UL, readBack.length);
+	CHECK_ARRAY_EQUAL(image.data, readBack.data, 5000);
+	fx2CloseSession(session);
+	bufDestroy(&readBack);
+	bufDestroy(&image);
+}
+
+TEST(EEPROM_testBulk) {
+	FX2MockConfig config;
+	FX2MockStats before, after;
+	FX2Session *session;
+	Buffer image, readBack;
+	uint8 *eeprom;
+	uint32 eepromSize, i;
+	fx2MockDefaultConfig(&config);
+	config.writeCycleMicros = 100;
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&image, 4096, 0x00));
+	CHECK_EQUAL(BUF_SUCCESS, bufAppendZeros(&image, 4096, NULL));
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&readBack, 1024, 0x00));
+	for ( i = 0; i < 4096; i++ ) {
+		image.data[i] = (uint8)(i * 13);
+	}
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+
+	// A whole number of packets, so it needs a zero-length packet to end it. Apart from polling
+	// for the last write cycle, the only control transfer is the one which starts it.
+	//
+	fx2MockGetStats(session, &before);
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionWriteEEPROM(session, &image));
+	fx2MockGetStats(session, &after);
+	eeprom = fx2MockMemory(session, FX2_MOCK_EEPROM, &eepromSize);
+	CHECK_ARRAY_EQUAL(image.data, eeprom, 4096);
+	CHECK_EQUAL(0xEE, eeprom[4096]);
+	CHECK_EQUAL(1UL, after.numEepromWrites - before.numEepromWrites);
+	CHECK_EQUAL(64UL, after.numPageWrites - before.numPageWrites);
+	CHECK(after.numControl - before.numControl >= 2);
+	CHECK_EQUAL(4096LL, after.bulkOutBytes - before.bulkOutBytes);
+	CHECK_EQUAL(0UL, after.numStrayBulkOut);
+
+	// Reads are one control transfer and one bulk transfer
+	//
+	fx2MockGetStats(session, &before);
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionReadEEPROM(session, 4096, &readBack));
+	fx2MockGetStats(session, &after);
+	CHECK_EQUAL(4096UL, readBack.length);
+	CHECK_ARRAY_EQUAL(image.data, readBack.data, 4096);
+	CHECK_EQUAL(1UL, after.numControl - before.numControl);
+	CHECK_EQUAL(4096LL, after.bulkInBytes - before.bulkInBytes);
+
+	// A whole number of full-speed packets but not of high-speed ones already ends on a short
+	// packet, so no zero-length packet should follow it
+	//
+	image.length = 576;
+	for ( i = 0; i < 576; i++ ) {
+		image.data[i] = (uint8)~image.data[i];
+	}
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionWriteEEPROM(session, &image));
+	fx2MockGetStats(session, &after);
+	CHECK_ARRAY_EQUAL(image.data, eeprom, 576);
+	CHECK_EQUAL(0UL, after.numStrayBulkOut);
+	fx2CloseSession(session);
+	bufDestroy(&readBack);
+	bufDestroy(&image);
+}
+
+TEST(EEPROM_testPageAligned) {
+	FX2MockConfig config;
+	FX2MockStats before, after;
+	FX2Session *session;
+	uint8 data[200];
+	uint8 *eeprom;
+	uint32 eepromSize, i;
+	fx2MockDefaultConfig(&config);
+	config.writeCycleMicros = 0;
+	config.eepromPageSize = 128;  // e.g 24LC512
+	for ( i = 0; i < 200; i++ ) {
+		data[i] = (uint8)i;
+	}
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	eeprom = fx2MockMemory(session, FX2_MOCK_EEPROM, &eepromSize);
+
+	// A write straddling the end of the first page is split at the page boundary rather than
+	// wrapping back to the page's start
+	//
+	fx2MockGetStats(session, &before);
+	CHECK_EQUAL(16, fx2SessionControl(session, 0x40, 0xA2, 56, 0x0000, data, 16, 5000));
+	fx2MockGetStats(session, &after);
+	CHECK_ARRAY_EQUAL(data, eeprom + 56, 16);
+	CHECK_EQUAL(0xEE, eeprom[0]);
+	CHECK_EQUAL(2UL, after.numPageWrites - before.numPageWrites);
+
+	// A bigger page size in wIndex means fewer write cycles...
+	//
+	fx2MockGetStats(session, &before);
+	CHECK_EQUAL(200, fx2SessionControl(session, 0x40, 0xA2, 0x100, 0x0080, data, 200, 5000));
+	fx2MockGetStats(session, &after);
+	CHECK_ARRAY_EQUAL(data, eeprom + 0x100, 200);
+	CHECK_EQUAL(2UL, after.numPageWrites - before.numPageWrites);
+
+	// ...but if the part's pages are really smaller, it wraps, as on a real 24LC
+	//
+	fx2CloseSession(session);
+	config.eepromPageSize = 64;
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	eeprom = fx2MockMemory(session, FX2_MOCK_EEPROM, &eepromSize);
+	CHECK_EQUAL(96, fx2SessionControl(session, 0x40, 0xA2, 0x0000, 0x0080, data, 96, 5000));
+	CHECK_ARRAY_EQUAL(data + 64, eeprom, 32);
+	CHECK_ARRAY_EQUAL(data + 32, eeprom + 32, 32);
+	CHECK_EQUAL(0xEE, eeprom[64]);
+	fx2CloseSession(session);
+}
+
+TEST(EEPROM_testNoFirmware) {
+	FX2MockConfig config;
+	FX2Session *session;
+	Buffer image;
+	const FX2Error *error;
+	fx2MockDefaultConfig(&config);
+	config.supportsEEPROM = false;
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&image, 1024, 0x00));
+	CHECK_EQUAL(BUF_SUCCESS, bufAppendZeros(&image, 100, NULL));
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	CHECK_EQUAL(FX2_USBERR, fx2SessionWriteEEPROM(session, &image));
+	error = fx2SessionError(session);
+	CHECK_EQUAL(FX2_PHASE_EEPROM_WRITE, error->phase);
+	CHECK(error->usbCode < 0);
+	fx2CloseSession(session);
+	bufDestroy(&image);
+}
+
+TEST(EEPROM_testReadImageOnly) {
+	FX2MockConfig config;
+	FX2MockStats before, after;
+	FX2Session *session;
+	Buffer data, mask, image, readBack;
+	uint32 i;
+	fx2MockDefaultConfig(&config);
+	config.writeCycleMicros = 0;
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&data, 3000, 0x00));
+	CHECK_EQUAL(BUF_SUCCESS, bufAppendZeros(&data, 3000, NULL));
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&mask, 3000, 0x00));
+	CHECK_EQUAL(BUF_SUCCESS, bufAppendConst(&mask, 3000, 0x01, NULL));
+	for ( i = 0; i < 3000; i++ ) {
+		data.data[i] = (uint8)(i * 13);
+	}
+	memset(mask.data + 1500, 0x00, 100);
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&image, 1024, 0x00));
+	CHECK_EQUAL(I2C_SUCCESS, i2cInitialise(&image, 0x0000, 0x0000, 0x0000, CONFIG_BYTE_400KHZ));
+	CHECK_EQUAL(I2C_SUCCESS, i2cWritePromRecords(&image, &data, &mask));
+	CHECK_EQUAL(I2C_SUCCESS, i2cFinalise(&image));
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&readBack, 1024, 0x00));
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionWriteEEPROM(session, &image));
+
+	// Header, then one read per record (each half of the image needs two), then the CPUCS record's
+	// data
+	//
+	fx2MockGetStats(session, &before);
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionReadEEPROMImage(session, 0x4000, &readBack));
+	fx2MockGetStats(session, &after);
+	CHECK_EQUAL(image.length, readBack.length);
+	CHECK_ARRAY_EQUAL(image.data, readBack.data, image.length);
+	CHECK_EQUAL(6UL, after.numControl - before.numControl);
+
+	// Something which isn't a C2 image is read in full
+	//
+	image.data[0] = 0xC0;
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionWriteEEPROM(session, &image));
+	readBack.length = 0;
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionReadEEPROMImage(session, 0x4000, &readBack));
+	CHECK_EQUAL(0x4000UL, readBack.length);
+	fx2CloseSession(session);
+	bufDestroy(&readBack);
+	bufDestroy(&image);
+	bufDestroy(&mask);
+	bufDestroy(&data);
+}
+
+TEST(EEPROM_testUpdateChangedPages) {
+	FX2MockConfig config;
+	FX2MockStats before, after;
+	FX2EepromStats stats;
+	FX2Session *session;
+	Buffer oldImage, newImage;
+	uint8 *eeprom;
+	uint32 eepromSize, i;
+	fx2MockDefaultConfig(&config);
+	config.writeCycleMicros = 0;
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&oldImage, 3000, 0x00));
+	CHECK_EQUAL(BUF_SUCCESS, bufAppendZeros(&oldImage, 3000, NULL));
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&newImage, 3010, 0x00));
+	for ( i = 0; i < 3000; i++ ) {
+		oldImage.data[i] = (uint8)(i * 5);
+	}
+	CHECK_EQUAL(BUF_SUCCESS, bufAppendBlock(&newImage, oldImage.data, 3000));
+	CHECK_EQUAL(BUF_SUCCESS, bufAppendConst(&newImage, 10, 0x42, NULL));
+	newImage.data[100] ^= 0xFF;  // page 1
+	newImage.data[127] ^= 0xFF;  // still page 1
+	newImage.data[2050] ^= 0xFF; // page 32
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionWriteEEPROM(session, &oldImage));
+
+	// Read what's there, then write the pages that changed: two in the middle, and the last two
+	// because the image grew
+	//
+	fx2MockGetStats(session, &before);
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionUpdateEEPROM(session, &newImage, NULL, 64, &stats));
+	fx2MockGetStats(session, &after);
+	CHECK_EQUAL(48UL, stats.numPages);
+	CHECK_EQUAL(4UL, stats.pagesWritten);
+	CHECK_EQUAL(3UL * 64UL + (3010UL - 47UL * 64UL), stats.bytesWritten);
+	CHECK_EQUAL(4UL, after.numPageWrites - before.numPageWrites);
+	eeprom = fx2MockMemory(session, FX2_MOCK_EEPROM, &eepromSize);
+	CHECK_ARRAY_EQUAL(newImage.data, eeprom, 3010);
+
+	// With the current contents known up front, nothing is read or written
+	//
+	fx2MockGetStats(session, &before);
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionUpdateEEPROM(session, &newImage, &newImage, 64, &stats));
+	fx2MockGetStats(session, &after);
+	CHECK_EQUAL(0UL, stats.pagesWritten);
+	CHECK_EQUAL(0UL, after.numControl - before.numControl);
+
+	// Pages smaller than an EP0 packet are sent together, but written a page at a time
+	//
+	newImage.data[0] ^= 0xFF;
+	newImage.data[16] ^= 0xFF;
+	fx2MockGetStats(session, &before);
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionUpdateEEPROM(session, &newImage, NULL, 16, &stats));
+	fx2MockGetStats(session, &after);
+	CHECK_EQUAL(2UL, stats.pagesWritten);
+	CHECK_EQUAL(1UL, after.numEepromWrites - before.numEepromWrites);
+	CHECK_EQUAL(2UL, after.numPageWrites - before.numPageWrites);
+	CHECK_ARRAY_EQUAL(newImage.data, eeprom, 3010);
+	CHECK_EQUAL(FX2_BUFERR, fx2SessionUpdateEEPROM(session, &newImage, NULL, 48, &stats));
+	fx2CloseSession(session);
+	bufDestroy(&newImage);
+	bufDestroy(&oldImage);
+}
+
+TEST(EEPROM_testVerifyCrc) {
+	FX2MockConfig config;
+	FX2MockStats before, after;
+	FX2Session *session;
+	Buffer image;
+	const FX2Error *error;
+	uint8 *eeprom;
+	uint32 eepromSize, i;
+	uint16 crc;
+	const uint8 check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+	CHECK_EQUAL(0x29B1, fx2Crc16(FX2_CRC_INIT, check, 9));  // the standard check value
+	fx2MockDefaultConfig(&config);
+	config.writeCycleMicros = 0;
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&image, 10000, 0x00));
+	CHECK_EQUAL(BUF_SUCCESS, bufAppendZeros(&image, 10000, NULL));
+	for ( i = 0; i < 10000; i++ ) {
+		image.data[i] = (uint8)(i * 3 + (i >> 8));
+	}
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionWriteEEPROM(session, &image));
+
+	// Three blocks, so three two-byte transfers
+	//
+	fx2MockGetStats(session, &before);
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionVerifyEEPROM(session, &image));
+	fx2MockGetStats(session, &after);
+	CHECK_EQUAL(3UL, after.numControl - before.numControl);
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionGetCrc(session, FX2_MEM_EEPROM, 100, 50, &crc));
+	CHECK_EQUAL(fx2Crc16(FX2_CRC_INIT, image.data + 100, 50), crc);
+
+	// A bad byte is found, to within a block
+	//
+	eeprom = fx2MockMemory(session, FX2_MOCK_EEPROM, &eepromSize);
+	eeprom[5000] ^= 0x01;
+	CHECK_EQUAL(FX2_VERIFYERR, fx2SessionVerifyEEPROM(session, &image));
+	error = fx2SessionError(session);
+	CHECK_EQUAL(FX2_PHASE_EEPROM_VERIFY, error->phase);
+	CHECK_EQUAL(4096UL, error->address);
+	fx2CloseSession(session);
+
+	// Firmware without the command
+	//
+	config.supportsCrc = false;
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	CHECK_EQUAL(FX2_USBERR, fx2SessionVerifyEEPROM(session, &image));
+	fx2CloseSession(session);
+	bufDestroy(&image);
+}
@@ -115,3 +115,92 @@ TEST(I2C_testFinaliseNoInit) {
 	CHECK_EQUAL(I2C_NOT_INITIALISED, iStatus);
 	bufDestroy(&buf);
 }
+
+// Encode the supplied data/mask with the chosen rule, check it decodes back to the same thing, and
+// return the size of the image.
+//
+static uint32 encodeAndCheck(const Buffer *data, const Buffer *mask, I2CEncoding encoding) {
+	Buffer i2cBuffer, dstData, dstMask;
+	uint32 i, size;
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&i2cBuffer, 1024, 0x00));
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&dstData, 1024, 0x00));
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&dstMask, 1024, 0x00));
+	CHECK_EQUAL(I2C_SUCCESS, i2cInitialise(&i2cBuffer, VID, PID, DID, CONFIG_BYTE_400KHZ));
+	CHECK_EQUAL(I2C_SUCCESS, i2cWritePromRecordsWith(&i2cBuffer, data, mask, encoding));
+	CHECK_EQUAL(I2C_SUCCESS, i2cFinalise(&i2cBuffer));
+	CHECK_EQUAL(I2C_SUCCESS, i2cReadPromRecords(&dstData, &dstMask, &i2cBuffer));
+	for ( i = 0; i < mask->length; i++ ) {
+		if ( mask->data[i] ) {
+			CHECK(i < dstMask.length && dstMask.data[i]);
+			CHECK(i < dstData.length && dstData.data[i] == data->data[i]);
+		}
+	}
+	size = i2cBuffer.length;
+	bufDestroy(&dstMask);
+	bufDestroy(&dstData);
+	bufDestroy(&i2cBuffer);
+	return size;
+}
+
+static void makeImage(Buffer *data, Buffer *mask, uint32 length) {
+	uint32 i;
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(data, length, 0x00));
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(mask, length, 0x00));
+	CHECK_EQUAL(BUF_SUCCESS, bufAppendZeros(data, length, NULL));
+	CHECK_EQUAL(BUF_SUCCESS, bufAppendZeros(mask, length, NULL));
+	for ( i = 0; i < length; i++ ) {
+		data->data[i] = (uint8)(i * 13 + 1);
+	}
+}
+
+TEST(I2C_testOptimalBeatsGreedy) {
+	// A 1000-byte run, a three-byte gap, then 97 more bytes. The greedy rule keeps the gap (it's
+	// too short to split on) and then has to break at 1023 anyway; the optimal layout splits at
+	// the gap instead and saves the three padding bytes.
+	//
+	Buffer data, mask;
+	I2CImageStats stats;
+	makeImage(&data, &mask, 1100);
+	memset(mask.data, 0x01, 1000);
+	memset(mask.data + 1003, 0x01, 97);
+	CHECK_EQUAL(8UL + 4 + 1023 + 4 + 77 + 5, encodeAndCheck(&data, &mask, I2C_ENCODE_GREEDY));
+	CHECK_EQUAL(8UL + 4 + 1000 + 4 + 97 + 5, encodeAndCheck(&data, &mask, I2C_ENCODE_OPTIMAL));
+	bufDestroy(&mask);
+	bufDestroy(&data);
+
+	// An empty image is just the header and the final record
+	//
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&data, 16, 0x00));
+	CHECK_EQUAL(I2C_SUCCESS, i2cInitialise(&data, VID, PID, DID, CONFIG_BYTE_400KHZ));
+	CHECK_EQUAL(I2C_SUCCESS, i2cFinalise(&data));
+	CHECK_EQUAL(I2C_SUCCESS, i2cGetImageStats(&data, &stats));
+	CHECK_EQUAL(13UL, stats.numBytes);
+	CHECK_EQUAL(0UL, stats.numRecords);
+	CHECK_EQUAL(382UL, stats.bootMicros);  // 17 bytes at 22.5us each
+	bufDestroy(&data);
+}
+
+TEST(I2C_testOptimalNeverWorse) {
+	Buffer data, mask;
+	uint32 seed = 12345, i, trial, runLength;
+	uint8 value;
+	for ( trial = 0; trial < 200; trial++ ) {
+		// Alternate runs of masked and unmasked bytes, mostly short but sometimes long enough to
+		// need splitting
+		//
+		makeImage(&data, &mask, 4000);
+		value = 0x00;
+		for ( i = 0; i < 4000; i += runLength ) {
+			seed = seed * 1103515245 + 12345;
+			runLength = (seed >> 16) % ((seed & 0x100) ? 1500 : 8) + 1;
+			if ( i + runLength > 4000 ) {
+				runLength = 4000 - i;
+			}
+			memset(mask.data + i, value, runLength);
+			value ^= 0x01;
+		}
+		CHECK(encodeAndCheck(&data, &mask, I2C_ENCODE_OPTIMAL) <= encodeAndCheck(&data, &mask, I2C_ENCODE_GREEDY));
+		bufDestroy(&mask);
+		bufDestroy(&data);
+	}
+}
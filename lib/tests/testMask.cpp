@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <UnitTest++.h>
+#include "../mask.h"
+#include "naiveMask.h"
+
+TEST(Mask_testAgainstNaive) {
+	static uint8 mask[1000];
+	uint32 trial, from;
+	for ( trial = 0; trial < 100; trial++ ) {
+		const uint32 length = 1000 - trial;  // exercise every alignment of the tail
+		makeMask(mask, length, (trial % 3) ? 40 : 3, trial);
+		for ( from = 0; from <= length; from++ ) {
+			CHECK_EQUAL(naiveFindSet(mask, from, length), maskFindSet(mask, from, length));
+			CHECK_EQUAL(naiveFindClear(mask, from, length), maskFindClear(mask, from, length));
+		}
+	}
+}
@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <UnitTest++.h>
+#include "../fx2loader.h"
+#include "../i2c.h"
+#include "../sys.h"
+#include "types.h"
+
+// What a simulated FX2LP's memory starts off filled with
+//
+#define MOCK_FILL 0xEE
+
+// Make a data buffer with a recognisable pattern and a mask with the supplied [start, end) ranges
+// marked as used.
+//
+static void makeImage(Buffer *data, Buffer *mask, uint32 length, const uint32 *ranges, uint32 numRanges) {
+	uint32 i;
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(data, length, 0x00));
+	CHECK_EQUAL(BUF_SUCCESS, bufAppendZeros(data, length, NULL));
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(mask, length, 0x00));
+	CHECK_EQUAL(BUF_SUCCESS, bufAppendZeros(mask, length, NULL));
+	for ( i = 0; i < length; i++ ) {
+		data->data[i] = (uint8)(i ^ (i >> 8));
+	}
+	for ( i = 0; i < numRanges; i++ ) {
+		memset(mask->data + ranges[2*i], 0x01, ranges[2*i+1] - ranges[2*i]);
+	}
+}
+
+TEST(RAM_testSparse) {
+	// Code at the bottom, then a small table 256 bytes further on (close enough to merge), then
+	// xdata variables at 0x3C00 and descriptors at 0x3E00 (too far apart to merge)
+	//
+	const uint32 ranges[] = {0x0000, 0x0800, 0x0900, 0x0910, 0x3C00, 0x3C40, 0x3E00, 0x3E20};
+	FX2MockConfig config;
+	FX2MockStats mockStats;
+	uint8 *ram;
+	uint32 ramSize;
+	Buffer data, mask;
+	FX2Session *session;
+	FX2RamStats stats;
+	uint32 i;
+	fx2MockDefaultConfig(&config);
+	makeImage(&data, &mask, 0x3E20, ranges, 4);
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	ram = fx2MockMemory(session, FX2_MOCK_RAM, &ramSize);
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionWriteRAM(session, &data, &mask, &stats));
+	CHECK_EQUAL(0x0910UL + 0x40UL + 0x20UL, stats.numBytes);
+	CHECK_EQUAL(3UL, stats.numTransfers);
+	CHECK_EQUAL(0x3E20UL, stats.fullBytes);
+	CHECK_EQUAL(4UL, stats.fullTransfers);
+	fx2MockGetStats(session, &mockStats);
+	CHECK_EQUAL(stats.numBytes, mockStats.ramBytes);
+	CHECK_EQUAL(stats.numTransfers, mockStats.numRamWrites);
+	CHECK_EQUAL(false, mockStats.inReset);
+	CHECK_EQUAL(0UL, mockStats.numOrderingErrors);
+	for ( i = 0; i < 0x3E20; i++ ) {
+		if ( mask.data[i] ) {
+			CHECK_EQUAL(data.data[i], ram[i]);
+		} else if ( i >= 0x0910 ) {
+			CHECK_EQUAL(MOCK_FILL, ram[i]);
+		}
+	}
+	fx2CloseSession(session);
+	bufDestroy(&mask);
+	bufDestroy(&data);
+}
+
+TEST(RAM_testLongRangeIsSplit) {
+	const uint32 ranges[] = {0x0010, 0x2345};
+	FX2MockConfig config;
+	uint8 *ram;
+	uint32 ramSize;
+	Buffer data, mask;
+	FX2Session *session;
+	FX2RamStats stats;
+	fx2MockDefaultConfig(&config);
+	makeImage(&data, &mask, 0x3000, ranges, 1);
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	ram = fx2MockMemory(session, FX2_MOCK_RAM, &ramSize);
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionWriteRAM(session, &data, &mask, &stats));
+	CHECK_EQUAL(0x2335UL, stats.numBytes);
+	CHECK_EQUAL(3UL, stats.numTransfers);
+	CHECK_ARRAY_EQUAL(data.data + 0x0010, ram + 0x0010, 0x2335);
+	CHECK_EQUAL(MOCK_FILL, ram[0x000F]);
+	CHECK_EQUAL(MOCK_FILL, ram[0x2345]);
+	fx2CloseSession(session);
+	bufDestroy(&mask);
+	bufDestroy(&data);
+}
+
+TEST(RAM_testNoMask) {
+	FX2MockConfig config;
+	uint8 *ram;
+	uint32 ramSize;
+	Buffer data, mask;
+	FX2Session *session;
+	FX2RamStats stats;
+	fx2MockDefaultConfig(&config);
+	makeImage(&data, &mask, 0x2001, NULL, 0);
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	ram = fx2MockMemory(session, FX2_MOCK_RAM, &ramSize);
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionWriteRAM(session, &data, NULL, &stats));
+	CHECK_EQUAL(0x2001UL, stats.numBytes);
+	CHECK_EQUAL(3UL, stats.numTransfers);
+	CHECK_ARRAY_EQUAL(data.data, ram, 0x2001);
+	fx2CloseSession(session);
+	bufDestroy(&mask);
+	bufDestroy(&data);
+}
+
+TEST(RAM_testQueuedWriteAndReadBack) {
+	const uint32 ranges[] = {0x0000, 0x3800};
+	FX2MockConfig config;
+	FX2MockStats mockStats;
+	uint8 *ram;
+	uint32 ramSize;
+	Buffer data, mask, readBack;
+	FX2Session *session;
+	FX2RamStats stats;
+	fx2MockDefaultConfig(&config);
+	config.latencyMicros = 20000;
+	makeImage(&data, &mask, 0x3800, ranges, 1);
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&readBack, 1024, 0x00));
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	ram = fx2MockMemory(session, FX2_MOCK_RAM, &ramSize);
+	fx2SessionSetQueueDepth(session, 8);
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionWriteRAM(session, &data, &mask, &stats));
+	CHECK_EQUAL(4UL, stats.numTransfers);
+	fx2MockGetStats(session, &mockStats);
+	CHECK_EQUAL(4UL, mockStats.maxInFlight);        // all four chunks were queued at once...
+	CHECK_EQUAL(0UL, mockStats.numOrderingErrors);  // ...but CPUCS was only touched when idle
+	CHECK_EQUAL(false, mockStats.inReset);
+	CHECK_ARRAY_EQUAL(data.data, ram, 0x3800);
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionReadRAM(session, 0x0100, 0x3000, &readBack));
+	CHECK_EQUAL(0x3000UL, readBack.length);
+	CHECK_ARRAY_EQUAL(data.data + 0x0100, readBack.data, 0x3000);
+	fx2CloseSession(session);
+	bufDestroy(&readBack);
+	bufDestroy(&mask);
+	bufDestroy(&data);
+}
+
+TEST(RAM_testQueueDepthOne) {
+	const uint32 ranges[] = {0x0000, 0x3800};
+	FX2MockConfig config;
+	FX2MockStats mockStats;
+	uint8 *ram;
+	uint32 ramSize;
+	Buffer data, mask;
+	FX2Session *session;
+	fx2MockDefaultConfig(&config);
+	makeImage(&data, &mask, 0x3800, ranges, 1);
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	ram = fx2MockMemory(session, FX2_MOCK_RAM, &ramSize);
+	fx2SessionSetQueueDepth(session, 1);
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionWriteRAM(session, &data, &mask, NULL));
+	fx2MockGetStats(session, &mockStats);
+	CHECK_EQUAL(1UL, mockStats.maxInFlight);
+	CHECK_ARRAY_EQUAL(data.data, ram, 0x3800);
+	fx2CloseSession(session);
+	bufDestroy(&mask);
+	bufDestroy(&data);
+}
+
+// Time a full load of a 14KiB image at the supplied queue depth, with a simulated 5ms round trip.
+//
+static long long timeLoad(uint32 depth) {
+	const uint32 ranges[] = {0x0000, 0x3800};
+	FX2MockConfig config;
+	Buffer data, mask;
+	FX2Session *session;
+	long long elapsed;
+	fx2MockDefaultConfig(&config);
+	config.latencyMicros = 5000;
+	makeImage(&data, &mask, 0x3800, ranges, 1);
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	fx2SessionSetQueueDepth(session, depth);
+	elapsed = sysTimeMicros();
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionWriteRAM(session, &data, &mask, NULL));
+	elapsed = sysTimeMicros() - elapsed;
+	fx2CloseSession(session);
+	bufDestroy(&mask);
+	bufDestroy(&data);
+	return elapsed;
+}
+
+TEST(RAM_testQueueingHidesLatency) {
+	// Reset + 4 chunks + release is six round trips one after another, but only three when the
+	// chunks are all in flight together
+	//
+	const long long serial = timeLoad(1);
+	const long long queued = timeLoad(4);
+	CHECK(serial >= 30000);
+	CHECK(queued < serial - 10000);
+}
+
+TEST(RAM_testControlBatch) {
+	// Unrelated requests go out together, and each gets its own result
+	//
+	FX2MockConfig config;
+	FX2MockStats mockStats;
+	FX2Session *session;
+	FX2Request requests[8];
+	uint8 results[8][8];
+	uint32 i;
+	fx2MockDefaultConfig(&config);
+	config.latencyMicros = 5000;
+	for ( i = 0; i < 8; i++ ) {
+		requests[i].requestType = 0xC0;
+		requests[i].request = (i == 5) ? 0x99 : 0x80;
+		requests[i].value = (uint16)(10 * i);
+		requests[i].index = 2;
+		requests[i].data = results[i];
+		requests[i].length = 8;
+		requests[i].timeout = 5000;
+	}
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionControlBatch(session, requests, 8));
+	for ( i = 0; i < 8; i++ ) {
+		if ( i == 5 ) {
+			CHECK(requests[i].returnCode < 0);
+		} else {
+			CHECK_EQUAL(8, requests[i].returnCode);
+			CHECK_EQUAL(10 * i + 2, results[i][0]);
+		}
+	}
+	fx2MockGetStats(session, &mockStats);
+	CHECK_EQUAL((uint32)FX2_DEFAULT_QUEUE_DEPTH, mockStats.maxInFlight);
+	fx2CloseSession(session);
+}
+
+TEST(RAM_testStreamRecords) {
+	// Encode a sparse image as C2 records, then send it straight from the records
+	//
+	const uint32 ranges[] = {0x0000, 0x0C00, 0x1000, 0x1010, 0x3C00, 0x3C40};
+	FX2MockConfig config;
+	FX2MockStats mockStats;
+	uint8 *ram;
+	uint32 ramSize, i;
+	Buffer data, mask, i2cBuffer;
+	FX2Session *session;
+	FX2RamStats stats;
+	const FX2Error *error;
+	fx2MockDefaultConfig(&config);
+	makeImage(&data, &mask, 0x3C40, ranges, 3);
+	CHECK_EQUAL(BUF_SUCCESS, bufInitialise(&i2cBuffer, 1024, 0x00));
+	CHECK_EQUAL(I2C_SUCCESS, i2cInitialise(&i2cBuffer, 0x0000, 0x0000, 0x0000, CONFIG_BYTE_400KHZ));
+	CHECK_EQUAL(I2C_SUCCESS, i2cWritePromRecords(&i2cBuffer, &data, &mask));
+	CHECK_EQUAL(I2C_SUCCESS, i2cFinalise(&i2cBuffer));
+	CHECK_EQUAL(FX2_SUCCESS, fx2OpenMockSession(&config, &session));
+	fx2SessionSetQueueDepth(session, 3);
+	ram = fx2MockMemory(session, FX2_MOCK_RAM, &ramSize);
+	CHECK_EQUAL(FX2_SUCCESS, fx2SessionWriteRAMRecords(session, &i2cBuffer, &stats));
+	CHECK_EQUAL(0x0C00UL + 0x10UL + 0x40UL, stats.numBytes);
+	CHECK_EQUAL(6UL, stats.numTransfers);  // four records for the first range, one for each other
+	CHECK_EQUAL(0x3C40UL, stats.fullBytes);
+	fx2MockGetStats(session, &mockStats);
+	CHECK_EQUAL(stats.numTransfers, mockStats.numRamWrites);
+	CHECK(mockStats.maxInFlight <= 3UL);
+	CHECK_EQUAL(0UL, mockStats.numOrderingErrors);
+	CHECK_EQUAL(false, mockStats.inReset);
+	for ( i = 0; i < 0x3C40; i++ ) {
+		CHECK_EQUAL(mask.data[i] ? data.data[i] : MOCK_FILL, ram[i]);
+	}
+
+	// A record running off the end of the image is caught, and the CPU is left in reset
+	//
+	i2cBuffer.length -= 5 + 0x20;
+	CHECK_EQUAL(FX2_BUFERR, fx2SessionWriteRAMRecords(session, &i2cBuffer, NULL));
+	error = fx2SessionError(session);
+	CHECK_EQUAL(FX2_PHASE_RAM_WRITE, error->phase);
+	fx2MockGetStats(session, &mockStats);
+	CHECK_EQUAL(true, mockStats.inReset);
+	fx2CloseSession(session);
+	bufDestroy(&i2cBuffer);
+	bufDestroy(&mask);
+	bufDestroy(&data);
+}
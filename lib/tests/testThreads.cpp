@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2009-2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <UnitTest++.h>
+#include "../i2c.h"
+#include "../fx2loader.h"
+#include "../sys.h"
+#include "types.h"
+
+#define NUM_DEVICES 32
+#define VID 0x1443
+#define NUM_ITERATIONS 50
+
+// What one worker thread saw; checked by the main thread afterwards because the CHECK macros
+// aren't thread-safe.
+//
+struct Worker {
+	uint16 pid;
+	bool shouldFail;
+	long failAddress;
+	int failCode;
+	int numFailures;
+	char firstFailure[256];
+};
+
+static void fail(Worker *worker, const char *what) {
+	if ( !worker->numFailures++ ) {
+		sprintf(worker->firstFailure, "Device %d: %s", worker->pid, what);
+	}
+}
+
+static void destroy(Buffer *buf) {
+	if ( buf->data ) {
+		bufDestroy(buf);
+		buf->data = NULL;
+	}
+}
+
+static void workerThread(void *arg) {
+	Worker *const worker = (Worker *)arg;
+	const uint32 length = 8192 + 37 * worker->pid;
+	FX2MockConfig config;
+	FX2Session *session;
+	uint8 *ram;
+	uint32 ramSize;
+	Buffer data, mask, i2cBuffer, readBack, decData, decMask;
+	char expectedCode[32];
+	uint32 i, j;
+	data.data = mask.data = i2cBuffer.data = readBack.data = decData.data = decMask.data = NULL;
+	fx2MockDefaultConfig(&config);
+	config.latencyMicros = 0;
+	config.bytesPerSecond = 0;
+	config.writeCycleMicros = 0;
+	config.failAddress = worker->shouldFail ? worker->failAddress : -1;
+	config.failCode = worker->failCode;
+	if ( fx2OpenMockSession(&config, &session) ) {
+		fail(worker, "open failed");
+		return;
+	}
+	ram = fx2MockMemory(session, FX2_MOCK_RAM, &ramSize);
+	if ( bufInitialise(&data, length, 0x00) || bufAppendZeros(&data, length, NULL) ||
+	     bufInitialise(&mask, length, 0x00) || bufAppendConst(&mask, length, 0x01, NULL) )
+	{
+		fail(worker, "buffer allocation failed");
+		goto cleanup;
+	}
+	sprintf(expectedCode, "returnCode %d:", worker->failCode);
+	for ( i = 0; i < NUM_ITERATIONS; i++ ) {
+		for ( j = 0; j < length; j++ ) {
+			data.data[j] = (uint8)(j * (worker->pid + 1) + i);
+		}
+
+		// RAM write: check for success, or for the right structured error and message
+		//
+		if ( worker->shouldFail ) {
+			const FX2Error *error;
+			if ( fx2SessionWriteRAM(session, &data, &mask, NULL) != FX2_USBERR ) {
+				fail(worker, "RAM write should have failed");
+			}
+			sysYield();  // give the other threads a chance to trample on the message
+			error = fx2SessionError(session);
+			if ( error->status != FX2_USBERR || error->phase != FX2_PHASE_RAM_WRITE ||
+			     error->usbCode != worker->failCode ||
+			     error->address != ((uint32)worker->failAddress & 0xF000UL) )
+			{
+				fail(worker, "wrong session error");
+			}
+			if ( !strstr(fx2StrError(), expectedCode) || !strstr(error->message, expectedCode) ) {
+				fail(worker, "wrong error message");
+			}
+		} else {
+			if ( fx2SessionWriteRAM(session, &data, &mask, NULL) != FX2_SUCCESS ) {
+				fail(worker, "RAM write failed");
+			} else if ( memcmp(ram, data.data, length) ) {
+				fail(worker, "RAM contents wrong");
+			}
+
+			// Raise a different error on this thread, to race with the failing devices' messages
+			//
+			if ( i2cFinalise(&mask) != I2C_NOT_INITIALISED ) {
+				fail(worker, "I2C finalise of a non-I2C buffer should have failed");
+			}
+			sysYield();
+			if ( !strstr(fx2StrError(), "not initialised") ) {
+				fail(worker, "wrong error message");
+			}
+		}
+		sysYield();
+
+		// Encode to C2 records, write to EEPROM, read back and decode
+		//
+		destroy(&i2cBuffer);
+		destroy(&readBack);
+		destroy(&decData);
+		destroy(&decMask);
+		if ( bufInitialise(&i2cBuffer, 1024, 0x00) || bufInitialise(&readBack, 1024, 0x00) ||
+		     bufInitialise(&decData, 1024, 0x00) || bufInitialise(&decMask, 1024, 0x00) )
+		{
+			fail(worker, "buffer allocation failed");
+			goto cleanup;
+		}
+		if ( i2cInitialise(&i2cBuffer, VID, worker->pid, 0x0000, CONFIG_BYTE_400KHZ) ||
+		     i2cWritePromRecords(&i2cBuffer, &data, &mask) || i2cFinalise(&i2cBuffer) )
+		{
+			fail(worker, "I2C encode failed");
+			continue;
+		}
+		if ( fx2SessionWriteEEPROM(session, &i2cBuffer) ) {
+			fail(worker, "EEPROM write failed");
+			continue;
+		}
+		if ( fx2SessionReadEEPROM(session, i2cBuffer.length, &readBack) ) {
+			fail(worker, "EEPROM read failed");
+			continue;
+		}
+		if ( memcmp(readBack.data, i2cBuffer.data, i2cBuffer.length) ) {
+			fail(worker, "EEPROM contents wrong");
+			continue;
+		}
+		if ( i2cReadPromRecords(&decData, &decMask, &readBack) ) {
+			fail(worker, "I2C decode failed");
+			continue;
+		}
+		if ( decData.length != length || memcmp(decData.data, data.data, length) ) {
+			fail(worker, "I2C round trip wrong");
+		}
+		sysYield();
+	}
+cleanup:
+	destroy(&decMask);
+	destroy(&decData);
+	destroy(&readBack);
+	destroy(&i2cBuffer);
+	destroy(&mask);
+	destroy(&data);
+	fx2CloseSession(session);
+}
+
+TEST(Threads_testConcurrentDevices) {
+	Worker workers[NUM_DEVICES];
+	SysThread *threads[NUM_DEVICES];
+	uint16 i;
+	for ( i = 0; i < NUM_DEVICES; i++ ) {
+		workers[i].pid = i;
+		workers[i].shouldFail = (i & 1) ? true : false;
+		workers[i].failAddress = 0x1000 * (1 + (i / 2) % 2) + i;
+		workers[i].failCode = -100 - i;
+		workers[i].numFailures = 0;
+		workers[i].firstFailure[0] = '\0';
+	}
+	for ( i = 0; i < NUM_DEVICES; i++ ) {
+		CHECK_EQUAL(0, sysThreadCreate(&threads[i], workerThread, &workers[i]));
+	}
+	for ( i = 0; i < NUM_DEVICES; i++ ) {
+		sysThreadJoin(threads[i]);
+	}
+	for ( i = 0; i < NUM_DEVICES; i++ ) {
+		if ( workers[i].numFailures ) {
+			fprintf(stderr, "%s\n", workers[i].firstFailure);
+		}
+		CHECK_EQUAL(0, workers[i].numFailures);
+	}
+}
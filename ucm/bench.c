@@ -0,0 +1,99 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include "bench.h"
+#include "usbwrap.h"
+#include "sys.h"
+
+// One round trip through the firmware's calculator command (0x80), checking the answers so a
+// misbehaving hub can't pass by returning garbage quickly.
+//
+static BenchStatus roundTrip(FX2Session *session, uint16 x, uint16 y) {
+	uint8 result[8];
+	const uint16 expected[] = {
+		(uint16)(x + y), (uint16)(x - y), (uint16)(x * y), (uint16)(x / y)
+	};
+	uint32 i;
+	const int returnCode = fx2SessionControl(
+		session, (USB_ENDPOINT_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE),
+		0x80, x, y, result, 8, 5000
+	);
+	if ( returnCode != 8 ) {
+		fprintf(
+			stderr, "Round trip failed with returnCode %d: %s\n",
+			returnCode, fx2SessionStrUsbError(session, returnCode));
+		return BENCH_USBERR;
+	}
+	for ( i = 0; i < 4; i++ ) {
+		if ( (uint16)(result[2*i] | (result[2*i+1] << 8)) != expected[i] ) {
+			fprintf(stderr, "Round trip with wValue=0x%04X, wIndex=0x%04X got a wrong answer\n", x, y);
+			return BENCH_BAD_RESULT;
+		}
+	}
+	return BENCH_SUCCESS;
+}
+
+// Time numRoundTrips control transfers, one after another, and report the latency distribution
+// and the transaction rate. The operands vary from one round trip to the next, so every answer
+// is different and gets checked.
+//
+BenchStatus benchLatency(FX2Session *session, uint32 numRoundTrips, FILE *out) {
+	BenchStatus status = BENCH_SUCCESS;
+	uint32 *latencies = NULL;
+	uint32 i;
+	long long start, end, before, after, total = 0;
+	if ( !numRoundTrips ) {
+		numRoundTrips = 1;
+	}
+	latencies = (uint32 *)malloc(numRoundTrips * sizeof(uint32));
+	if ( !latencies ) {
+		fprintf(stderr, "Cannot allocate %lu latencies\n", numRoundTrips);
+		return BENCH_NO_MEM;
+	}
+	for ( i = 0; i < BENCH_WARMUP; i++ ) {
+		status = roundTrip(session, (uint16)i, 1);
+		if ( status ) {
+			goto cleanup;
+		}
+	}
+	start = sysTimeMicros();
+	before = start;
+	for ( i = 0; i < numRoundTrips; i++ ) {
+		status = roundTrip(session, (uint16)(i * 7), (uint16)((i % 255) + 1));
+		if ( status ) {
+			goto cleanup;
+		}
+		after = sysTimeMicros();
+		latencies[i] = (uint32)(after - before);
+		total += after - before;
+		before = after;
+	}
+	end = before;
+	sysSortMicros(latencies, numRoundTrips);
+	fprintf(
+		out, "%lu round trips in %.3f s: %.0f transactions/s\n",
+		numRoundTrips, (double)(end - start) / 1000000.0,
+		(end > start) ? (double)numRoundTrips * 1000000.0 / (double)(end - start) : 0.0);
+	fprintf(
+		out, "Latency (us): min %lu, mean %.1f, p50 %lu, p99 %lu, p999 %lu, max %lu\n",
+		latencies[0], (double)total / (double)numRoundTrips,
+		sysPercentile(latencies, numRoundTrips, 0.50), sysPercentile(latencies, numRoundTrips, 0.99),
+		sysPercentile(latencies, numRoundTrips, 0.999), latencies[numRoundTrips - 1]);
+cleanup:
+	free(latencies);
+	return status;
+}
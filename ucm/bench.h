@@ -0,0 +1,45 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include "types.h"
+#include "fx2loader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// Round trips sent before the timed ones, to get the host controller and caches warmed up
+	//
+	#define BENCH_WARMUP 16UL
+
+	typedef enum {
+		BENCH_SUCCESS = 0,
+		BENCH_NO_MEM,
+		BENCH_USBERR,
+		BENCH_BAD_RESULT
+	} BenchStatus;
+
+	BenchStatus benchLatency(FX2Session *session, uint32 numRoundTrips, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
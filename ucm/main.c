@@ -14,9 +14,15 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <stdlib.h>
+#include <string.h>
 #include "usbwrap.h"
+#include "fx2loader.h"
 #include "argtable2.h"
 #include "arg_uint.h"
+#include "sys.h"
+#include "bench.h"
+#include "monitor.h"
 #ifdef WIN32
 #include <fcntl.h>
 #include <io.h>
@@ -25,32 +31,369 @@
 #define VID 0x04b4
 #define PID 0x8613
 #define BUFFER_SIZE 4096
+#define PIPELINE_DEPTH FX2_DEFAULT_QUEUE_DEPTH
+#define LINE_SIZE (16 + 3*BUFFER_SIZE + FILENAME_MAX)
+
+// One request from a script, and where its data comes from or goes to
+//
+typedef struct {
+	uint32 lineNumber;
+	uint32 batch;         // consecutive steps in the same batch are sent together
+	char *outName;        // file for IN data, or NULL for stdout
+} Step;
+
+typedef struct {
+	FX2Request *requests;
+	Step *steps;
+	uint32 numSteps;
+	uint32 capacity;
+} Script;
+
+static void scriptDestroy(Script *script) {
+	uint32 i;
+	for ( i = 0; i < script->numSteps; i++ ) {
+		free(script->requests[i].data);
+		free(script->steps[i].outName);
+	}
+	free(script->requests);
+	free(script->steps);
+}
+
+static int parseNumber(const char *token, uint32 maxValue, uint32 *value) {
+	char *end;
+	if ( !token ) {
+		return -1;
+	}
+	*value = strtoul(token, &end, 0);
+	return (*end || *value > maxValue) ? -1 : 0;
+}
+
+// Parse a script, one request per line:
+//
+//   in  <bRequest> <wValue> <wIndex> <wLength> [<outFile>]
+//   out <bRequest> <wValue> <wIndex> <wLength> [<inFile> | = <byte> <byte>...]
+//   parallel
+//   end
+//
+// Each request is a batch of its own, except that the requests between "parallel" and "end" are
+// all one batch. Blank lines and lines starting with # are ignored. Returns zero, or prints what's
+// wrong and returns nonzero.
+//
+static int parseScript(FILE *file, const char *name, Script *script) {
+	char line[LINE_SIZE];
+	char *token;
+	uint32 lineNumber = 0, parallelLine = 0, batch = 0, bRequest, wValue, wIndex, wLength, i;
+	bool isOut;
+	FX2Request *request;
+	Step *step;
+	while ( fgets(line, LINE_SIZE, file) ) {
+		lineNumber++;
+		token = strtok(line, " \t\r\n");
+		if ( !token || token[0] == '#' ) {
+			continue;
+		}
+		if ( !strcmp(token, "parallel") ) {
+			if ( parallelLine ) {
+				fprintf(stderr, "%s:%lu: parallel blocks don't nest\n", name, lineNumber);
+				return -1;
+			}
+			parallelLine = lineNumber;
+			batch++;
+			continue;
+		}
+		if ( !strcmp(token, "end") ) {
+			if ( !parallelLine ) {
+				fprintf(stderr, "%s:%lu: end without parallel\n", name, lineNumber);
+				return -1;
+			}
+			parallelLine = 0;
+			continue;
+		}
+		if ( !strcmp(token, "in") ) {
+			isOut = false;
+		} else if ( !strcmp(token, "out") ) {
+			isOut = true;
+		} else {
+			fprintf(stderr, "%s:%lu: expected in, out, parallel or end\n", name, lineNumber);
+			return -1;
+		}
+		if ( !parallelLine ) {
+			batch++;
+		}
+		if ( parseNumber(strtok(NULL, " \t\r\n"), 0xFF, &bRequest) ||
+		     parseNumber(strtok(NULL, " \t\r\n"), 0xFFFF, &wValue) ||
+		     parseNumber(strtok(NULL, " \t\r\n"), 0xFFFF, &wIndex) ||
+		     parseNumber(strtok(NULL, " \t\r\n"), BUFFER_SIZE, &wLength) )
+		{
+			fprintf(stderr, "%s:%lu: expected <bRequest> <wValue> <wIndex> <wLength> (at most %d bytes)\n", name, lineNumber, BUFFER_SIZE);
+			return -1;
+		}
+		if ( script->numSteps == script->capacity ) {
+			const uint32 newCapacity = script->capacity ? 2 * script->capacity : 64;
+			FX2Request *const newRequests = (FX2Request *)realloc(script->requests, newCapacity * sizeof(FX2Request));
+			Step *newSteps;
+			if ( newRequests ) {
+				script->requests = newRequests;
+			}
+			newSteps = (Step *)realloc(script->steps, newCapacity * sizeof(Step));
+			if ( newSteps ) {
+				script->steps = newSteps;
+			}
+			if ( !newRequests || !newSteps ) {
+				fprintf(stderr, "Cannot allocate script\n");
+				return -1;
+			}
+			script->capacity = newCapacity;
+		}
+		request = script->requests + script->numSteps;
+		step = script->steps + script->numSteps;
+		request->requestType = (uint8)((isOut?USB_ENDPOINT_OUT:USB_ENDPOINT_IN) | USB_TYPE_VENDOR | USB_RECIP_DEVICE);
+		request->request = (uint8)bRequest;
+		request->value = (uint16)wValue;
+		request->index = (uint16)wIndex;
+		request->length = (uint16)wLength;
+		request->timeout = 5000;
+		request->returnCode = 0;
+		request->data = (uint8 *)malloc(wLength ? wLength : 1);
+		step->lineNumber = lineNumber;
+		step->batch = batch;
+		step->outName = NULL;
+		if ( !request->data ) {
+			fprintf(stderr, "Cannot allocate script\n");
+			return -1;
+		}
+		script->numSteps++;
+		token = strtok(NULL, " \t\r\n");
+		if ( !isOut ) {
+			if ( token ) {
+				step->outName = (char *)malloc(strlen(token) + 1);
+				if ( !step->outName ) {
+					fprintf(stderr, "Cannot allocate script\n");
+					return -1;
+				}
+				strcpy(step->outName, token);
+			}
+		} else if ( token && !strcmp(token, "=") ) {
+			// Inline data
+			//
+			for ( i = 0; i < wLength; i++ ) {
+				uint32 byte;
+				if ( parseNumber(strtok(NULL, " \t\r\n"), 0xFF, &byte) ) {
+					fprintf(stderr, "%s:%lu: expected %lu data bytes\n", name, lineNumber, wLength);
+					return -1;
+				}
+				request->data[i] = (uint8)byte;
+			}
+		} else if ( token ) {
+			// Data from a file
+			//
+			size_t bytesRead;
+			FILE *inFile = fopen(token, "rb");
+			if ( inFile == NULL ) {
+				fprintf(stderr, "%s:%lu: cannot open file %s\n", name, lineNumber, token);
+				return -1;
+			}
+			bytesRead = fread(request->data, 1, wLength, inFile);
+			fclose(inFile);
+			if ( bytesRead != wLength ) {
+				fprintf(stderr, "%s:%lu: expected 0x%04lX bytes from \"%s\" but got 0x%04lX\n", name, lineNumber, wLength, token, (uint32)bytesRead);
+				return -1;
+			}
+		} else if ( wLength ) {
+			fprintf(stderr, "%s:%lu: an out request with data needs a file or = <bytes>\n", name, lineNumber);
+			return -1;
+		}
+	}
+	if ( parallelLine ) {
+		fprintf(stderr, "%s:%lu: parallel without end\n", name, parallelLine);
+		return -1;
+	}
+	return 0;
+}
+
+// Run a parsed script on an open session, one batch at a time. A batch of several requests (a
+// parallel block) is sent several at a time, and its results are written out in script order once
+// the whole batch is done. Stops at the end of the first batch with a failure.
+//
+static uint32 runScript(FX2Session *session, const char *name, Script *script) {
+	uint32 start = 0, end, i;
+	uint32 exitCode = 0;
+	FILE *outFile;
+	#ifdef WIN32
+		_setmode(_fileno(stdout), O_BINARY);
+	#endif
+	while ( start < script->numSteps && !exitCode ) {
+		end = start + 1;
+		while ( end < script->numSteps && script->steps[end].batch == script->steps[start].batch ) {
+			end++;
+		}
+		if ( fx2SessionControlBatch(session, script->requests + start, end - start) ) {
+			fprintf(stderr, "%s", fx2StrError());
+			return 10;
+		}
+		for ( i = start; i < end; i++ ) {
+			const FX2Request *const request = script->requests + i;
+			const Step *const step = script->steps + i;
+			if ( request->requestType & USB_ENDPOINT_IN ) {
+				if ( request->returnCode < 0 ) {
+					fprintf(
+						stderr, "%s:%lu: usb_control_msg() failed returnCode %d: %s\n",
+						name, step->lineNumber, request->returnCode, fx2SessionStrUsbError(session, request->returnCode));
+					exitCode = 10;
+				} else if ( step->outName ) {
+					outFile = fopen(step->outName, "wb");
+					if ( outFile == NULL ) {
+						fprintf(stderr, "%s:%lu: cannot open file %s\n", name, step->lineNumber, step->outName);
+						exitCode = 6;
+						continue;
+					}
+					fwrite(request->data, 1, request->returnCode, outFile);
+					fclose(outFile);
+				} else {
+					fwrite(request->data, 1, request->returnCode, stdout);
+				}
+			} else if ( request->returnCode != request->length ) {
+				fprintf(
+					stderr, "%s:%lu: expected to write 0x%04X bytes but actually wrote 0x%04X: %s\n",
+					name, step->lineNumber, request->length, request->returnCode, fx2SessionStrUsbError(session, request->returnCode));
+				exitCode = 10;
+			}
+		}
+		start = end;
+	}
+	return exitCode;
+}
+
+// Which of wValue and wIndex holds the address, for transfers split into chunks. With both, wValue
+// is the low word and wIndex the high word of a 32-bit address.
+//
+typedef enum {
+	ADVANCE_VALUE,
+	ADVANCE_INDEX,
+	ADVANCE_BOTH,
+	ADVANCE_NONE
+} Advance;
+
+// Move length bytes between the file and the device, as control transfers of at most chunkSize
+// bytes, advancing the address by the size of each one. A few chunks at a time are sent as one
+// batch, so only PIPELINE_DEPTH chunks are ever in memory. If the address doesn't advance, the
+// chunks go one at a time, since their order then matters. A short IN transfer means the device
+// has no more to give, so the read stops there.
+//
+static uint32 runChunked(
+	FX2Session *session, bool isOut, uint8 bRequest, uint16 wValue, uint16 wIndex,
+	uint32 length, uint32 chunkSize, Advance advance, FILE *file, const char *fileName)
+{
+	static uint8 buffers[PIPELINE_DEPTH][BUFFER_SIZE];
+	FX2Request requests[PIPELINE_DEPTH];
+	const uint32 depth = (advance == ADVANCE_NONE) ? 1 : PIPELINE_DEPTH;
+	const uint32 base = ((uint32)wIndex << 16) | wValue;
+	uint32 offset = 0, numRequests, i;
+	bool first = true;
+	while ( offset < length || first ) {
+		// Fill the next batch. A zero-length transfer is still one transfer.
+		//
+		for ( numRequests = 0; numRequests < depth && (offset < length || first); numRequests++ ) {
+			FX2Request *const request = requests + numRequests;
+			const uint32 thisChunk = (length - offset > chunkSize) ? chunkSize : length - offset;
+			request->requestType = (uint8)((isOut?USB_ENDPOINT_OUT:USB_ENDPOINT_IN) | USB_TYPE_VENDOR | USB_RECIP_DEVICE);
+			request->request = bRequest;
+			request->value = wValue;
+			request->index = wIndex;
+			if ( advance == ADVANCE_VALUE ) {
+				request->value = (uint16)(wValue + offset);
+			} else if ( advance == ADVANCE_INDEX ) {
+				request->index = (uint16)(wIndex + offset);
+			} else if ( advance == ADVANCE_BOTH ) {
+				request->value = (uint16)(base + offset);
+				request->index = (uint16)((base + offset) >> 16);
+			}
+			request->data = buffers[numRequests];
+			request->length = (uint16)thisChunk;
+			request->timeout = 5000;
+			if ( isOut && fread(request->data, 1, thisChunk, file) != thisChunk ) {
+				fprintf(stderr, "Whilst reading from \"%s\", ran out of data at offset 0x%lX\n", fileName, offset);
+				return 7;
+			}
+			offset += thisChunk;
+			first = false;
+		}
+		if ( fx2SessionControlBatch(session, requests, numRequests) ) {
+			fprintf(stderr, "%s", fx2StrError());
+			return 10;
+		}
+
+		// Check the results in order, writing out any IN data
+		//
+		for ( i = 0; i < numRequests; i++ ) {
+			const FX2Request *const request = requests + i;
+			if ( isOut ) {
+				if ( request->returnCode != request->length ) {
+					fprintf(
+						stderr, "Expected to write 0x%04X bytes at 0x%04X:0x%04X but actually wrote 0x%04X: %s\n",
+						request->length, request->index, request->value, request->returnCode,
+						fx2SessionStrUsbError(session, request->returnCode));
+					return 10;
+				}
+			} else {
+				if ( request->returnCode < 0 ) {
+					fprintf(
+						stderr, "usb_control_msg() failed at 0x%04X:0x%04X returnCode %d: %s\n",
+						request->index, request->value, request->returnCode, fx2SessionStrUsbError(session, request->returnCode));
+					return 10;
+				}
+				if ( request->returnCode > 0 &&
+				     fwrite(request->data, 1, (size_t)request->returnCode, file) != (size_t)request->returnCode )
+				{
+					fprintf(stderr, "Cannot write to \"%s\"\n", fileName);
+					return 6;
+				}
+				if ( request->returnCode < request->length ) {
+					return 0;
+				}
+			}
+		}
+	}
+	return 0;
+}
 
 int main(int argc, char* argv[]) {
 
 	struct arg_uint *vidOpt = arg_uint0("v", "vid", "<vendorID>", "  vendor ID");
 	struct arg_uint *pidOpt = arg_uint0("p", "pid", "<productID>", " product ID");
+	struct arg_str *devOpt  = arg_str0("d", "device", "<bus:addr>", "  device location, or \"mock\" for a simulated device (overrides VID/PID)");
 	struct arg_lit *inOpt  = arg_lit0("i", "in", "            this is an IN message (device->host)");
 	struct arg_lit *outOpt  = arg_lit0("o", "out", "            this is an OUT message (host->device)");
 	struct arg_file *fileOpt = arg_file0("f", "file", "<fileName>", " file to read from or write to (default stdin/stdout)");
+	struct arg_file *scriptOpt = arg_file0("s", "script", "<fileName>", " run the requests in a script file (- for stdin) on one open device");
 	struct arg_lit *helpOpt  = arg_lit0("h", "help", "            print this help and exit\n");
-	struct arg_uint *reqOpt = arg_uint1(NULL, NULL, "<bRequest>", "            the bRequest byte");
-	struct arg_uint *valOpt = arg_uint1(NULL, NULL, "<wValue>", "            the wValue word");
-	struct arg_uint *idxOpt = arg_uint1(NULL, NULL, "<wIndex>", "            the wIndex word");
-	struct arg_uint *lenOpt = arg_uint1(NULL, NULL, "<wLength>", "            the wLength word");
+	struct arg_uint *reqOpt = arg_uint0(NULL, NULL, "<bRequest>", "            the bRequest byte");
+	struct arg_uint *valOpt = arg_uint0(NULL, NULL, "<wValue>", "            the wValue word");
+	struct arg_uint *idxOpt = arg_uint0(NULL, NULL, "<wIndex>", "            the wIndex word");
+	struct arg_uint *benchOpt = arg_uint0("b", "bench", "<count>", "    time this many round trips of the calculator command (0x80) and report the latency");
+	struct arg_uint *monOpt = arg_uint0("m", "monitor", "<hz>", "      repeat the IN request at this rate, writing a timestamped record for each response");
+	struct arg_uint *countOpt = arg_uint0("n", "count", "<samples>", "  with --monitor, stop after this many (default until interrupted)");
+	struct arg_str *fmtOpt = arg_str0(NULL, "format", "<csv|bin>", "   with --monitor, the record format (default csv)");
+	struct arg_uint *cpuOpt = arg_uint0(NULL, "cpu", "<cpu>", "          with --bench or --monitor, pin to this CPU");
+	struct arg_lit *fifoOpt = arg_lit0(NULL, "fifo", "             with --bench or --monitor, run at realtime priority (SCHED_FIFO; usually needs root)");
+	struct arg_uint *chunkOpt = arg_uint0("c", "chunk", "<bytes>", "    most bytes per control transfer (default and maximum 4096)");
+	struct arg_str *advOpt = arg_str0(NULL, "advance", "<value|index|both|none>", " which field holds the address to advance for each chunk (default value)");
+	struct arg_uint *lenOpt = arg_uint0(NULL, NULL, "<wLength>", "            the number of bytes (split into chunks if need be)");
 	struct arg_end *endOpt   = arg_end(20);
-	void* argTable[] = {vidOpt, pidOpt, inOpt, outOpt, fileOpt, helpOpt, reqOpt, valOpt, idxOpt, lenOpt, endOpt};
+	void* argTable[] = {vidOpt, pidOpt, devOpt, inOpt, outOpt, fileOpt, scriptOpt, benchOpt, monOpt, countOpt, fmtOpt, cpuOpt, fifoOpt, chunkOpt, advOpt, helpOpt, reqOpt, valOpt, idxOpt, lenOpt, endOpt};
 	const char *progName = "ucm";
 	uint32 exitCode = 0;
 	int numErrors;
 
 	uint8 bRequest;
-	uint16 wValue, wIndex, wLength, vid, pid;
-	char buffer[BUFFER_SIZE];
+	uint16 wValue, wIndex, vid, pid;
+	uint32 length, chunkSize;
+	Advance advance = ADVANCE_VALUE;
 	bool isOut = false;
-	FILE *outFile = NULL;
-	UsbDeviceHandle *deviceHandle;
-	int returnCode;
+	FILE *dataFile = NULL;
+	FX2Session *session;
+	FX2Status fStatus;
+	Script script = {0};
 
 	if ( arg_nullcheck(argTable) != 0 ) {
 		printf("%s: insufficient memory\n", progName);
@@ -76,6 +419,95 @@ int main(int argc, char* argv[]) {
 		goto cleanupArgtable;
 	}
 
+	if ( (cpuOpt->count || fifoOpt->count) && !benchOpt->count && !monOpt->count ) {
+		fprintf(stderr, "The --cpu and --fifo options only make sense with --bench or --monitor\n");
+		exitCode = 11;
+		goto cleanupArgtable;
+	}
+	if ( (countOpt->count || fmtOpt->count) && !monOpt->count ) {
+		fprintf(stderr, "The --count and --format options only make sense with --monitor\n");
+		exitCode = 11;
+		goto cleanupArgtable;
+	}
+	if ( benchOpt->count ) {
+		// Benchmark mode: the same code runs against real hardware or the mock, so results from
+		// a hub or host controller under test can be compared with the simulated timing
+		//
+		if ( scriptOpt->count || inOpt->count || outOpt->count || fileOpt->count || reqOpt->count ) {
+			fprintf(stderr, "A benchmark cannot be combined with a script or a request\n");
+			exitCode = 11;
+			goto cleanupArgtable;
+		}
+		if ( cpuOpt->count && sysPinToCpu((int)cpuOpt->ival[0]) ) {
+			fprintf(stderr, "Warning: cannot pin to CPU %d\n", (int)cpuOpt->ival[0]);
+		}
+		if ( fifoOpt->count && sysSetRealtime() ) {
+			fprintf(stderr, "Warning: cannot switch to realtime priority\n");
+		}
+		vid = vidOpt->count ? (uint16)vidOpt->ival[0] : VID;
+		pid = pidOpt->count ? (uint16)pidOpt->ival[0] : PID;
+		fStatus = devOpt->count ?
+			fx2OpenSessionPath(devOpt->sval[0], &session) :
+			fx2OpenSession(vid, pid, &session);
+		if ( fStatus ) {
+			fprintf(stderr, "%s", fx2StrError());
+			exitCode = 9;
+			goto cleanupArgtable;
+		}
+		if ( benchLatency(session, benchOpt->ival[0], stdout) ) {
+			exitCode = 13;
+		}
+		fx2CloseSession(session);
+		goto cleanupArgtable;
+	}
+
+	if ( scriptOpt->count ) {
+		// Script mode: parse the whole script first, so a mistake in it is found before anything
+		// is sent, then open the device once for all of it
+		//
+		const char *const scriptName = scriptOpt->filename[0];
+		const bool isStdin = !strcmp(scriptName, "-");
+		FILE *scriptFile;
+		if ( inOpt->count || outOpt->count || fileOpt->count || reqOpt->count ) {
+			fprintf(stderr, "A script cannot be combined with -i, -o, -f or a request on the command line\n");
+			exitCode = 11;
+			goto cleanupArgtable;
+		}
+		scriptFile = isStdin ? stdin : fopen(scriptName, "r");
+		if ( scriptFile == NULL ) {
+			fprintf(stderr, "Cannot open file %s\n", scriptName);
+			exitCode = 6;
+			goto cleanupArgtable;
+		}
+		numErrors = parseScript(scriptFile, isStdin ? "<stdin>" : scriptName, &script);
+		if ( !isStdin ) {
+			fclose(scriptFile);
+		}
+		if ( numErrors ) {
+			exitCode = 12;
+			goto cleanupScript;
+		}
+		vid = vidOpt->count ? (uint16)vidOpt->ival[0] : VID;
+		pid = pidOpt->count ? (uint16)pidOpt->ival[0] : PID;
+		fStatus = devOpt->count ?
+			fx2OpenSessionPath(devOpt->sval[0], &session) :
+			fx2OpenSession(vid, pid, &session);
+		if ( fStatus ) {
+			fprintf(stderr, "%s", fx2StrError());
+			exitCode = 9;
+			goto cleanupScript;
+		}
+		exitCode = runScript(session, isStdin ? "<stdin>" : scriptName, &script);
+		fx2CloseSession(session);
+		goto cleanupScript;
+	}
+
+	if ( !reqOpt->count || !valOpt->count || !idxOpt->count || !lenOpt->count ) {
+		fprintf(stderr, "You must supply <bRequest> <wValue> <wIndex> <wLength>, or a script\n");
+		exitCode = 11;
+		goto cleanupArgtable;
+	}
+
 	if ( inOpt->count && outOpt->count ) {
 		fprintf(stderr, "You cannot supply both -i and -o\n");
 		exitCode = 3;
@@ -93,98 +525,158 @@ int main(int argc, char* argv[]) {
 	bRequest = (uint8)reqOpt->ival[0];
 	wValue = (uint16)valOpt->ival[0];
 	wIndex = (uint16)idxOpt->ival[0];
-	wLength = (uint16)lenOpt->ival[0];
+	length = lenOpt->ival[0];
 	vid = vidOpt->count ? (uint16)vidOpt->ival[0] : VID;
 	pid = pidOpt->count ? (uint16)pidOpt->ival[0] : PID;
 
-	if ( wLength > BUFFER_SIZE ) {
-		fprintf(stderr, "Cannot %s more than %d bytes\n", isOut?"write":"read", BUFFER_SIZE);
-		exitCode = 5;
-		goto cleanupArgtable;
-	}
-
-	if ( isOut ) {
-		if ( fileOpt->count ) {
-			// Read OUT data from specified file
-			//
-			size_t bytesRead;
-			FILE *inFile = fopen(fileOpt->filename[0], "rb");
-			if ( inFile == NULL ) {
-				fprintf(stderr, "Cannot open file %s\n", argv[6]);
-				exitCode = 6;
+	if ( monOpt->count ) {
+		// Monitor mode: one IN request, repeated on a fixed schedule
+		//
+		MonitorConfig monitor;
+		if (
+			isOut || chunkOpt->count || advOpt->count || length > BUFFER_SIZE ||
+			!monOpt->ival[0] || monOpt->ival[0] > MAX_MONITOR_RATE )
+		{
+			fprintf(
+				stderr, "The monitor needs -i, a rate from 1 to %d Hz and at most %d bytes per request\n",
+				MAX_MONITOR_RATE, BUFFER_SIZE);
+			exitCode = 11;
+			goto cleanupArgtable;
+		}
+		monitor.bRequest = bRequest;
+		monitor.wValue = wValue;
+		monitor.wIndex = wIndex;
+		monitor.wLength = (uint16)length;
+		monitor.rateHz = monOpt->ival[0];
+		monitor.count = countOpt->count ? countOpt->ival[0] : 0;
+		monitor.format = MONITOR_CSV;
+		if ( fmtOpt->count ) {
+			if ( !strcmp(fmtOpt->sval[0], "bin") ) {
+				monitor.format = MONITOR_BINARY;
+			} else if ( strcmp(fmtOpt->sval[0], "csv") ) {
+				fprintf(stderr, "Unrecognised record format: %s\n", fmtOpt->sval[0]);
+				exitCode = 11;
 				goto cleanupArgtable;
 			}
-			bytesRead = fread(buffer, 1, wLength, inFile);
-			fclose(inFile);
-			if ( bytesRead != wLength ) {
-				fprintf(stderr, "Whilst reading from \"%s\", expected 0x%04X bytes but got 0x%04X\n", argv[6], wLength, bytesRead);
-				exitCode = 7;
+		}
+		if ( fileOpt->count ) {
+			dataFile = fopen(fileOpt->filename[0], (monitor.format == MONITOR_BINARY) ? "wb" : "w");
+			if ( dataFile == NULL ) {
+				fprintf(stderr, "Cannot open file %s\n", fileOpt->filename[0]);
+				exitCode = 6;
 				goto cleanupArgtable;
 			}
 		} else {
-			// Read OUT data from stdin
-			//
-			uint32 bytesRead;
 			#ifdef WIN32
-				_setmode(_fileno(stdin), O_BINARY);
+				if ( monitor.format == MONITOR_BINARY ) {
+					_setmode(_fileno(stdout), O_BINARY);
+				}
 			#endif
-			bytesRead = fread(buffer, 1, wLength, stdin);
-			if ( bytesRead != wLength ) {
-				exitCode = 8;
-				goto cleanupArgtable;
-			}
+			dataFile = stdout;
 		}
-	} else {
-		if ( fileOpt->count ) {
-			// Write IN data to specified file
-			//
-			outFile = fopen(fileOpt->filename[0], "wb");
+		if ( cpuOpt->count && sysPinToCpu((int)cpuOpt->ival[0]) ) {
+			fprintf(stderr, "Warning: cannot pin to CPU %d\n", (int)cpuOpt->ival[0]);
+		}
+		if ( fifoOpt->count && sysSetRealtime() ) {
+			fprintf(stderr, "Warning: cannot switch to realtime priority\n");
+		}
+		fStatus = devOpt->count ?
+			fx2OpenSessionPath(devOpt->sval[0], &session) :
+			fx2OpenSession(vid, pid, &session);
+		if ( fStatus ) {
+			fprintf(stderr, "%s", fx2StrError());
+			exitCode = 9;
+			goto cleanupDataFile;
+		}
+		if ( monitorRun(session, &monitor, dataFile) ) {
+			exitCode = 14;
+		}
+		fx2CloseSession(session);
+		goto cleanupDataFile;
+	}
+
+	chunkSize = chunkOpt->count ? chunkOpt->ival[0] : BUFFER_SIZE;
+	if ( chunkSize == 0 || chunkSize > BUFFER_SIZE ) {
+		fprintf(stderr, "The chunk size must be between 1 and %d bytes\n", BUFFER_SIZE);
+		exitCode = 5;
+		goto cleanupArgtable;
+	}
+	if ( advOpt->count ) {
+		if ( !strcmp(advOpt->sval[0], "value") ) {
+			advance = ADVANCE_VALUE;
+		} else if ( !strcmp(advOpt->sval[0], "index") ) {
+			advance = ADVANCE_INDEX;
+		} else if ( !strcmp(advOpt->sval[0], "both") ) {
+			advance = ADVANCE_BOTH;
+		} else if ( !strcmp(advOpt->sval[0], "none") ) {
+			advance = ADVANCE_NONE;
 		} else {
-			// Write IN data to stdout
-			//
-			#ifdef WIN32
-				_setmode(_fileno(stdout), O_BINARY);
-			#endif
-			outFile = stdout;
+			fprintf(stderr, "Unrecognised address field: %s\n", advOpt->sval[0]);
+			exitCode = 5;
+			goto cleanupArgtable;
+		}
+	}
+	if ( length > chunkSize ) {
+		// The last chunk's address must still fit
+		//
+		const uint32 lastOffset = (length - 1) / chunkSize * chunkSize;
+		const unsigned long long lastAddress =
+			(advance == ADVANCE_VALUE) ? (unsigned long long)wValue + lastOffset :
+			(advance == ADVANCE_INDEX) ? (unsigned long long)wIndex + lastOffset :
+			(advance == ADVANCE_BOTH) ? (((unsigned long long)wIndex << 16) | wValue) + lastOffset : 0ULL;
+		if ( lastAddress > ((advance == ADVANCE_BOTH) ? 0xFFFFFFFFULL : 0xFFFFULL) ) {
+			fprintf(stderr, "Cannot %s 0x%lX bytes without the address overflowing\n", isOut?"write":"read", length);
+			exitCode = 5;
+			goto cleanupArgtable;
 		}
 	}
 
-	usbInitialise();
-	returnCode = usbOpenDevice(vid, pid, 1, 0, 0, &deviceHandle);
-	if ( returnCode ) {
-		fprintf(stderr, "usbOpenDevice() failed: %s\n", usbStrError());
-		exitCode = 9;
-		goto cleanupOutFile;
-	}
-	returnCode = usb_control_msg(
-		deviceHandle,
-		((isOut?USB_ENDPOINT_OUT:USB_ENDPOINT_IN) | USB_TYPE_VENDOR | USB_RECIP_DEVICE),
-		bRequest, wValue, wIndex, buffer, wLength, 5000
-	);
-	if ( isOut ) {
-		if ( returnCode != wLength ) {
-			fprintf(stderr, "Expected to write 0x%04X bytes but actually wrote 0x%04X: %s\n", wLength, returnCode, usb_strerror());
-			exitCode = 10;
-			goto cleanupUsb;
+	if ( fileOpt->count ) {
+		// Read OUT data from, or write IN data to, the specified file
+		//
+		dataFile = fopen(fileOpt->filename[0], isOut ? "rb" : "wb");
+		if ( dataFile == NULL ) {
+			fprintf(stderr, "Cannot open file %s\n", fileOpt->filename[0]);
+			exitCode = 6;
+			goto cleanupArgtable;
 		}
+	} else if ( isOut ) {
+		// Read OUT data from stdin
+		//
+		#ifdef WIN32
+			_setmode(_fileno(stdin), O_BINARY);
+		#endif
+		dataFile = stdin;
 	} else {
-		if ( returnCode < 0 ) {
-			fprintf(stderr, "usb_control_msg() failed returnCode %d: %s\n", returnCode, usb_strerror());
-			exitCode = 10;
-			goto cleanupUsb;
-		} else if ( returnCode > 0 ) {
-			fwrite(buffer, 1, returnCode, outFile);
-		}
+		// Write IN data to stdout
+		//
+		#ifdef WIN32
+			_setmode(_fileno(stdout), O_BINARY);
+		#endif
+		dataFile = stdout;
 	}
 
-cleanupUsb:
-	usb_release_interface(deviceHandle, 0);
-	usb_close(deviceHandle);
+	fStatus = devOpt->count ?
+		fx2OpenSessionPath(devOpt->sval[0], &session) :
+		fx2OpenSession(vid, pid, &session);
+	if ( fStatus ) {
+		fprintf(stderr, "%s", fx2StrError());
+		exitCode = 9;
+		goto cleanupDataFile;
+	}
+	exitCode = runChunked(
+		session, isOut, bRequest, wValue, wIndex, length, chunkSize, advance, dataFile,
+		fileOpt->count ? fileOpt->filename[0] : (isOut ? "stdin" : "stdout"));
+	fx2CloseSession(session);
 
-cleanupOutFile:
-	if ( outFile != NULL && outFile != stdout ) {
-		fclose(outFile);
+cleanupDataFile:
+	if ( dataFile != NULL && dataFile != stdout && dataFile != stdin ) {
+		fclose(dataFile);
 	}
+	goto cleanupArgtable;
+
+cleanupScript:
+	scriptDestroy(&script);
 cleanupArgtable:
 	arg_freetable(argTable, sizeof(argTable)/sizeof(argTable[0]));
 
@@ -0,0 +1,159 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <signal.h>
+#include "monitor.h"
+#include "usbwrap.h"
+#include "sys.h"
+
+#define MAX_DATA 4096
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onInterrupt(int sig) {
+	(void)sig;
+	stopRequested = 1;
+}
+
+// Wait until the supplied time: sleep for most of it, then spin for the rest.
+//
+static void waitUntil(long long deadline) {
+	long long remaining = deadline - sysTimeMicros();
+	if ( remaining > MONITOR_SPIN_MICROS ) {
+		sysSleepMicros((long)(remaining - MONITOR_SPIN_MICROS));
+	}
+	while ( sysTimeMicros() < deadline );
+}
+
+static void putLittleEndian(uint8 *ptr, unsigned long long value, uint32 numBytes) {
+	while ( numBytes-- ) {
+		*ptr++ = (uint8)value;
+		value >>= 8;
+	}
+}
+
+// Write one sample. A binary record is 20 bytes of little-endian header then wLength bytes of
+// data (zero-padded if the device sent less):
+//
+//   uint32 sequence number
+//   uint64 microseconds since the first deadline, taken when the response arrived
+//   uint32 round trip in microseconds
+//   uint16 deadlines missed just before this sample (saturating)
+//   int16  the transfer's return code (bytes received, or a negative libusb error)
+//
+static int writeRecord(
+	FILE *out, MonitorFormat format, uint32 sequence, long long timestamp, uint32 latency,
+	uint32 missed, int returnCode, const uint8 *data, uint16 wLength)
+{
+	int i;
+	if ( format == MONITOR_BINARY ) {
+		uint8 header[20];
+		putLittleEndian(header, sequence, 4);
+		putLittleEndian(header + 4, (unsigned long long)timestamp, 8);
+		putLittleEndian(header + 12, latency, 4);
+		putLittleEndian(header + 16, (missed > 0xFFFF) ? 0xFFFF : missed, 2);
+		putLittleEndian(header + 18, (uint16)(int16)returnCode, 2);
+		if ( fwrite(header, 1, 20, out) != 20 || fwrite(data, 1, wLength, out) != wLength ) {
+			return -1;
+		}
+	} else {
+		fprintf(out, "%lu,%lld,%lu,%lu,%d,", sequence, timestamp, latency, missed, returnCode);
+		for ( i = 0; i < returnCode; i++ ) {
+			fprintf(out, "%02X", data[i]);
+		}
+		if ( fputc('\n', out) == EOF ) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Issue the configured IN request once per period, on a fixed schedule, and write a timestamped
+// record for each response. Deadlines are absolute, and each is worked out from the start time
+// and its slot number rather than by adding up a rounded period, so one slow response doesn't
+// shift all the ones after it, and a rate which doesn't divide a second exactly doesn't drift. If
+// a response is so slow that whole periods have gone by, those deadlines are counted as missed
+// (and reported in the next record) rather than being made up in a burst. Runs for the configured
+// number of samples, or until interrupted (e.g Ctrl-C), then prints a summary on stderr. A failed
+// transfer is recorded, not fatal, since that may be the transient being looked for.
+//
+MonitorStatus monitorRun(FX2Session *session, const MonitorConfig *config, FILE *out) {
+	MonitorStatus status = MONITOR_SUCCESS;
+	uint8 data[MAX_DATA];
+	const long long rate = config->rateHz ? config->rateHz : 1;
+	long long start, deadline, slot = 0, before, after, maxLatency = 0;
+	uint32 sequence = 0, missed = 0, totalMissed = 0, numErrors = 0, i;
+	int returnCode;
+	void (*oldHandler)(int) = signal(SIGINT, onInterrupt);
+	if ( config->format == MONITOR_CSV ) {
+		fprintf(out, "sequence,time_us,latency_us,missed,status,data\n");
+	}
+	start = sysTimeMicros() + 1000000LL / rate;
+	deadline = start;
+	while ( !stopRequested && (!config->count || sequence < config->count) ) {
+		waitUntil(deadline);
+		for ( i = 0; i < config->wLength; i++ ) {
+			data[i] = 0x00;
+		}
+		before = sysTimeMicros();
+		returnCode = fx2SessionControl(
+			session, (USB_ENDPOINT_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE),
+			config->bRequest, config->wValue, config->wIndex, data, config->wLength, 1000
+		);
+		after = sysTimeMicros();
+		if ( returnCode < 0 ) {
+			numErrors++;
+		}
+		if ( after - before > maxLatency ) {
+			maxLatency = after - before;
+		}
+
+		if ( writeRecord(
+			out, config->format, sequence, after - start, (uint32)(after - before), missed,
+			returnCode, data, config->wLength) )
+		{
+			fprintf(stderr, "Cannot write monitor record\n");
+			status = MONITOR_FILE_ERR;
+			break;
+		}
+		sequence++;
+
+		// Skip any deadlines which have already gone by
+		//
+		missed = 0;
+		for ( ; ; ) {
+			slot++;
+			deadline = start + slot * 1000000LL / rate;
+			if ( deadline > sysTimeMicros() ) {
+				break;
+			}
+			missed++;
+		}
+		totalMissed += missed;
+	}
+	fflush(out);
+	signal(SIGINT, oldHandler);
+	after = sysTimeMicros();
+	fprintf(
+		stderr, "%lu samples in %.3f s (%.1f Hz, target %lu Hz): %lu missed deadlines, %lu failed transfers, max round trip %lld us\n",
+		sequence, (double)(after - start) / 1000000.0,
+		(after > start) ? (double)sequence * 1000000.0 / (double)(after - start) : 0.0,
+		config->rateHz, totalMissed, numErrors, maxLatency);
+	if ( status == MONITOR_SUCCESS && numErrors ) {
+		status = MONITOR_USBERR;
+	}
+	return status;
+}
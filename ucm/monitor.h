@@ -0,0 +1,66 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include <stdio.h>
+#include "types.h"
+#include "fx2loader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	typedef enum {
+		MONITOR_CSV,
+		MONITOR_BINARY
+	} MonitorFormat;
+
+	// The last this long of each wait is spent spinning on the clock rather than sleeping, since
+	// a sleep can overshoot by more than a whole period at kHz rates.
+	//
+	#define MONITOR_SPIN_MICROS 200
+
+	// Deadlines are kept to the microsecond, so that's as fine as the schedule can go.
+	//
+	#define MAX_MONITOR_RATE 1000000
+
+	// What to poll, how often, and where the records go. A count of zero means until interrupted.
+	//
+	typedef struct {
+		uint8 bRequest;
+		uint16 wValue;
+		uint16 wIndex;
+		uint16 wLength;
+		uint32 rateHz;
+		uint32 count;
+		MonitorFormat format;
+	} MonitorConfig;
+
+	typedef enum {
+		MONITOR_SUCCESS = 0,
+		MONITOR_USBERR,
+		MONITOR_FILE_ERR
+	} MonitorStatus;
+
+	MonitorStatus monitorRun(FX2Session *session, const MonitorConfig *config, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif